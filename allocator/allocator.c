@@ -0,0 +1,204 @@
+/*
+    Copyright (C) 2020 Duncan Watts
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 3 or later.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "allocator.h"
+
+#ifdef PERSISTENT_REFCOUNT
+/* the reference counted build doesn't link the collector */
+#define CHUNK_ALLOC(size) calloc(1, (size))
+#define CHUNK_FREE(ptr) free(ptr)
+#else
+#include <gc.h>
+/* uncollectable memory is scanned for pointers but
+   only released when it's freed */
+#define CHUNK_ALLOC(size) GC_MALLOC_UNCOLLECTABLE(size)
+#define CHUNK_FREE(ptr) GC_FREE(ptr)
+#endif
+
+/* chunks are this big unless an allocation needs more */
+#define REGION_CHUNK_SIZE (64 * 1024)
+
+/* allocations bigger than this get a chunk of their own
+   rather than leaving the rest of the current one unused */
+#define REGION_LARGE (REGION_CHUNK_SIZE / 4)
+
+#define REGION_ALIGN 16
+
+typedef struct Chunk {
+  struct Chunk *next;
+  size_t size;
+  _Alignas(REGION_ALIGN) char data[];
+} Chunk;
+
+struct Region {
+  Allocator alloc;
+
+  /* the region that was active when this one began */
+  Region *outer;
+
+  /* every chunk, newest first. allocations come from the
+     space between top and end in the newest */
+  Chunk *chunks;
+  char *top;
+  char *end;
+  size_t size;
+
+  /* taken while allocating as the workers building a map in parallel
+     share its allocator */
+  char lock;
+};
+
+static void *region_alloc(void *ctx, size_t size);
+
+static Chunk *region_chunk(Region *region, size_t size);
+
+static __thread Region *active_region;
+
+static void *malloc_alloc(void *ctx, size_t size)
+{
+  return calloc(1, size);
+}
+
+static void *malloc_alloc_atomic(void *ctx, size_t size)
+{
+  return malloc(size);
+}
+
+static void malloc_free(void *ctx, void *ptr)
+{
+  free(ptr);
+}
+
+Allocator allocator_malloc = {malloc_alloc, malloc_alloc_atomic, malloc_free, NULL};
+
+#ifdef PERSISTENT_REFCOUNT
+
+#define DEFAULT_ALLOCATOR allocator_malloc
+
+#else
+
+static void *gc_alloc(void *ctx, size_t size)
+{
+  return GC_MALLOC(size);
+}
+
+static void *gc_alloc_atomic(void *ctx, size_t size)
+{
+  return GC_MALLOC_ATOMIC(size);
+}
+
+/* the collector finds unused memory by itself */
+Allocator allocator_gc = {gc_alloc, gc_alloc_atomic, NULL, NULL};
+
+#define DEFAULT_ALLOCATOR allocator_gc
+
+#endif
+
+static Allocator *default_allocator = &DEFAULT_ALLOCATOR;
+
+Allocator *allocator_default(void)
+{
+  return active_region ? &active_region->alloc : default_allocator;
+}
+
+void allocator_set_default(Allocator *alloc)
+{
+  default_allocator = alloc ? alloc : &DEFAULT_ALLOCATOR;
+}
+
+Region *region_begin(void)
+{
+  Region *region = CHUNK_ALLOC(sizeof(*region));
+  assert(region);
+
+  /* the chunks are zeroed when they're allocated and never reused
+     so there is no need to clear anything and nothing to free */
+  region->alloc.alloc = region_alloc;
+  region->alloc.alloc_atomic = NULL;
+  region->alloc.free = NULL;
+  region->alloc.ctx = region;
+
+  region->outer = active_region;
+  active_region = region;
+
+  return region;
+}
+
+void region_end(Region *region)
+{
+  assert(region == active_region);
+  active_region = region->outer;
+
+  Chunk *chunk = region->chunks;
+  while (chunk) {
+    Chunk *next = chunk->next;
+    CHUNK_FREE(chunk);
+    chunk = next;
+  }
+  CHUNK_FREE(region);
+}
+
+Allocator *region_allocator(Region *region)
+{
+  return &region->alloc;
+}
+
+size_t region_size(Region *region)
+{
+  return region->size;
+}
+
+static void *region_alloc(void *ctx, size_t size)
+{
+  Region *region = ctx;
+  size = (size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+
+  while (__atomic_test_and_set(&region->lock, __ATOMIC_ACQUIRE)) {}
+  region->size += size;
+
+  void *ptr;
+  if (size > REGION_LARGE) {
+    ptr = region_chunk(region, size)->data;
+  }
+  else {
+    if (size > (size_t)(region->end - region->top)) {
+
+      Chunk *chunk = region_chunk(region, REGION_CHUNK_SIZE);
+      region->top = chunk->data;
+      region->end = chunk->data + REGION_CHUNK_SIZE;
+    }
+    ptr = region->top;
+    region->top += size;
+  }
+
+  __atomic_clear(&region->lock, __ATOMIC_RELEASE);
+  return ptr;
+}
+
+static Chunk *region_chunk(Region *region, size_t size)
+{
+  Chunk *chunk = CHUNK_ALLOC(sizeof(*chunk) + size);
+  assert(chunk);
+
+  chunk->size = size;
+  chunk->next = region->chunks;
+  region->chunks = chunk;
+
+  return chunk;
+}
@@ -0,0 +1,112 @@
+/*
+    Copyright (C) 2020 Duncan Watts
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 3 or later.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PERSISTENT_ALLOCATOR_H
+#define _PERSISTENT_ALLOCATOR_H
+
+#include <stddef.h>
+
+/*
+   the collections get all their memory from an Allocator. maps and vectors
+   made with one keep using it for every version made from them. the rest
+   use the default, which is the Boehm collector unless it is changed. built
+   with PERSISTENT_REFCOUNT the collector isn't used and the default is
+   allocator_malloc
+*/
+
+/* alloc returns zeroed memory that may hold pointers. alloc_atomic returns
+   memory that will never hold pointers and needn't be zeroed (NULL to use
+   alloc). free (NULL if not needed) is given the temporary memory that the
+   collections are finished with. nodes are never freed individually as any
+   number of versions may share them, except by Hashmaps and Vectors in the
+   reference counted build, so otherwise an allocator without a collector
+   needs to release them all at once, like an arena. memory not from the
+   collector isn't scanned by it, so anything only referenced from there
+   must be kept alive some other way */
+typedef struct Allocator {
+  void *(*alloc)(void *ctx, size_t size);
+  void *(*alloc_atomic)(void *ctx, size_t size);
+  void (*free)(void *ctx, void *ptr);
+
+  /* passed to each of the functions */
+  void *ctx;
+} Allocator;
+
+#ifndef PERSISTENT_REFCOUNT
+/* allocates from the Boehm collector. free does nothing */
+extern Allocator allocator_gc;
+#endif
+
+/* allocates with calloc, malloc and free */
+extern Allocator allocator_malloc;
+
+/* returns the allocator for collections made without one */
+Allocator *allocator_default(void);
+
+/* sets the allocator for collections made without one from now on.
+   NULL restores the original. collections already made are unaffected */
+void allocator_set_default(Allocator *alloc);
+
+/*
+   a Region hands out memory by bumping a pointer through large chunks and
+   releases it all at once when it ends, so collections that only live for
+   a while, e.g. for one request, never have to be found by the collector.
+   while a region is active it is the default allocator on the thread that
+   began it, so every collection made there, and every version made from
+   those, is allocated from it. versions made there from a collection made
+   outside it use that collection's allocator instead, as every version
+   does, so a region can't hold memory that outlives it. copy such a
+   collection in with hashmap_promote or vector_promote to keep its
+   versions in the region. anything that has to outlive the region is
+   copied out with hashmap_promote or vector_promote before it ends. the
+   chunks are scanned by the collector so keys and values that are only
+   referenced from a region are kept alive while it lasts. in the reference
+   counted build a region is where lists and intmaps, which aren't
+   counted, can be released from
+*/
+typedef struct Region Region;
+
+/* begins a new region and makes it the default allocator on this thread
+   until it ends. regions nest */
+Region *region_begin(void);
+
+/* ends region, which must be the innermost one active on this thread, and
+   releases all the memory allocated from it. nothing made from it can be
+   used afterwards */
+void region_end(Region *region);
+
+/* returns the allocator handing out region's memory */
+Allocator *region_allocator(Region *region);
+
+/* returns the number of bytes allocated from region */
+size_t region_size(Region *region);
+
+static inline void *allocator_alloc(Allocator *alloc, size_t size)
+{
+  return alloc->alloc(alloc->ctx, size);
+}
+
+static inline void *allocator_alloc_atomic(Allocator *alloc, size_t size)
+{
+  if (!alloc->alloc_atomic) { return alloc->alloc(alloc->ctx, size); }
+  return alloc->alloc_atomic(alloc->ctx, size);
+}
+
+static inline void allocator_free(Allocator *alloc, void *ptr)
+{
+  if (alloc->free) { alloc->free(alloc->ctx, ptr); }
+}
+#endif
@@ -17,8 +17,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifndef PERSISTENT_REFCOUNT
+/* threads used by hashmap_visit_parallel must be registered with the collector */
+#define GC_THREADS
 #include <gc.h>
+#endif
+#include <pthread.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "hashmap.h"
 
@@ -41,23 +51,18 @@
    http://blog.higher-order.net/2009/09/08/understanding-clojures-persistenthashmap-deftwice
 */
 
+/*
+   the nodes use the CHAMP layout described in "Optimizing Hash-Array
+   Mapped Tries for Fast and Lean Immutable JVM Collections"
+   (Steindorfer and Vinju, OOPSLA 2015)
+*/
+
 /* Implementation details */
-typedef struct NodeType NodeType;
 typedef struct Node Node;
-typedef struct LeafNode LeafNode;
+typedef struct Entry Entry;
 typedef struct BitmapIndexedNode BitmapIndexedNode;
 typedef struct HashCollisionNode HashCollisionNode;
-
-typedef void *(*get_fn)(Node *self, int level, void *key, \
-			hash_t hash, equal_fn eq_key, equal_fn eq_val);
-
-typedef Node *(*assoc_fn)(Node *self, int level, void *key, void *val, \
-			  hash_t hash, equal_fn eq_key, equal_fn eq_val, int *result);
-
-typedef Node *(*dissoc_fn)(Node *self, int level, void *key, hash_t hash, \
-			   equal_fn eq_key, equal_fn eq_val, int *result);
-
-typedef void (*visitor_fn)(Node *self, visit_fn fn, void **acc);
+typedef struct Image Image;
 
 /* hashmap links to nodes and holds functions for
    operating on otherwise generic keys and vals */
@@ -66,117 +71,411 @@ struct Hashmap {
   equal_fn eq_key;
   equal_fn eq_val;
   int count;
+#ifdef PERSISTENT_REFCOUNT
+  /* the number of references to the map, next to count to fill the padding */
+  unsigned int refs;
+#endif
   Node* root;
-};
 
-/* polymorphic dispatch through the common NodeType */
-struct NodeType {
-  get_fn get;
-  assoc_fn assoc;
-  dissoc_fn dissoc;
-  visitor_fn visitor;
+  /* edit token - only set while the map is transient */
+  void *edit;
+
+  /* the mapped file of a map from hashmap_open_mmap, which has no root */
+  Image *image;
+
+  /* where the map and its nodes are allocated from */
+  Allocator *alloc;
 };
 
-/* generic node */
+/* the kind of node is held in a tag so that walking the trie
+   is a loop rather than a chain of indirect calls */
+typedef enum {
+  BITMAP_INDEXED,
+  HASH_COLLISION
+} NodeTag;
+
+/* generic node. in the reference counted build every kind of node
+   has the number of references to it straight after the tag */
 struct Node {
-  NodeType *type;
+  NodeTag tag;
+#ifdef PERSISTENT_REFCOUNT
+  unsigned int refs;
+#endif
 };
 
-/* holds a key/value pair */
-struct LeafNode {
-  NodeType *type;
+/* a key/value pair stored inline in a BitmapIndexedNode */
+struct Entry {
   void *key;
   void *val;
   hash_t hash;
 };
 
-/* a linked list of nodes with the same hash */
-struct HashCollisionNode {
-  NodeType *type;
+/* a key/value pair in a HashCollisionNode */
+typedef struct Pair {
   void *key;
   void *val;
-  hash_t hash;
+} Pair;
 
-  HashCollisionNode *next;
+/* the keys sharing a whole hash. array holds their pairs
+   and is allocated with the node */
+struct HashCollisionNode {
+  NodeTag tag;
+#ifdef PERSISTENT_REFCOUNT
+  unsigned int refs;
+#endif
+  hash_t hash;
+  int count;
+  Pair array[];
 };
 
-/* a dynamically sized array of up to 32 child nodes */
+/* each of the 32 positions holds either an inline entry (set in datamap)
+   or a sub-node (set in nodemap). array holds the entries followed by
+   the sub-nodes, both in bit order, and is allocated with the node */
 struct BitmapIndexedNode {
-  NodeType *type;
-  int bitmap;
-  Node **children;
+  NodeTag tag;
+#ifdef PERSISTENT_REFCOUNT
+  unsigned int refs;
+#endif
+  unsigned int datamap;
+  unsigned int nodemap;
+  void *edit;
+  void *array[];
 };
 
-/* basic list structure for implementing an iterator */
-typedef struct list {
-  void *data;
-  struct list *next;
-} list;
+/* a position in the trie: the next entry or sub-node of a
+   BitmapIndexedNode or the next pair in a HashCollisionNode */
+typedef struct Frame {
+  Node *node;
+  int idx;
+} Frame;
+
+/* an iterator walks the trie lazily keeping a stack of positions
+   from the root down to the current entry */
+typedef struct Cursor {
+  void *key;
+  void *val;
+  Image *image;
+  int depth;
+  Frame stack[];
+} Cursor;
+
+/* the contents of one position of a BitmapIndexedNode while merging:
+   an inline entry, a sub-node or neither */
+typedef struct Slot {
+  Entry *entry;
+  Node *node;
+} Slot;
+
+/* the sub-tries shared out between the threads of hashmap_visit_parallel.
+   next is the index of the first one not yet taken */
+typedef struct VisitTasks {
+  Node **nodes;
+  int count;
+  int next;
+  visit_fn fn;
+} VisitTasks;
+
+/* a thread visiting sub-tries into its own accumulator */
+typedef struct VisitWorker {
+  VisitTasks *tasks;
+  void *acc;
+} VisitWorker;
+
+/* the shared state of hashmap_from_arrays_parallel. the input is
+   partitioned by position at the root and each position's sub-node
+   is built separately */
+typedef struct BuildTasks {
+  Allocator *alloc;
+  hash_fn hash;
+  equal_fn eq_key;
+  void **keys;
+  void **vals;
+  Entry *entries;
+  Entry *scratch;
+
+  /* where the entries for each position start and how many there are */
+  int starts[32];
+  int sizes[32];
+
+  /* the sub-node built for each position, or NULL with the single
+     entry left, and the number of distinct keys */
+  Node *children[32];
+  Entry inline_entries[32];
+  int counts[32];
+
+  /* the next position to be built */
+  int next;
+} BuildTasks;
+
+/* a thread working on a slice of the input. offsets holds the number of its
+   entries for each position and then where the next one is copied to */
+typedef struct BuildWorker {
+  BuildTasks *tasks;
+  int start;
+  int end;
+  int offsets[32];
+} BuildWorker;
+
+/* a read-modify-write passed down to assoc in place of a value. remove is
+   set if fn asks for a key that is in the map to be removed */
+typedef struct Update {
+  update_fn fn;
+  void *ctx;
+  int remove;
+} Update;
+
+/* the callbacks for reporting the differences between two maps */
+typedef struct Diff {
+  Allocator *alloc;
+  equal_fn eq_key;
+  equal_fn eq_val;
+  visit_fn on_added;
+  visit_fn on_removed;
+  change_fn on_changed;
+  void **acc;
+} Diff;
+
+/*
+   a serialized map is an ImageHeader, then the encoded keys and values and
+   the nodes, then an ImageVersion for each map written and an ImageTrailer.
+   each node comes after everything it refers to and links are offsets from
+   the start of the image, so versions of a map can share nodes, keys and
+   values just as they do in memory. every part is a multiple of 8 bytes so
+   the fields are aligned when it is mapped
+*/
+#define IMAGE_MAGIC "PHASHMAP"
+#define IMAGE_VERSION 1
+
+/* marks the offsets of keys and values among the heights of checked nodes */
+#define IMAGE_ENCODED UINTPTR_MAX
+
+typedef struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t hash_size;
+} ImageHeader;
+
+/* root is 0 for an empty map */
+typedef struct ImageVersion {
+  uint64_t count;
+  uint64_t root;
+} ImageVersion;
+
+typedef struct ImageTrailer {
+  uint64_t versions;
+} ImageTrailer;
+
+/* a BitmapIndexedNode is followed by its ImageEntries and then the offsets
+   of its sub-nodes. a HashCollisionNode is followed by count ImagePairs */
+typedef struct ImageNode {
+  uint32_t tag;
+  uint32_t count;
+  uint32_t datamap;
+  uint32_t nodemap;
+  uint64_t hash;
+} ImageNode;
+
+typedef struct ImageEntry {
+  uint64_t hash;
+  uint64_t key;
+  uint64_t val;
+} ImageEntry;
+
+typedef struct ImagePair {
+  uint64_t key;
+  uint64_t val;
+} ImagePair;
+
+/* each key and value is its uint64_t size followed by the encoded bytes */
+
+/* a mapped image and how to decode its keys and values */
+struct Image {
+  const char *base;
+  size_t size;
+  uint64_t root;
+  HashmapCodec key_codec;
+  HashmapCodec val_codec;
+};
+
+/* maps the addresses of nodes, keys and values to their offsets while an
+   image is written, and offsets back to the loaded objects while one is
+   read. open addressing with linear probing and 0 marks an empty slot */
+typedef struct IdentityTable {
+  Allocator *alloc;
+  uintptr_t *keys;
+  uintptr_t *vals;
+  size_t capacity;
+  size_t count;
+} IdentityTable;
+
+/* the bytes buffered before each write to the file */
+#define WRITE_BUFFER_SIZE 65536
+
+/* images are written through a buffer. offset is the number of bytes
+   written so far including those still in the buffer. the tables hold
+   what has already been written so it is written only once */
+typedef struct Writer {
+  Allocator *alloc;
+  int fd;
+  int failed;
+  uint64_t offset;
+  size_t used;
+  IdentityTable *nodes;
+  IdentityTable *keys;
+  IdentityTable *vals;
+  char buf[WRITE_BUFFER_SIZE];
+} Writer;
+
+/* the array of maps returned by hashmap_load_versions follows one of these,
+   which keeps the buffer that keys and values are decoded in place in */
+typedef struct LoadedVersions {
+  Allocator *alloc;
+  char *base;
+} LoadedVersions;
+
+/* the state of hashmap_load_versions. the tables hold the nodes, keys and
+   values already made from each offset so that shared parts stay shared */
+typedef struct Loader {
+  Allocator *alloc;
+  Image image;
+  IdentityTable nodes;
+  IdentityTable keys;
+  IdentityTable vals;
+} Loader;
 
 /* forward references */
 static hash_t hash_str(void *obj);
 
 static int equal_str(void *obj1, void *obj2);
 
-static LeafNode *new_leaf_node(void *key, void *val, hash_t hash);
+static HashCollisionNode *new_hash_collision_node(Allocator *alloc, hash_t hash, int count);
 
-static HashCollisionNode *new_hash_collision_node(void *key, void* val, hash_t hash);
+static BitmapIndexedNode *new_bitmap_indexed_node(Allocator *alloc, void *edit, \
+                                                  unsigned int datamap, unsigned int nodemap);
 
-static BitmapIndexedNode *new_bitmap_indexed_node();
+static Hashmap *copy_hashmap(Hashmap *map);
 
-static BitmapIndexedNode *copy_bitmap_indexed_node(BitmapIndexedNode *node);
+static void *owned_edit(Hashmap *map);
 
-static Hashmap *copy_hashmap(Hashmap *map);
+static Hashmap *with_root(Hashmap *map, Node *root, int count);
 
-static void *leaf_get(Node *self, int level, void *key,                 \
-                      hash_t hash, equal_fn eq_key, equal_fn eq_val);
+static void set_root(Hashmap *map, Node *root);
 
-static void *bitmap_indexed_get(Node *self, int level, void *key, \
-                                hash_t hash, equal_fn eq_key, equal_fn eq_val);
+static Node *promote_node(Allocator *alloc, Node *node);
 
-static void *hash_collision_get(Node *self, int level, void *key,	\
-                                hash_t hash, equal_fn eq_key, equal_fn eq_val);
+static Node *root_assoc(Hashmap *map, void *edit, void *key, void *val, \
+                        hash_t hash, Update *update, int *result);
 
-static Node *leaf_assoc(Node *self, int level, void *key, void *val, \
-                        hash_t hash, equal_fn eq_key, equal_fn eq_val, int *result);
+static Node *root_dissoc(Hashmap *map, void *edit, void *key, hash_t hash, int *result);
 
-static Node *bitmap_indexed_assoc(Node *self, int level, void *key, void *val, \
-                                  hash_t hash, equal_fn eq_key, equal_fn eq_val, int *result);
+static Node *build_node(Allocator *alloc, Entry *entries, Entry *scratch, int n, int level, \
+                        equal_fn eq_key, Entry *entry, int *count);
 
-static Node *hash_collision_assoc(Node *self, int level, void *key, void *val, \
-                                  hash_t hash, equal_fn eq_key, equal_fn eq_val, int *result);
+static void *hash_collision_get(HashCollisionNode *node, void *key, hash_t hash, \
+                                equal_fn eq_key);
 
-static Node *leaf_dissoc(Node *self, int level, void *key, hash_t hash, \
-                         equal_fn eq_key, equal_fn eq_val, int *result);
+static void **node_find(Node *node, void *key, hash_t hash, equal_fn eq_key);
 
-static Node *bitmap_indexed_dissoc(Node *self, int level, void *key, hash_t hash, \
-                                   equal_fn eq_key, equal_fn eq_val, int *result);
+static void *node_get(Node *node, void *key, hash_t hash, equal_fn eq_key);
 
-static Node *hash_collision_dissoc(Node *self, int level, void *key, hash_t hash, \
-                                   equal_fn eq_key, equal_fn eq_val, int *result);
+static Node *node_assoc(Allocator *alloc, Node *root, void *edit, void *key, void *val, \
+                        hash_t hash, equal_fn eq_key, equal_fn eq_val, Update *update, \
+                        int *result);
 
-static void leaf_visit(Node *self, visit_fn fn, void **acc);
+static Node *node_dissoc(Allocator *alloc, Node *root, void *edit, void *key, hash_t hash, \
+                         equal_fn eq_key, int *result);
 
-static void bitmap_indexed_visit(Node *self, visit_fn fn, void **acc);
+static Node *merge_positions(Allocator *alloc, Allocator *alloc_b, Slot a, Slot b, int level, \
+                             equal_fn eq_key, equal_fn eq_val, merge_fn resolve, int *added);
 
-static void hash_collision_visit(Node *self, visit_fn fn, void **acc);
+static int node_equal(Node *a, Node *b, equal_fn eq_key, equal_fn eq_val);
 
-static void iterator_visit(void *key, void *val, void **acc);
+static int node_contains(Node *node, Hashmap *map, equal_fn eq_val);
 
-static Iterator *hashmap_next_fn(Iterator *iter);
+static void diff_slots(Slot old, Slot new, int level, Diff *diff);
+
+static void node_visit(Node *node, visit_fn fn, void **acc);
+
+static void *node_reduce(Node *node, reduce_kv_fn fn, void *acc, int *reduced);
+
+static void node_stats(Node *node, int depth, HashmapStats *stats);
+
+static size_t node_bytes(Node *node);
+
+static size_t subtrie_bytes(Node *node);
+
+static size_t shared_bytes(Node *a, Node *b, int level);
+
+static void *visit_worker(void *arg);
+
+static void run_workers(Allocator *alloc, void *(*fn)(void *), void *workers, size_t size, \
+                        int n);
+
+static void *build_hash_worker(void *arg);
+
+static void *build_scatter_worker(void *arg);
+
+static void *build_child_worker(void *arg);
+
+static int cursor_advance(Cursor *cursor);
+
+static void write_bytes(Writer *writer, const void *data, size_t size);
+
+static void write_flush(Writer *writer);
+
+static uint64_t write_encoded(Writer *writer, HashmapCodec *codec, IdentityTable *table, \
+                              void *obj);
+
+static uint64_t write_node(Writer *writer, Node *node, HashmapCodec *key_codec, \
+                           HashmapCodec *val_codec);
+
+static void identity_init(IdentityTable *table, Allocator *alloc, size_t capacity);
+
+static void identity_free(IdentityTable *table);
+
+static uintptr_t identity_get(IdentityTable *table, uintptr_t key);
+
+static void identity_put(IdentityTable *table, uintptr_t key, uintptr_t val);
+
+static char *read_all(int fd, Allocator *alloc, size_t *size);
+
+static const ImageVersion *image_versions(const char *base, size_t size, uint64_t *n);
+
+static int image_check(Image *image, IdentityTable *checked, uint64_t root, uint64_t limit);
+
+static int image_check_node(Image *image, IdentityTable *checked, uint64_t offset, \
+                            uint64_t limit, int depth);
+
+static int image_check_encoded(Image *image, IdentityTable *checked, uint64_t offset, \
+                               uint64_t limit);
+
+static int image_check_hash(Image *image, uint64_t root, hash_fn hash);
+
+static void *load_encoded(Loader *loader, IdentityTable *table, HashmapCodec *codec, \
+                          uint64_t offset);
+
+static Node *load_node(Loader *loader, uint64_t offset);
+
+static void *image_get(Hashmap *map, void *key, hash_t hash);
+
+static void image_visit(Image *image, uint64_t offset, visit_fn fn, void **acc);
+
+static void *image_reduce(Image *image, uint64_t offset, reduce_kv_fn fn, void *acc, \
+                          int *reduced);
+
+static int image_cursor_advance(Cursor *cursor);
 
-/* constant NodeTypes */
+static Iterator *hashmap_next_fn(Iterator *iter);
 
-/* Leaf nodes store key/value pairs */
-NodeType NT_LEAF = {leaf_get, leaf_assoc, leaf_dissoc, leaf_visit};
+static Cursor *iter_cursor(Iterator *iter);
 
-/* Bitmap indexed nodes hold pointers to up to 32 sub-nodes */
-NodeType NT_BITMAP_INDEXED = {bitmap_indexed_get, bitmap_indexed_assoc, \
-                              bitmap_indexed_dissoc, bitmap_indexed_visit};
+/* the deepest a trie can be: one level for every BITS_PER_LEVEL
+   bits of the hash plus one for a HashCollisionNode */
+#define MAX_DEPTH (((sizeof(hash_t) * 8) + BITS_PER_LEVEL - 1) / BITS_PER_LEVEL + 1)
 
-/* Hash collision nodes replace leaf nodes when there is a collision */
-NodeType NT_HASH_COLLISION = {hash_collision_get, hash_collision_assoc, \
-                              hash_collision_dissoc, hash_collision_visit};
+/* the number of sub-tries per thread that hashmap_visit_parallel aims
+   for so that threads finishing early can take on more of the work */
+#define TASKS_PER_THREAD 4
 
 /* count 1's in x efficiently */
 #define popcount(x) __builtin_popcount(x)
@@ -197,688 +496,3281 @@ static int mask(hash_t hash, int level)
 }
 
 /* map a hash code [0-31] to a bit in the bitmap 2^[0-31] */
-static int bitpos(hash_t hash, int level)
+static unsigned int bitpos(hash_t hash, int level)
 {
-  return 1 << mask(hash, level);
+  return 1u << mask(hash, level);
 }
 
 /* return the number of 1's in bitmap less than bit */
-static int bit_index(int bitmap, int bit)
+static int bit_index(unsigned int bitmap, unsigned int bit)
 {
   return popcount(bitmap & (bit - 1));
 }
 
-/* external interface */
-Hashmap *hashmap_make(hash_fn hash, equal_fn eq_keys, equal_fn eq_vals)
+#ifdef PERSISTENT_REFCOUNT
+/* a node can be updated in place when the edit token is passed down to
+   it, which only happens while it and every node above it has a single
+   owner. the token left in the node doesn't matter: a transient holds its
+   own reference to the root it shares with the version it came from, so
+   its first change copies the root and the copy's references make every
+   node below it shared in turn. nothing a retained version can reach is
+   ever reached with the token, whoever created it */
+static int editable(void *node_edit, void *edit)
 {
-  Hashmap *map = GC_MALLOC(sizeof(*map));
-
-  map->count = 0;
-  map->root = NULL;
-
-  map->hash = hash ? hash : hash_str;
-  map->eq_key = eq_keys ? eq_keys : equal_str;
-  map->eq_val = eq_vals ? eq_vals : equal_str;
-
-  return map;
+  return (edit != NULL);
 }
-
-Hashmap *hashmap_assoc(Hashmap* map, void *key, void *val)
+#else
+/* a node can be updated in place if it was created by the
+   transient currently holding the edit token */
+static int editable(void *node_edit, void *edit)
 {
-  /* result is a boolean that indicates if the map changed during the operation */
-  int result = UNCHANGED;
-  Node *root = NULL;
-
-  /* if there are no entries create a leaf node */
-  if (!map->root) {
-
-    LeafNode* leaf = new_leaf_node(key, val, map->hash(key));
-    result = ADDED;
-    root = (Node*)leaf;
-  }
-  /* otherwise call assoc on the root node */
-  else {
-      root = (map->root)->type->assoc(map->root, 0, key, val, map->hash(key), \
-                                      map->eq_key, map->eq_val, &result);
-  }
-  /* if there was a change create a new hashmap */
-  if (result != UNCHANGED) {
-
-    Hashmap *new = copy_hashmap(map);
-    new->root = root;
-    new->count += (result == ADDED) ? 1 : 0;
-
-    return new;
-  }
-  /* no change */
-  return map;
+  return (edit && node_edit == edit);
 }
+#endif
 
-Hashmap *hashmap_dissoc(Hashmap *map, void *key)
+/* the inline entries of a BitmapIndexedNode */
+static Entry *node_entries(BitmapIndexedNode *node)
 {
-  /* result is a boolean that indicates if the map changed during the operation */
-  int result = UNCHANGED;
-
-  /* if there are no entries there's nothing to dissoc */
-  if (!map->root) { return map; }
-
-  /* otherwise call dissoc on the root node */
-  Node *root = (map->root)->type->dissoc(map->root, 0, key, map->hash(key), \
-                                         map->eq_key, map->eq_val, &result);
-
-  /* if there was a change create a new hashmap */
-  if (result != UNCHANGED) {
-
-    Hashmap *new = copy_hashmap(map);
-    new->root = root;
-    new->count -= (result == REMOVED) ? 1 : 0;
-
-    return new;
-  }
-  /* no change */
-  return map;
+  return (Entry*)node->array;
 }
 
-void *hashmap_get(Hashmap *map, void *key)
+/* the sub-nodes of a BitmapIndexedNode follow the entries */
+static Node **node_children(BitmapIndexedNode *node)
 {
-  if (!map->root) { return NULL; }
-  return (map->root)->type->get(map->root, 0, key, map->hash(key), \
-                                map->eq_key, map->eq_val);
+  return (Node**)(node_entries(node) + popcount(node->datamap));
 }
 
-int hashmap_count(Hashmap *map)
-{
-  return map->count;
-}
+#ifdef PERSISTENT_REFCOUNT
 
-int hashmap_empty(Hashmap *map)
+/* passed as the edit token by the persistent operations on a map with a
+   single owner and held by transients. any token will do as a transient
+   is the only owner of the nodes it makes */
+static char owned_token;
+#define OWNED ((void *)&owned_token)
+
+/* a node with more than one owner is part of other versions or sub-tries
+   so nothing below it can be changed in place */
+static inline int node_shared(Node *node)
 {
-  return (map->count == 0);
+  return __atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) > 1;
 }
 
-void hashmap_visit(Hashmap *map, visit_fn fn, void** acc)
+static inline Node *node_retain(Node *node)
 {
-  if (!map->root) { return; }
-  (map->root)->type->visitor(map->root, fn, acc);
+  __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+  return node;
 }
 
-Iterator *hashmap_iterator_make(Hashmap *map)
+/* drop a reference to node, freeing it along with its
+   references to its sub-nodes if it was the last */
+static void node_release(Allocator *alloc, Node *node)
 {
-  assert(map);
+  if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
 
-  /* empty hashmap returns a NULL iterator */
-  if (hashmap_empty(map)) { return NULL; }
+  if (node->tag == BITMAP_INDEXED) {
 
-  /* create an iterator */
-  Iterator *iter = GC_MALLOC(sizeof(*iter));
+    BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+    Node **children = node_children(bitmap);
 
-  /* install the next function for a hashmap */
-  iter->next_fn = hashmap_next_fn;
+    for (int i = 0; i < popcount(bitmap->nodemap); i++) {
+      node_release(alloc, children[i]);
+    }
+  }
+  allocator_free(alloc, node);
+}
 
-  /* create a list of key/val pairs */
-  list *lst = NULL;
-  hashmap_visit(map, iterator_visit, (void **)&lst);
+#else
 
-  /* set the entry for the current element */
-  iter->current = lst;
-  iter->value = lst->data;
+/* without reference counts only the edit token of a transient decides
+   what can be changed in place and the collector frees the nodes */
+static inline int node_shared(Node *node) { return 0; }
 
-  return iter;
-}
+static inline Node *node_retain(Node *node) { return node; }
 
-/* internal implementation */
+static inline void node_release(Allocator *alloc, Node *node) {}
 
-static LeafNode *new_leaf_node(void *key, void *val, hash_t hash)
-{
-  LeafNode *node = GC_MALLOC(sizeof(*node));
-  node->type = &NT_LEAF;
-  node->key = key;
-  node->val = val;
-  node->hash = hash;
+#endif
 
-  return node;
+/* the n sub-nodes copied from children to a new node are shared with it */
+static inline void retain_children(Node **children, int n)
+{
+  for (int i = 0; i < n; i++) { node_retain(children[i]); }
 }
 
-static BitmapIndexedNode *new_bitmap_indexed_node()
-{
-  BitmapIndexedNode *node = GC_MALLOC(sizeof(*node));
-  node->type = &NT_BITMAP_INDEXED;
-  node->bitmap = 0;
+/* external interface */
 
-  return node;
-}
+/* the address of a private object can't be a value stored by the caller */
+static char not_found;
+void *const HASHMAP_NOT_FOUND = &not_found;
 
-static HashCollisionNode *new_hash_collision_node(void *key, void* val, hash_t hash)
+Hashmap *hashmap_make(hash_fn hash, equal_fn eq_keys, equal_fn eq_vals)
 {
-  HashCollisionNode *node = GC_MALLOC(sizeof(*node));
-  node->type = &NT_HASH_COLLISION;
-  node->key = key;
-  node->val = val;
-  node->hash = hash;
-
-  node->next = NULL;
-  return node;
+  return hashmap_make_with_allocator(hash, eq_keys, eq_vals, allocator_default());
 }
 
-static Hashmap *copy_hashmap(Hashmap *map)
+Hashmap *hashmap_make_with_allocator(hash_fn hash, equal_fn eq_keys, equal_fn eq_vals, \
+                                     Allocator *alloc)
 {
-  Hashmap *new = GC_MALLOC(sizeof(*new));
-  memcpy(new, map, sizeof(*new));
+  Hashmap *map = allocator_alloc(alloc, sizeof(*map));
 
-  return new;
-}
+  map->alloc = alloc;
+  map->count = 0;
+  map->root = NULL;
+  map->edit = NULL;
+  map->image = NULL;
+#ifdef PERSISTENT_REFCOUNT
+  map->refs = 1;
+#endif
 
-static BitmapIndexedNode *copy_bitmap_indexed_node(BitmapIndexedNode *node)
-{
-  BitmapIndexedNode *copy = GC_MALLOC(sizeof(*copy));
-  memcpy(copy, node, sizeof(*copy));
-  return copy;
+  map->hash = hash ? hash : hash_str;
+  map->eq_key = eq_keys ? eq_keys : equal_str;
+  map->eq_val = eq_vals ? eq_vals : equal_str;
+
+  return map;
 }
 
-static void *leaf_get(Node *self, int level, void *key, hash_t hash, \
-                      equal_fn eq_key, equal_fn eq_val)
+Hashmap *hashmap_from_arrays(hash_fn hash, equal_fn eq_keys, equal_fn eq_vals, \
+                             void **keys, void **vals, int n)
 {
-
-  LeafNode* node = (LeafNode*)self;
-
-  /* if found - return the value */
-  if (eq_key(node->key, key)) {
-    return node->val;
-  } else {
-    return NULL;
-  }
+  return hashmap_from_arrays_with_allocator(hash, eq_keys, eq_vals, keys, vals, n, \
+                                            allocator_default());
 }
 
-static void *bitmap_indexed_get(Node *self, int level, void *key, hash_t hash, \
-                                equal_fn eq_key, equal_fn eq_val)
+Hashmap *hashmap_from_arrays_with_allocator(hash_fn hash, equal_fn eq_keys, equal_fn eq_vals, \
+                                            void **keys, void **vals, int n, Allocator *alloc)
 {
-  BitmapIndexedNode *node = (BitmapIndexedNode*)self;
+  Hashmap *map = hashmap_make_with_allocator(hash, eq_keys, eq_vals, alloc);
+  if (n == 0) { return map; }
+
+  /* hash every key up front so the entries can be partitioned
+     by each level of their hashes */
+  Entry *entries = allocator_alloc(alloc, sizeof(Entry) * n);
+  Entry *scratch = allocator_alloc(alloc, sizeof(Entry) * n);
+
+  for (int i = 0; i < n; i++) {
+    entries[i].key = keys[i];
+    entries[i].val = vals[i];
+    entries[i].hash = map->hash(keys[i]);
+  }
 
-  int bit = bitpos(hash, level);
+  Entry entry;
+  map->root = build_node(alloc, entries, scratch, n, 0, map->eq_key, &entry, &map->count);
 
-  /* if there is a matching bit in bitpos keep searching for a leaf node */
-  if(node->bitmap & bit) {
-    int idx = bit_index(node->bitmap, bit);
-    Node *child = node->children[idx];
+  allocator_free(alloc, entries);
+  allocator_free(alloc, scratch);
 
-    /* look down a level */
-    return child->type->get(child, (level + 1), key, hash, eq_key, eq_val);
-  }
-  /* not found */
-  else {
-    return NULL;
-  }
+  return map;
 }
 
-static void *hash_collision_get(Node *self, int level, void *key, hash_t hash, \
-                                equal_fn eq_key, equal_fn eq_val)
+Hashmap *hashmap_from_arrays_parallel(hash_fn hash, equal_fn eq_keys, equal_fn eq_vals, \
+                                      void **keys, void **vals, int n, int nthreads)
 {
-  HashCollisionNode *node = (HashCollisionNode*)self;
-
-  /* check if the key exists */
-  while (node) {
-
-    /* if found - return the value */
-    if (eq_key(node->key, key)) {
-      return node->val;
-    }
-    node = node->next;
-  }
-  /* not found */
-  return NULL;
+  return hashmap_from_arrays_parallel_with_allocator(hash, eq_keys, eq_vals, keys, vals, n, \
+                                                     nthreads, allocator_default());
 }
 
-static Node *leaf_assoc(Node *self, int level, void *key, void *val, hash_t hash, \
-                        equal_fn eq_key, equal_fn eq_val, int *result)
+Hashmap *hashmap_from_arrays_parallel_with_allocator(hash_fn hash, equal_fn eq_keys, \
+                                                     equal_fn eq_vals, void **keys, void **vals, \
+                                                     int n, int nthreads, Allocator *alloc)
 {
-  LeafNode *node = (LeafNode*)self;
+  if (nthreads <= 1 || n < nthreads) {
+    return hashmap_from_arrays_with_allocator(hash, eq_keys, eq_vals, keys, vals, n, alloc);
+  }
 
-  /* if the hash doesn't match this leaf create a BitmapIndexedNode to
-     hold the existing LeafNode and the new LeafNode and return it */
-  if (node->hash != hash) {
+  Hashmap *map = hashmap_make_with_allocator(hash, eq_keys, eq_vals, alloc);
 
-    BitmapIndexedNode *parent = new_bitmap_indexed_node();
+  BuildTasks *tasks = allocator_alloc(alloc, sizeof(*tasks));
+  tasks->alloc = alloc;
+  tasks->hash = map->hash;
+  tasks->eq_key = map->eq_key;
+  tasks->keys = keys;
+  tasks->vals = vals;
+  tasks->entries = allocator_alloc(alloc, sizeof(Entry) * n);
+  tasks->scratch = allocator_alloc(alloc, sizeof(Entry) * n);
 
-    /* calculate bit-positions of new nodes */
-    int node_bit = bitpos(node->hash, level);
-    int new_bit = bitpos(hash, level);
+  /* each thread hashes a slice of the keys and counts their positions */
+  BuildWorker *workers = allocator_alloc(alloc, sizeof(BuildWorker) * nthreads);
 
-    /* can't put two leaves in the same bitmap if they
-       have the same bit position */
-    if (node_bit != new_bit) {
+  for (int i = 0; i < nthreads; i++) {
+    workers[i].tasks = tasks;
+    workers[i].start = (int)((long)n * i / nthreads);
+    workers[i].end = (int)((long)n * (i + 1) / nthreads);
+  }
+  run_workers(alloc, build_hash_worker, workers, sizeof(BuildWorker), nthreads);
 
-      /* allocate enough space for two nodes */
-      parent->children = GC_MALLOC(sizeof(LeafNode*) * 2);
+  /* each thread's entries for a position follow those of the threads
+     before it so the order of the input is kept */
+  for (int pos = 0, offset = 0; pos < 32; pos++) {
 
-      /* update the bitmap */
-      parent->bitmap |= node_bit;
-      parent->bitmap |= new_bit;
+    tasks->starts[pos] = offset;
 
-      /* work out the new indices */
-      int node_idx = bit_index(parent->bitmap, node_bit);
-      int new_idx = bit_index(parent->bitmap, new_bit);
+    for (int i = 0; i < nthreads; i++) {
+      int size = workers[i].offsets[pos];
+      workers[i].offsets[pos] = offset;
+      offset += size;
+    }
+    tasks->sizes[pos] = offset - tasks->starts[pos];
+  }
+  run_workers(alloc, build_scatter_worker, workers, sizeof(BuildWorker), nthreads);
 
-      /* create new child node */
-      LeafNode *new = new_leaf_node(key, val, hash);
+  /* the threads take the positions in turn and build their sub-nodes */
+  run_workers(alloc, build_child_worker, workers, sizeof(BuildWorker), \
+              (nthreads < 32) ? nthreads : 32);
 
-      /* add the leaf nodes */
-      parent->children[node_idx] = self;
-      parent->children[new_idx] = (Node*)new;
+  /* then join the sub-nodes under the root */
+  unsigned int datamap = 0;
+  unsigned int nodemap = 0;
 
-      *result = ADDED;
-      return (Node*)parent;
-    }
-    /* add a node at level + 1 */
-    else {
-      /* allocate enough space for single node */
-      parent->children = GC_MALLOC(sizeof(Node*));
+  for (int pos = 0; pos < 32; pos++) {
 
-      /* update the bitmap */
-      parent->bitmap |= node_bit;
+    if (tasks->sizes[pos] == 0) { continue; }
 
-      /* add the original leaf node */
-      parent->children[0] = self;
+    if (tasks->children[pos]) { nodemap |= 1u << pos; }
+    else { datamap |= 1u << pos; }
 
-      /* call assoc again on the new bitmap_indexed_node */
-      return (Node*)(parent->type->assoc((Node*)parent, level, key, val, hash, \
-                                         eq_key, eq_val, result));
-    }
+    map->count += tasks->counts[pos];
   }
 
-  /* if the key/value pair already exists return the original node */
-  else if (eq_key(node->key, key) && eq_val(node->val, val)) {
+  BitmapIndexedNode *root = new_bitmap_indexed_node(alloc, NULL, datamap, nodemap);
+  Entry *entries = node_entries(root);
+  Node **children = node_children(root);
 
-    *result = UNCHANGED;
-    return self;
-  }
- /* if the key exists with a different value return a copy with the new value */
-  else if (eq_key(node->key, key)) {
+  for (int pos = 0; pos < 32; pos++) {
 
-    LeafNode *new = new_leaf_node(key, val, hash);
-    *result = UPDATED;
-    return (Node*)new;
+    if (datamap & (1u << pos)) { *entries++ = tasks->inline_entries[pos]; }
+    if (nodemap & (1u << pos)) { *children++ = tasks->children[pos]; }
   }
-  /* if the key is different but has the same hash we have a collision
-     so create a pair of linked HashCollisionNodes and return the first one */
-  else {
+  map->root = (Node*)root;
 
-    HashCollisionNode *original = new_hash_collision_node(node->key, node->val, node->hash);
-    HashCollisionNode *new = new_hash_collision_node(key, val, hash);
-    new->next = original;
+  allocator_free(alloc, tasks->entries);
+  allocator_free(alloc, tasks->scratch);
+  allocator_free(alloc, tasks);
+  allocator_free(alloc, workers);
 
-    *result = ADDED;
-    return (Node*)new;
-  }
+  return map;
 }
 
-static Node *bitmap_indexed_assoc(Node *self, int level, void *key, void *val, hash_t hash, \
-                                  equal_fn eq_key, equal_fn eq_val, int *result)
+Hashmap *hashmap_assoc(Hashmap* map, void *key, void *val)
 {
-  BitmapIndexedNode *node = (BitmapIndexedNode*)self;
+  return hashmap_assoc_with_hash(map, key, val, map->hash(key));
+}
 
-  int bit = bitpos(hash, level);
-  int idx = bit_index(node->bitmap, bit);
+Hashmap *hashmap_assoc_with_hash(Hashmap* map, void *key, void *val, hash_t hash)
+{
+  /* transients must be updated with hashmap_assoc_mut */
+  assert(!map->edit);
 
-  /* if a child node already exists at this bitpos */
-  if (node->bitmap & bit) {
+  /* mapped files are read-only */
+  assert(!map->image);
 
-    /* assoc at the existing child */
-    Node *child = node->children[idx];
-    Node *new = child->type->assoc(child, (level + 1), key, val, hash,  \
-                                   eq_key, eq_val, result);
+  /* result is a boolean that indicates if the map changed during the operation */
+  int result = UNCHANGED;
+  Node *root = root_assoc(map, owned_edit(map), key, val, hash, NULL, &result);
 
-    /* change was made to the child node */
-    if (*result != UNCHANGED) {
+  /* if there was a change create a new hashmap */
+  if (result != UNCHANGED) {
+    return with_root(map, root, map->count + ((result == ADDED) ? 1 : 0));
+  }
+  /* no change */
+  return map;
+}
 
-      /* copy the node */
-      BitmapIndexedNode *copy = copy_bitmap_indexed_node(node);
+Hashmap *hashmap_update(Hashmap *map, void *key, update_fn fn, void *ctx)
+{
+  /* transients must be updated with hashmap_update_mut */
+  assert(!map->edit);
+  assert(!map->image);
 
-      /* count the number of 1s in the bitmap */
-      int nodes = popcount(node->bitmap);
+  hash_t hash = map->hash(key);
+  Update update = {fn, ctx, 0};
 
-      /* allocate storage dynamically */
-      copy->children = GC_MALLOC(sizeof(Node*) * nodes);
+  int result = UNCHANGED;
+  Node *root = root_assoc(map, owned_edit(map), key, NULL, hash, &update, &result);
 
-      /* copy all the existing child nodes */
-      memcpy(copy->children, node->children, sizeof(Node*) * nodes);
-      copy->children[idx] = new;
+  /* removing is rare enough to be left to dissoc */
+  if (update.remove) { return hashmap_dissoc_with_hash(map, key, hash); }
 
-      return (Node*)copy;
-    }
-    /* key not found or key/value pair already exists */
-    else {
-      return self;
-    }
+  /* if there was a change create a new hashmap */
+  if (result != UNCHANGED) {
+    return with_root(map, root, map->count + ((result == ADDED) ? 1 : 0));
   }
-  /* create a new child node */
-  else {
-
-    /* copy the node */
-    BitmapIndexedNode *new= copy_bitmap_indexed_node(node);
-
-    /* set the new node in the bitmap */
-    new->bitmap |= bit;
-
-    /* count the number of 1s in the bitmap */
-    int nodes = popcount(new->bitmap);
+  /* no change */
+  return map;
+}
 
-    /* allocate storage dynamically */
-    new->children = GC_MALLOC(sizeof(Node*) * nodes);
+Hashmap *hashmap_dissoc(Hashmap *map, void *key)
+{
+  return hashmap_dissoc_with_hash(map, key, map->hash(key));
+}
 
-    /* copy all the existing child nodes */
-    memcpy(new->children, node->children, sizeof(Node*) * idx);
-    /* shifting over the ones at > idx to make room for the new one */
-    memcpy(&new->children[idx + 1], &node->children[idx], sizeof(Node*) * (nodes - idx));
+Hashmap *hashmap_dissoc_with_hash(Hashmap *map, void *key, hash_t hash)
+{
+  /* transients must be updated with hashmap_dissoc_mut */
+  assert(!map->edit);
+  assert(!map->image);
 
-    /* create a new leaf node at idx */
-    new->children[idx] = (Node*)new_leaf_node(key, val, hash);
+  /* result is a boolean that indicates if the map changed during the operation */
+  int result = UNCHANGED;
+  Node *root = root_dissoc(map, owned_edit(map), key, hash, &result);
 
-    *result = ADDED;
-    return (Node*)new;
+  /* if there was a change create a new hashmap */
+  if (result != UNCHANGED) {
+    return with_root(map, root, map->count - ((result == REMOVED) ? 1 : 0));
   }
+  /* no change */
+  return map;
 }
 
-static Node *hash_collision_assoc(Node *self, int level, void *key, void *val, hash_t hash, \
-                                  equal_fn eq_key, equal_fn eq_val, int *result)
+Hashmap *hashmap_merge(Hashmap *a, Hashmap *b, merge_fn resolve)
 {
-  HashCollisionNode *node = (HashCollisionNode*)self;
+  /* transients must be made persistent first */
+  assert(!a->edit && !b->edit);
+  assert(!a->image && !b->image);
 
-  /* check if the key already exists */
-  while (node) {
-
-    if (eq_key(node->key, key)) {
-      /* found - exit the loop */
-      break;
-    }
-    /* keep looking */
-    node = node->next;
-  }
+  /* the tries can only be walked together if keys have the same position in both */
+  assert(a->hash == b->hash);
 
-  /* not found */
-  if (!node) {
-    /* add a new HashCollisionNode to the head of the linked list */
-    HashCollisionNode *new = new_hash_collision_node(key, val, hash);
-    new->next = (HashCollisionNode*)self;
+  if (!b->root || a->root == b->root) { return hashmap_retain(a); }
 
-    *result = ADDED;
-    return (Node*)new;
-  }
+  /* the result is allocated like a, so nodes from b can only
+     be shared when b is allocated the same way */
+  Allocator *alloc = a->alloc;
 
-  /* if the key/value pair already exists return the original node */
-  if (eq_key(node->key, key) && eq_val(node->val, val)) {
+  if (!a->root) {
 
-    *result = UNCHANGED;
-    return self;
+    Hashmap *new = copy_hashmap(a);
+    new->root = (b->alloc == alloc) ? node_retain(b->root) : promote_node(alloc, b->root);
+    new->count = b->count;
+    return new;
   }
 
-  /* if the key exists with a different value we replace it */
-
-  /* create new node to replace current value */
-  HashCollisionNode *new = new_hash_collision_node(key, val, hash);
-  /* point it at the tail */
-  new->next = node->next;
+  /* count the keys from b that aren't in a */
+  int added = 0;
+  Slot root_a = {NULL, a->root};
+  Slot root_b = {NULL, b->root};
+  Node *root = merge_positions(alloc, b->alloc, root_a, root_b, 0, a->eq_key, a->eq_val, \
+                               resolve, &added);
 
-  /* if we modified the head of the list we're done */
-  if ((Node*)node == (Node*)self) {
-    *result = UPDATED;
-    return (Node*)new;
+  if (root == a->root) {
+    node_release(alloc, root);
+    return hashmap_retain(a);
   }
 
-  /* if we're not at the head of the list then we need to
-     copy all the nodes up to the one we changed */
+  Hashmap *new = copy_hashmap(a);
+  new->root = root;
+  new->count = a->count + added;
+  return new;
+}
 
-  /* make a copy of the list up to the replaced node */
-  HashCollisionNode *prev = new;
-  HashCollisionNode *curr= (HashCollisionNode*)self;
-  HashCollisionNode *copy = NULL;
+int hashmap_equal(Hashmap *a, Hashmap *b)
+{
+  assert(!a->image && !b->image);
 
-  /* copy the nodes */
-  while (curr != node) {
+  if (a == b || a->root == b->root) { return 1; }
+  if (a->count != b->count) { return 0; }
 
-    copy = new_hash_collision_node(curr->key, curr->val, curr->hash);
-    copy->next = prev;
-    prev = copy;
-    curr = curr->next;
+  /* with the same hash function the same keys always give the same shape
+     of trie so the nodes can be compared directly */
+  if (a->hash == b->hash) {
+    return node_equal(a->root, b->root, a->eq_key, a->eq_val);
   }
-  *result = UPDATED;
-  return (Node*)copy;
+
+  /* otherwise look up every key of a in b */
+  return node_contains(a->root, b, a->eq_val);
 }
 
-static Node *leaf_dissoc(Node *self, int level, void *key, hash_t hash, \
-                         equal_fn eq_key, equal_fn eq_val, int *result)
+void hashmap_diff(Hashmap *old, Hashmap *new, visit_fn on_added, visit_fn on_removed, \
+                  change_fn on_changed, void **acc)
 {
-  /* dissocing a leaf node creates a NULL Node */
-  LeafNode* node = (LeafNode*)self;
+  /* the tries can only be walked together if keys have the same position in both */
+  assert(old->hash == new->hash);
+  assert(!old->image && !new->image);
+
+  Diff diff = {old->alloc, old->eq_key, old->eq_val, on_added, on_removed, on_changed, acc};
+  Slot root_old = {NULL, old->root};
+  Slot root_new = {NULL, new->root};
+
+  diff_slots(root_old, root_new, 0, &diff);
+}
+
+Hashmap *hashmap_transient(Hashmap *map)
+{
+  assert(!map->edit);
+  assert(!map->image);
+
+  Hashmap *new = copy_hashmap(map);
+
+#ifdef PERSISTENT_REFCOUNT
+  /* the nodes shared with map are copied before they're changed */
+  if (new->root) { node_retain(new->root); }
+  new->edit = OWNED;
+#else
+  /* a fresh allocation gives a token no other transient can hold */
+  new->edit = allocator_alloc(map->alloc, 1);
+#endif
+
+  return new;
+}
+
+Hashmap *hashmap_assoc_mut(Hashmap *map, void *key, void *val)
+{
+  assert(map->edit);
+
+  int result = UNCHANGED;
+  Node *root = root_assoc(map, map->edit, key, val, map->hash(key), NULL, &result);
+
+  /* update the transient in place */
+  if (result != UNCHANGED) {
+    set_root(map, root);
+    map->count += (result == ADDED) ? 1 : 0;
+  }
+
+  return map;
+}
+
+Hashmap *hashmap_dissoc_mut(Hashmap *map, void *key)
+{
+  assert(map->edit);
+
+  int result = UNCHANGED;
+  Node *root = root_dissoc(map, map->edit, key, map->hash(key), &result);
+
+  /* update the transient in place */
+  if (result != UNCHANGED) {
+    set_root(map, root);
+    map->count -= (result == REMOVED) ? 1 : 0;
+  }
+
+  return map;
+}
+
+Hashmap *hashmap_update_mut(Hashmap *map, void *key, update_fn fn, void *ctx)
+{
+  assert(map->edit);
+
+  hash_t hash = map->hash(key);
+  Update update = {fn, ctx, 0};
+
+  int result = UNCHANGED;
+  Node *root = root_assoc(map, map->edit, key, NULL, hash, &update, &result);
+
+  /* removing is rare enough to be left to dissoc */
+  if (update.remove) {
+
+    root = root_dissoc(map, map->edit, key, hash, &result);
+    set_root(map, root);
+    map->count--;
+    return map;
+  }
+
+  /* update the transient in place */
+  if (result != UNCHANGED) {
+    set_root(map, root);
+    map->count += (result == ADDED) ? 1 : 0;
+  }
+
+  return map;
+}
+
+Hashmap *hashmap_persistent(Hashmap *map)
+{
+  assert(map->edit);
+
+  /* dropping the token means nothing created by
+     the transient can be modified again */
+  map->edit = NULL;
+
+  return map;
+}
+
+Hashmap *hashmap_promote(Hashmap *map, Allocator *alloc)
+{
+  assert(!map->edit);
+  assert(!map->image);
+
+  Hashmap *new = allocator_alloc(alloc, sizeof(*new));
+  memcpy(new, map, sizeof(*new));
+#ifdef PERSISTENT_REFCOUNT
+  new->refs = 1;
+#endif
+
+  new->alloc = alloc;
+  new->root = map->root ? promote_node(alloc, map->root) : NULL;
+
+  return new;
+}
+
+Hashmap *hashmap_retain(Hashmap *map)
+{
+#ifdef PERSISTENT_REFCOUNT
+  __atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+#endif
+  return map;
+}
+
+void hashmap_release(Hashmap *map)
+{
+#ifdef PERSISTENT_REFCOUNT
+  if (__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+
+  /* a mapped file is unmapped by hashmap_close_mmap */
+  assert(!map->image);
+
+  if (map->root) { node_release(map->alloc, map->root); }
+  allocator_free(map->alloc, map);
+#endif
+}
+
+void *hashmap_get(Hashmap *map, void *key)
+{
+  if (!map->root) { return map->image ? image_get(map, key, map->hash(key)) : NULL; }
+  return node_get(map->root, key, map->hash(key), map->eq_key);
+}
+
+void *hashmap_get_with_hash(Hashmap *map, void *key, hash_t hash)
+{
+  if (!map->root) { return map->image ? image_get(map, key, hash) : NULL; }
+  return node_get(map->root, key, hash, map->eq_key);
+}
+
+/* the number of lookups hashmap_get_many keeps in flight at once */
+#define GET_MANY_BATCH 16
+
+void hashmap_get_many(Hashmap *map, void **keys, int n, void **vals)
+{
+  hash_t hashes[GET_MANY_BATCH];
+  Node *nodes[GET_MANY_BATCH];
+
+  if (map->image) {
+    for (int i = 0; i < n; i++) { vals[i] = image_get(map, keys[i], map->hash(keys[i])); }
+    return;
+  }
+
+  for (int start = 0; start < n; start += GET_MANY_BATCH) {
+
+    int batch = (n - start < GET_MANY_BATCH) ? (n - start) : GET_MANY_BATCH;
+    void **batch_keys = keys + start;
+    void **batch_vals = vals + start;
+
+    for (int i = 0; i < batch; i++) {
+      hashes[i] = map->hash(batch_keys[i]);
+      nodes[i] = map->root;
+      batch_vals[i] = NULL;
+    }
+
+    /* move every lookup in the batch down one level per pass. the
+       sub-node for each lookup is prefetched when it is found so it
+       loads while the rest of the batch is walked */
+    int active = (map->root != NULL);
+    for (int level = 0; active; level++) {
+
+      active = 0;
+      for (int i = 0; i < batch; i++) {
+
+        Node *node = nodes[i];
+        if (!node) { continue; }
+
+        /* finished with this lookup unless it moves to a sub-node */
+        nodes[i] = NULL;
+
+        if (node->tag == HASH_COLLISION) {
+          batch_vals[i] = hash_collision_get((HashCollisionNode*)node, batch_keys[i], \
+                                             hashes[i], map->eq_key);
+          continue;
+        }
+
+        BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+        unsigned int bit = bitpos(hashes[i], level);
+
+        if (bitmap->datamap & bit) {
+          Entry *entry = &node_entries(bitmap)[bit_index(bitmap->datamap, bit)];
+
+          if (entry->hash == hashes[i] && map->eq_key(entry->key, batch_keys[i])) {
+            batch_vals[i] = entry->val;
+          }
+          continue;
+        }
+
+        if (bitmap->nodemap & bit) {
+          Node *child = node_children(bitmap)[bit_index(bitmap->nodemap, bit)];
+          __builtin_prefetch(child);
+
+          nodes[i] = child;
+          active = 1;
+        }
+      }
+    }
+  }
+}
+
+hash_t hashmap_hash(Hashmap *map, void *key)
+{
+  return map->hash(key);
+}
+
+int hashmap_count(Hashmap *map)
+{
+  return map->count;
+}
+
+int hashmap_empty(Hashmap *map)
+{
+  return (map->count == 0);
+}
+
+void hashmap_visit(Hashmap *map, visit_fn fn, void** acc)
+{
+  if (map->image && map->image->root) { image_visit(map->image, map->image->root, fn, acc); }
+  if (!map->root) { return; }
+  node_visit(map->root, fn, acc);
+}
+
+void *hashmap_reduce(Hashmap *map, reduce_kv_fn fn, void *init)
+{
+  int reduced = 0;
+
+  if (map->image && map->image->root) {
+    return image_reduce(map->image, map->image->root, fn, init, &reduced);
+  }
+  if (!map->root) { return init; }
+  return node_reduce(map->root, fn, init, &reduced);
+}
+
+void hashmap_stats(Hashmap *map, HashmapStats *stats)
+{
+  assert(!map->image);
+
+  memset(stats, 0, sizeof(*stats));
+  stats->bytes = sizeof(*map);
+
+  if (!map->root) { return; }
+  node_stats(map->root, 0, stats);
+
+  /* every entry and sub-node except the root is in one BitmapIndexedNode */
+  int positions = stats->inline_entries + stats->bitmap_nodes + stats->collision_nodes - 1;
+  stats->fan_out = (double)positions / stats->bitmap_nodes;
+}
+
+size_t hashmap_shared_bytes(Hashmap *a, Hashmap *b)
+{
+  assert(!a->image && !b->image);
+
+  if (!a->root || !b->root) { return 0; }
+  return shared_bytes(a->root, b->root, 0);
+}
+
+void hashmap_visit_parallel(Hashmap *map, visit_fn fn, combine_fn combine, void **acc, \
+                            int nthreads)
+{
+  assert(!map->image);
+
+  if (!map->root) { return; }
+  if (nthreads < 1) { nthreads = 1; }
+
+  /* split the trie a level at a time until there are enough sub-tries to
+     share out. the entries of the nodes split up are visited here */
+  void *part = NULL;
+  int target = nthreads * TASKS_PER_THREAD;
+
+  Allocator *alloc = map->alloc;
+  Node **nodes = allocator_alloc(alloc, sizeof(Node*));
+  nodes[0] = map->root;
+  int count = 1;
+  int split = 1;
+
+  while (count < target && split) {
+
+    Node **next = allocator_alloc(alloc, sizeof(Node*) * count * 32);
+    int n_next = 0;
+    split = 0;
+
+    for (int i = 0; i < count; i++) {
+
+      if (nodes[i]->tag == HASH_COLLISION) {
+        next[n_next++] = nodes[i];
+        continue;
+      }
+
+      BitmapIndexedNode *bitmap = (BitmapIndexedNode*)nodes[i];
+      Entry *entries = node_entries(bitmap);
+      Node **children = node_children(bitmap);
+
+      for (int j = 0; j < popcount(bitmap->datamap); j++) {
+        fn(entries[j].key, entries[j].val, &part);
+      }
+      for (int j = 0; j < popcount(bitmap->nodemap); j++) {
+        next[n_next++] = children[j];
+      }
+      split = 1;
+    }
+    allocator_free(alloc, nodes);
+    nodes = next;
+    count = n_next;
+  }
+
+  /* each thread takes the next sub-trie until they're all visited */
+  VisitTasks tasks = {nodes, count, 0, fn};
+  int n_workers = (nthreads < count) ? nthreads : count;
+  if (n_workers < 1) { n_workers = 1; }
+
+  VisitWorker *workers = allocator_alloc(alloc, sizeof(VisitWorker) * n_workers);
+
+  for (int i = 0; i < n_workers; i++) {
+    workers[i].tasks = &tasks;
+    workers[i].acc = NULL;
+  }
+  run_workers(alloc, visit_worker, workers, sizeof(VisitWorker), n_workers);
+
+  combine(acc, part);
+  for (int i = 0; i < n_workers; i++) {
+    combine(acc, workers[i].acc);
+  }
+
+  allocator_free(alloc, nodes);
+  allocator_free(alloc, workers);
+}
+
+Iterator *hashmap_iterator_make(Hashmap *map)
+{
+  assert(map);
+
+  /* empty hashmap returns a NULL iterator */
+  if (hashmap_empty(map)) { return NULL; }
+
+  /* create an iterator followed by its cursor */
+  Iterator *iter = iterator_alloc(sizeof(*iter) + sizeof(Cursor) + sizeof(Frame) * MAX_DEPTH);
+
+  /* install the next function for a hashmap */
+  iter->next_fn = hashmap_next_fn;
+
+  /* start the walk at the root */
+  Cursor *cursor = iter_cursor(iter);
+  cursor->stack[0].node = map->root;
+  cursor->stack[0].idx = 0;
+  cursor->depth = 1;
+  cursor->image = map->image;
+
+  /* the frames of a mapped map hold ImageNodes */
+  if (map->image) {
+    cursor->stack[0].node = (Node*)(map->image->base + map->image->root);
+  }
+
+  /* find the first entry */
+  cursor_advance(cursor);
+
+  /* the key comes first then data is set when the value is current */
+  iter->value = cursor->key;
+  iter->data = (void *)0;
+
+  return iter;
+}
+
+int hashmap_serialize(Hashmap *map, int fd, HashmapCodec *key_codec, HashmapCodec *val_codec)
+{
+  return hashmap_serialize_versions(&map, 1, fd, key_codec, val_codec);
+}
+
+int hashmap_serialize_versions(Hashmap **versions, int n, int fd, HashmapCodec *key_codec, \
+                               HashmapCodec *val_codec)
+{
+  assert(n > 0);
+  Allocator *alloc = versions[0]->alloc;
+
+  /* the tables live on the stack so the collector sees them while the
+     writer, which is too big for the stack, has no pointers to scan */
+  IdentityTable nodes, keys, vals;
+  identity_init(&nodes, alloc, 1024);
+  identity_init(&keys, alloc, 1024);
+  identity_init(&vals, alloc, 1024);
+
+  Writer *writer = allocator_alloc_atomic(alloc, sizeof(*writer));
+  writer->alloc = alloc;
+  writer->fd = fd;
+  writer->failed = 0;
+  writer->offset = 0;
+  writer->used = 0;
+  writer->nodes = &nodes;
+  writer->keys = &keys;
+  writer->vals = &vals;
+
+  ImageHeader header;
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.hash_size = sizeof(hash_t);
+  write_bytes(writer, &header, sizeof(header));
+
+  ImageVersion *table = allocator_alloc_atomic(alloc, sizeof(ImageVersion) * n);
+
+  for (int i = 0; i < n; i++) {
+
+    Hashmap *map = versions[i];
+    assert(!map->edit && !map->image);
+
+    /* the versions are loaded with one hash function */
+    assert(map->hash == versions[0]->hash);
+
+    table[i].count = map->count;
+    table[i].root = map->root ? write_node(writer, map->root, key_codec, val_codec) : 0;
+  }
+  write_bytes(writer, table, sizeof(ImageVersion) * n);
+
+  ImageTrailer trailer = {n};
+  write_bytes(writer, &trailer, sizeof(trailer));
+  write_flush(writer);
+
+  int failed = writer->failed;
+
+  identity_free(&nodes);
+  identity_free(&keys);
+  identity_free(&vals);
+  allocator_free(alloc, table);
+  allocator_free(alloc, writer);
+
+  return failed ? -1 : 0;
+}
+
+Hashmap **hashmap_load_versions(int fd, hash_fn hash, equal_fn eq_keys, equal_fn eq_vals, \
+                                HashmapCodec *key_codec, HashmapCodec *val_codec, int *n)
+{
+  return hashmap_load_versions_with_allocator(fd, hash, eq_keys, eq_vals, key_codec, val_codec, \
+                                              n, allocator_default());
+}
+
+Hashmap **hashmap_load_versions_with_allocator(int fd, hash_fn hash, equal_fn eq_keys, \
+                                               equal_fn eq_vals, HashmapCodec *key_codec, \
+                                               HashmapCodec *val_codec, int *n, Allocator *alloc)
+{
+  /* the file is kept as keys and values may be decoded in place */
+  size_t size;
+  char *base = read_all(fd, alloc, &size);
+  if (!base) { return NULL; }
+
+  uint64_t n_versions;
+  const ImageVersion *table = image_versions(base, size, &n_versions);
+  if (!table) {
+    allocator_free(alloc, base);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  Loader loader;
+  loader.alloc = alloc;
+  loader.image.base = base;
+  loader.image.size = size;
+  loader.image.key_codec = *key_codec;
+  loader.image.val_codec = *val_codec;
+
+  /* check every version before loading any so a corrupt image is found
+     before anything is made from it, and loading can't fail part way.
+     nodes shared between versions are checked once. keys hashed
+     differently would be looked for in the wrong places */
+  IdentityTable checked;
+  identity_init(&checked, alloc, 1024);
+  int valid = 1;
+  for (uint64_t i = 0; i < n_versions && valid; i++) {
+    valid = image_check(&loader.image, &checked, table[i].root, (const char*)table - base) && \
+            image_check_hash(&loader.image, table[i].root, hash ? hash : hash_str);
+  }
+  identity_free(&checked);
+
+  if (!valid) {
+    allocator_free(alloc, base);
+    errno = EINVAL;
+    return NULL;
+  }
+  identity_init(&loader.nodes, alloc, 1024);
+  identity_init(&loader.keys, alloc, 1024);
+  identity_init(&loader.vals, alloc, 1024);
+
+  LoadedVersions *loaded = allocator_alloc(alloc, sizeof(*loaded) + \
+                                           sizeof(Hashmap*) * n_versions);
+  loaded->alloc = alloc;
+  loaded->base = base;
+  Hashmap **versions = (Hashmap**)(loaded + 1);
+
+  for (uint64_t i = 0; i < n_versions; i++) {
+
+    Hashmap *map = hashmap_make_with_allocator(hash, eq_keys, eq_vals, alloc);
+    map->count = table[i].count;
+    map->root = table[i].root ? load_node(&loader, table[i].root) : NULL;
+    versions[i] = map;
+  }
+  identity_free(&loader.nodes);
+  identity_free(&loader.keys);
+  identity_free(&loader.vals);
+
+  *n = n_versions;
+  return versions;
+}
+
+void hashmap_free_versions(Hashmap **versions)
+{
+  LoadedVersions *loaded = (LoadedVersions*)versions - 1;
+  Allocator *alloc = loaded->alloc;
+
+  allocator_free(alloc, loaded->base);
+  allocator_free(alloc, loaded);
+}
+
+Hashmap *hashmap_open_mmap(const char *path, hash_fn hash, equal_fn eq_keys, \
+                           HashmapCodec *key_codec, HashmapCodec *val_codec)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) { return NULL; }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* the mapping stays valid after the file is closed */
+  const char *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) { return NULL; }
+
+  uint64_t n_versions;
+  const ImageVersion *table = image_versions(base, size, &n_versions);
+  if (!table) {
+    munmap((void*)base, size);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* the newest version */
+  const ImageVersion *version = &table[n_versions - 1];
+
+  Hashmap *map = hashmap_make(hash, eq_keys, NULL);
+
+  Image *image = allocator_alloc(map->alloc, sizeof(*image));
+  image->base = base;
+  image->size = size;
+  image->root = version->root;
+  image->key_codec = *key_codec;
+  image->val_codec = *val_codec;
+
+  map->count = version->count;
+  map->image = image;
+
+  /* nothing is read from the file after this without being checked here
+     first, and keys hashed differently would be looked for in the wrong
+     places */
+  IdentityTable checked;
+  identity_init(&checked, map->alloc, 1024);
+  int valid = image_check(image, &checked, image->root, (const char*)table - base) && \
+              image_check_hash(image, image->root, map->hash);
+  identity_free(&checked);
+
+  if (!valid) {
+    hashmap_close_mmap(map);
+    hashmap_release(map);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return map;
+}
+
+void hashmap_close_mmap(Hashmap *map)
+{
+  assert(map->image);
+
+  munmap((void*)map->image->base, map->image->size);
+  allocator_free(map->alloc, map->image);
+  map->image = NULL;
+  map->count = 0;
+}
+
+/* internal implementation */
+
+/* the size of the array holding the entries and sub-nodes */
+static size_t array_size(unsigned int datamap, unsigned int nodemap)
+{
+  return (sizeof(Entry) * popcount(datamap)) + (sizeof(Node*) * popcount(nodemap));
+}
+
+static BitmapIndexedNode *new_bitmap_indexed_node(Allocator *alloc, void *edit, \
+                                                  unsigned int datamap, unsigned int nodemap)
+{
+  /* a single allocation holds the node and its array */
+  BitmapIndexedNode *node = allocator_alloc(alloc, sizeof(*node) + array_size(datamap, nodemap));
+  node->tag = BITMAP_INDEXED;
+#ifdef PERSISTENT_REFCOUNT
+  node->refs = 1;
+#endif
+  node->edit = edit;
+  node->datamap = datamap;
+  node->nodemap = nodemap;
+
+  return node;
+}
+
+static HashCollisionNode *new_hash_collision_node(Allocator *alloc, hash_t hash, int count)
+{
+  /* a single allocation holds the node and its array */
+  HashCollisionNode *node = allocator_alloc(alloc, sizeof(*node) + sizeof(Pair) * count);
+  node->tag = HASH_COLLISION;
+#ifdef PERSISTENT_REFCOUNT
+  node->refs = 1;
+#endif
+  node->hash = hash;
+  node->count = count;
+
+  return node;
+}
+
+static Hashmap *copy_hashmap(Hashmap *map)
+{
+  Hashmap *new = allocator_alloc(map->alloc, sizeof(*new));
+  memcpy(new, map, sizeof(*new));
+#ifdef PERSISTENT_REFCOUNT
+  new->refs = 1;
+#endif
+
+  return new;
+}
+
+/* the edit token for a persistent operation on map. in the reference
+   counted build a map with a single owner can be changed in place */
+static void *owned_edit(Hashmap *map)
+{
+#ifdef PERSISTENT_REFCOUNT
+  if (__atomic_load_n(&map->refs, __ATOMIC_ACQUIRE) == 1) { return OWNED; }
+#endif
+  return NULL;
+}
+
+/* returns map with a new root and count, taking over the caller's
+   reference to map. it's copied unless it can be changed in place */
+static Hashmap *with_root(Hashmap *map, Node *root, int count)
+{
+  if (owned_edit(map)) {
+    set_root(map, root);
+    map->count = count;
+    return map;
+  }
+
+  Hashmap *new = copy_hashmap(map);
+  new->root = root;
+  new->count = count;
+  hashmap_release(map);
+
+  return new;
+}
+
+/* replace the root of a map changed in place, releasing the old one */
+static void set_root(Hashmap *map, Node *root)
+{
+  if (map->root && map->root != root) { node_release(map->alloc, map->root); }
+  map->root = root;
+}
+
+/* return a copy of node and everything below it allocated from alloc */
+static Node *promote_node(Allocator *alloc, Node *node)
+{
+  if (node->tag == HASH_COLLISION) {
+
+    HashCollisionNode *collision = (HashCollisionNode*)node;
+    HashCollisionNode *copy = new_hash_collision_node(alloc, collision->hash, collision->count);
+    memcpy(copy->array, collision->array, sizeof(Pair) * collision->count);
+
+    return (Node*)copy;
+  }
+
+  BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+  BitmapIndexedNode *copy = new_bitmap_indexed_node(alloc, NULL, bitmap->datamap, \
+                                                    bitmap->nodemap);
+  memcpy(node_entries(copy), node_entries(bitmap), sizeof(Entry) * popcount(bitmap->datamap));
+
+  Node **children = node_children(bitmap);
+  Node **copies = node_children(copy);
+  int n_children = popcount(bitmap->nodemap);
+
+  for (int i = 0; i < n_children; i++) {
+    copies[i] = promote_node(alloc, children[i]);
+  }
+
+  return (Node*)copy;
+}
+
+/* return a node that can be modified without changing any earlier
+   version of the map. changing the number of entries or sub-nodes
+   always needs a new node, even in a transient */
+static BitmapIndexedNode *edit_bitmap_indexed_node(Allocator *alloc, BitmapIndexedNode *node, \
+                                                   void *edit)
+{
+  if (editable(node->edit, edit)) { return node; }
+
+  BitmapIndexedNode *copy = new_bitmap_indexed_node(alloc, edit, node->datamap, node->nodemap);
+  memcpy(copy->array, node->array, array_size(node->datamap, node->nodemap));
+  retain_children(node_children(node), popcount(node->nodemap));
+
+  return copy;
+}
+
+/* return a node with the entry at bit added */
+static BitmapIndexedNode *insert_entry(Allocator *alloc, BitmapIndexedNode *node, void *edit, \
+                                       unsigned int bit, void *key, void *val, hash_t hash)
+{
+  Entry *entries = node_entries(node);
+  Node **children = node_children(node);
+  int n_entries = popcount(node->datamap);
+  int n_children = popcount(node->nodemap);
+  int idx = bit_index(node->datamap, bit);
+
+  BitmapIndexedNode *new = new_bitmap_indexed_node(alloc, edit, node->datamap | bit, \
+                                                   node->nodemap);
+  Entry *new_entries = node_entries(new);
+
+  /* copy the entries shifting over the ones at >= idx to make room for the new one */
+  memcpy(new_entries, entries, sizeof(Entry) * idx);
+  memcpy(&new_entries[idx + 1], &entries[idx], sizeof(Entry) * (n_entries - idx));
+
+  new_entries[idx].key = key;
+  new_entries[idx].val = val;
+  new_entries[idx].hash = hash;
+
+  /* the sub-nodes are unchanged */
+  memcpy(node_children(new), children, sizeof(Node*) * n_children);
+  retain_children(children, n_children);
+
+  return new;
+}
+
+/* return a node with the entry at bit removed */
+static BitmapIndexedNode *remove_entry(Allocator *alloc, BitmapIndexedNode *node, void *edit, \
+                                       unsigned int bit)
+{
+  Entry *entries = node_entries(node);
+  Node **children = node_children(node);
+  int n_entries = popcount(node->datamap);
+  int n_children = popcount(node->nodemap);
+  int idx = bit_index(node->datamap, bit);
+
+  BitmapIndexedNode *new = new_bitmap_indexed_node(alloc, edit, node->datamap & ~bit, \
+                                                   node->nodemap);
+  Entry *new_entries = node_entries(new);
+
+  /* copy the entries shifting over the ones at > idx to replace the removed one */
+  memcpy(new_entries, entries, sizeof(Entry) * idx);
+  memcpy(&new_entries[idx], &entries[idx + 1], sizeof(Entry) * (n_entries - idx - 1));
+
+  /* the sub-nodes are unchanged */
+  memcpy(node_children(new), children, sizeof(Node*) * n_children);
+  retain_children(children, n_children);
+
+  return new;
+}
+
+/* return a node with the entry at bit replaced by the sub-node child */
+static BitmapIndexedNode *entry_to_child(Allocator *alloc, BitmapIndexedNode *node, void *edit, \
+                                         unsigned int bit, Node *child)
+{
+  Entry *entries = node_entries(node);
+  Node **children = node_children(node);
+  int n_entries = popcount(node->datamap);
+  int n_children = popcount(node->nodemap);
+  int entry_idx = bit_index(node->datamap, bit);
+  int child_idx = bit_index(node->nodemap, bit);
+
+  BitmapIndexedNode *new = new_bitmap_indexed_node(alloc, edit, node->datamap & ~bit, \
+                                                   node->nodemap | bit);
+  Entry *new_entries = node_entries(new);
+  Node **new_children = node_children(new);
+
+  /* copy the entries without the one being pushed down */
+  memcpy(new_entries, entries, sizeof(Entry) * entry_idx);
+  memcpy(&new_entries[entry_idx], &entries[entry_idx + 1], \
+         sizeof(Entry) * (n_entries - entry_idx - 1));
+
+  /* copy the sub-nodes making room for the new one */
+  memcpy(new_children, children, sizeof(Node*) * child_idx);
+  memcpy(&new_children[child_idx + 1], &children[child_idx], \
+         sizeof(Node*) * (n_children - child_idx));
+  retain_children(children, n_children);
+  new_children[child_idx] = child;
+
+  return new;
+}
+
+/* return a node with the sub-node at bit replaced by the entry */
+static BitmapIndexedNode *child_to_entry(Allocator *alloc, BitmapIndexedNode *node, void *edit, \
+                                         unsigned int bit, Entry *entry)
+{
+  Entry *entries = node_entries(node);
+  Node **children = node_children(node);
+  int n_entries = popcount(node->datamap);
+  int n_children = popcount(node->nodemap);
+  int entry_idx = bit_index(node->datamap, bit);
+  int child_idx = bit_index(node->nodemap, bit);
+
+  BitmapIndexedNode *new = new_bitmap_indexed_node(alloc, edit, node->datamap | bit, \
+                                                   node->nodemap & ~bit);
+  Entry *new_entries = node_entries(new);
+  Node **new_children = node_children(new);
+
+  /* copy the entries making room for the one being pulled up */
+  memcpy(new_entries, entries, sizeof(Entry) * entry_idx);
+  memcpy(&new_entries[entry_idx + 1], &entries[entry_idx], \
+         sizeof(Entry) * (n_entries - entry_idx));
+  new_entries[entry_idx] = *entry;
+
+  /* copy the sub-nodes without the replaced one */
+  memcpy(new_children, children, sizeof(Node*) * child_idx);
+  memcpy(&new_children[child_idx], &children[child_idx + 1], \
+         sizeof(Node*) * (n_children - child_idx - 1));
+  retain_children(new_children, n_children - 1);
+
+  return new;
+}
+
+/* create the smallest sub-node at level holding both the entry and the new key/val */
+static Node *merge_entries(Allocator *alloc, void *edit, int level, Entry *entry, void *key, \
+                           void *val, hash_t hash)
+{
+  /* the whole hash is the same so create a HashCollisionNode holding both */
+  if (entry->hash == hash) {
+
+    HashCollisionNode *collision = new_hash_collision_node(alloc, hash, 2);
+    collision->array[0].key = entry->key;
+    collision->array[0].val = entry->val;
+    collision->array[1].key = key;
+    collision->array[1].val = val;
+
+    return (Node*)collision;
+  }
+
+  unsigned int entry_bit = bitpos(entry->hash, level);
+  unsigned int new_bit = bitpos(hash, level);
+
+  /* can't put two entries in the same position so push them down a level */
+  if (entry_bit == new_bit) {
+
+    BitmapIndexedNode *node = new_bitmap_indexed_node(alloc, edit, 0, entry_bit);
+    node_children(node)[0] = merge_entries(alloc, edit, level + 1, entry, key, val, hash);
+
+    return (Node*)node;
+  }
+
+  /* otherwise store both entries inline in bit order */
+  BitmapIndexedNode *node = new_bitmap_indexed_node(alloc, edit, entry_bit | new_bit, 0);
+  Entry *entries = node_entries(node);
+
+  int entry_idx = bit_index(node->datamap, entry_bit);
+  int new_idx = bit_index(node->datamap, new_bit);
+
+  entries[entry_idx] = *entry;
+  entries[new_idx].key = key;
+  entries[new_idx].val = val;
+  entries[new_idx].hash = hash;
+
+  return (Node*)node;
+}
+
+/* if node only holds a single entry copy it to entry and return 1 */
+static int single_entry(Node *node, Entry *entry)
+{
+  if (node->tag == HASH_COLLISION) {
+
+    HashCollisionNode *collision = (HashCollisionNode*)node;
+    if (collision->count != 1) { return 0; }
+
+    entry->key = collision->array[0].key;
+    entry->val = collision->array[0].val;
+    entry->hash = collision->hash;
+    return 1;
+  }
+
+  BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+  if (bitmap->nodemap || popcount(bitmap->datamap) != 1) { return 0; }
+
+  *entry = node_entries(bitmap)[0];
+  return 1;
+}
+
+/* a sub-node holding nothing but a HashCollisionNode is replaced by it
+   so that every set of keys has exactly one shape of trie. node is
+   dropped when it isn't old, the node it was made from */
+static Node *collapse(Allocator *alloc, BitmapIndexedNode *node, BitmapIndexedNode *old, \
+                      int level)
+{
+  if (level > 0 && !node->datamap && popcount(node->nodemap) == 1) {
+
+    Node *child = node_children(node)[0];
+    if (child->tag == HASH_COLLISION) {
+
+      node_retain(child);
+      if (node != old) { node_release(alloc, (Node*)node); }
+      return child;
+    }
+  }
+  return (Node*)node;
+}
+
+/* create the smallest sub-node at level holding both the
+   HashCollisionNode and a new key/val with a different hash */
+static Node *merge_collision(Allocator *alloc, void *edit, int level, \
+                             HashCollisionNode *collision, void *key, void *val, hash_t hash)
+{
+  unsigned int collision_bit = bitpos(collision->hash, level);
+  unsigned int new_bit = bitpos(hash, level);
+
+  /* both in the same position so push them down a level */
+  if (collision_bit == new_bit) {
+
+    BitmapIndexedNode *node = new_bitmap_indexed_node(alloc, edit, 0, collision_bit);
+    node_children(node)[0] = merge_collision(alloc, edit, level + 1, collision, key, val, hash);
+
+    return (Node*)node;
+  }
+
+  /* otherwise store the new entry inline next to the HashCollisionNode */
+  BitmapIndexedNode *node = new_bitmap_indexed_node(alloc, edit, new_bit, collision_bit);
+  Entry *entry = node_entries(node);
+
+  entry->key = key;
+  entry->val = val;
+  entry->hash = hash;
+  node_children(node)[0] = node_retain((Node*)collision);
+
+  return (Node*)node;
+}
+
+/* true if all n entries have the same hash */
+static int same_hash(Entry *entries, int n)
+{
+  for (int i = 1; i < n; i++) {
+    if (entries[i].hash != entries[0].hash) { return 0; }
+  }
+  return 1;
+}
+
+/* build the node at level holding the n entries bottom up so that each
+   node is allocated once at its final size. where a key appears more than
+   once the last one wins. if only a single key is left below the root it
+   is copied to entry and NULL is returned so the parent can store it inline */
+static Node *build_node(Allocator *alloc, Entry *entries, Entry *scratch, int n, int level, \
+                        equal_fn eq_key, Entry *entry, int *count)
+{
+  /* below the root keys sharing a hash all go in one HashCollisionNode */
+  if (level > 0 && same_hash(entries, n)) {
+
+    /* move the last of each distinct key to the end of the entries */
+    int first = n;
+    for (int i = n - 1; i >= 0; i--) {
+
+      int found = 0;
+      for (int j = first; j < n && !found; j++) {
+        found = eq_key(entries[j].key, entries[i].key);
+      }
+      if (!found) { entries[--first] = entries[i]; }
+    }
+    *count += n - first;
+
+    if (first == n - 1) {
+      *entry = entries[first];
+      return NULL;
+    }
+
+    HashCollisionNode *collision = new_hash_collision_node(alloc, entries[first].hash, n - first);
+    for (int i = first; i < n; i++) {
+      collision->array[i - first].key = entries[i].key;
+      collision->array[i - first].val = entries[i].val;
+    }
+    return (Node*)collision;
+  }
+
+  /* partition the entries by their position at this level keeping their order */
+  int sizes[32] = {0};
+  int offsets[32];
+
+  for (int i = 0; i < n; i++) {
+    sizes[mask(entries[i].hash, level)]++;
+  }
+  for (int pos = 0, offset = 0; pos < 32; pos++) {
+    offsets[pos] = offset;
+    offset += sizes[pos];
+  }
+  for (int i = 0; i < n; i++) {
+    scratch[offsets[mask(entries[i].hash, level)]++] = entries[i];
+  }
+  memcpy(entries, scratch, sizeof(Entry) * n);
+
+  /* build each position's sub-node first to find out which are inline */
+  Entry inline_entries[32];
+  Node *children[32];
+  unsigned int datamap = 0;
+  unsigned int nodemap = 0;
+  int n_entries = 0;
+  int n_children = 0;
+
+  for (int pos = 0, start = 0; pos < 32; start += sizes[pos], pos++) {
+
+    if (sizes[pos] == 0) { continue; }
+
+    if (sizes[pos] == 1) {
+      datamap |= 1u << pos;
+      inline_entries[n_entries++] = entries[start];
+      (*count)++;
+      continue;
+    }
+
+    Node *child = build_node(alloc, entries + start, scratch + start, sizes[pos], level + 1, \
+                             eq_key, &inline_entries[n_entries], count);
+    if (child) {
+      nodemap |= 1u << pos;
+      children[n_children++] = child;
+    }
+    else {
+      datamap |= 1u << pos;
+      n_entries++;
+    }
+  }
+
+  BitmapIndexedNode *node = new_bitmap_indexed_node(alloc, NULL, datamap, nodemap);
+  memcpy(node_entries(node), inline_entries, sizeof(Entry) * n_entries);
+  memcpy(node_children(node), children, sizeof(Node*) * n_children);
+
+  return (Node*)node;
+}
+
+/* when assoc is doing an update set val to the new value for key given
+   its old one. returns 0 if the key is to be left out of the map */
+static int update_val(Update *update, void *key, void *old, void **val)
+{
+  if (!update) { return 1; }
+
+  *val = update->fn(key, old, update->ctx);
+  if (*val != HASHMAP_NOT_FOUND) { return 1; }
+
+  /* a key in the map is removed afterwards */
+  update->remove = (old != HASHMAP_NOT_FOUND);
+  return 0;
+}
+
+static Node *root_assoc(Hashmap *map, void *edit, void *key, void *val, \
+                        hash_t hash, Update *update, int *result)
+{
+  Allocator *alloc = map->alloc;
+
+  /* if there are no entries create a root node holding the entry */
+  if (!map->root) {
+
+    if (!update_val(update, key, HASHMAP_NOT_FOUND, &val)) { return NULL; }
+
+    BitmapIndexedNode *root = new_bitmap_indexed_node(alloc, edit, bitpos(hash, 0), 0);
+    Entry *entry = node_entries(root);
+    entry->key = key;
+    entry->val = val;
+    entry->hash = hash;
+
+    *result = ADDED;
+    return (Node*)root;
+  }
+  /* otherwise call assoc on the root node */
+  return node_assoc(alloc, map->root, edit, key, val, hash, map->eq_key, map->eq_val, \
+                    update, result);
+}
+
+static Node *root_dissoc(Hashmap *map, void *edit, void *key, hash_t hash, int *result)
+{
+  /* if there are no entries there's nothing to dissoc */
+  if (!map->root) { return NULL; }
+
+  /* otherwise call dissoc on the root node */
+  return node_dissoc(map->alloc, map->root, edit, key, hash, map->eq_key, result);
+}
+
+/* the index of key in a HashCollisionNode or -1 if it isn't there */
+static int hash_collision_index(HashCollisionNode *node, void *key, equal_fn eq_key)
+{
+  for (int i = 0; i < node->count; i++) {
+    if (eq_key(node->array[i].key, key)) { return i; }
+  }
+  return -1;
+}
+
+static void *hash_collision_get(HashCollisionNode *node, void *key, hash_t hash, \
+                                equal_fn eq_key)
+{
+  /* all the keys in the node share a single hash */
+  if (node->hash != hash) { return NULL; }
+
+  int idx = hash_collision_index(node, key, eq_key);
+  return (idx < 0) ? NULL : node->array[idx].val;
+}
+
+/* return where the value for key is held, or NULL if key isn't
+   present, so that a NULL value can be told apart from a missing key */
+static inline void **node_find(Node *node, void *key, hash_t hash, equal_fn eq_key)
+{
+  /* keep looking down a level until the key's position is found */
+  for (int level = 0; node->tag == BITMAP_INDEXED; level++) {
+
+    BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+    unsigned int bit = bitpos(hash, level);
+
+    /* if the entry is inline compare the hash before the key */
+    if (bitmap->datamap & bit) {
+      Entry *entry = &node_entries(bitmap)[bit_index(bitmap->datamap, bit)];
+
+      if (entry->hash == hash && eq_key(entry->key, key)) {
+        return &entry->val;
+      }
+      return NULL;
+    }
+    /* not found */
+    if (!(bitmap->nodemap & bit)) { return NULL; }
+
+    node = node_children(bitmap)[bit_index(bitmap->nodemap, bit)];
+  }
+
+  /* all the keys in a HashCollisionNode share a single hash */
+  HashCollisionNode *collision = (HashCollisionNode*)node;
+  if (collision->hash != hash) { return NULL; }
+
+  int idx = hash_collision_index(collision, key, eq_key);
+  return (idx < 0) ? NULL : &collision->array[idx].val;
+}
+
+static inline void *node_get(Node *node, void *key, hash_t hash, equal_fn eq_key)
+{
+  void **val = node_find(node, key, hash, eq_key);
+  return val ? *val : NULL;
+}
+
+static Node *hash_collision_assoc(Allocator *alloc, HashCollisionNode *node, void *edit, \
+                                  int level, void *key, void *val, hash_t hash, equal_fn eq_key, \
+                                  equal_fn eq_val, Update *update, int *result)
+{
+  /* a different hash can't join the node so separate them in a new sub-node */
+  if (node->hash != hash) {
+
+    if (!update_val(update, key, HASHMAP_NOT_FOUND, &val)) { return (Node*)node; }
+
+    *result = ADDED;
+    return merge_collision(alloc, edit, level, node, key, val, hash);
+  }
+
+  int idx = hash_collision_index(node, key, eq_key);
+
+  /* not found - copy the array with the new pair on the end */
+  if (idx < 0) {
+
+    if (!update_val(update, key, HASHMAP_NOT_FOUND, &val)) { return (Node*)node; }
+
+    HashCollisionNode *new = new_hash_collision_node(alloc, hash, node->count + 1);
+    memcpy(new->array, node->array, sizeof(Pair) * node->count);
+    new->array[node->count].key = key;
+    new->array[node->count].val = val;
+
+    *result = ADDED;
+    return (Node*)new;
+  }
+
+  if (!update_val(update, key, node->array[idx].val, &val)) { return (Node*)node; }
+
+  /* if the key/value pair already exists return the original node */
+  if (eq_val(node->array[idx].val, val)) {
+
+    *result = UNCHANGED;
+    return (Node*)node;
+  }
+
+  /* otherwise copy the array replacing the value */
+  HashCollisionNode *new = new_hash_collision_node(alloc, hash, node->count);
+  memcpy(new->array, node->array, sizeof(Pair) * node->count);
+  new->array[idx].val = val;
+
+  *result = UPDATED;
+  return (Node*)new;
+}
+
+static Node *node_assoc(Allocator *alloc, Node *root, void *edit, void *key, void *val, \
+                        hash_t hash, equal_fn eq_key, equal_fn eq_val, Update *update, \
+                        int *result)
+{
+  /* the BitmapIndexedNodes walked through on the way down and the
+     edit token each can be changed in place with */
+  BitmapIndexedNode *path[MAX_DEPTH];
+  void *edits[MAX_DEPTH];
+
+  Node *node = root;
+  Node *new = NULL;
+  int level = 0;
+
+  *result = UNCHANGED;
+
+  /* walk down through the sub-nodes to the key's position */
+  while (node->tag == BITMAP_INDEXED) {
+
+    BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+    unsigned int bit = bitpos(hash, level);
+
+    /* nothing below a shared node can be changed in place */
+    if (node_shared(node)) { edit = NULL; }
+
+    if (bitmap->nodemap & bit) {
+      edits[level] = edit;
+      path[level++] = bitmap;
+      node = node_children(bitmap)[bit_index(bitmap->nodemap, bit)];
+      continue;
+    }
+
+    /* an empty position so store the new entry inline */
+    if (!(bitmap->datamap & bit)) {
+
+      if (!update_val(update, key, HASHMAP_NOT_FOUND, &val)) { return root; }
+
+      *result = ADDED;
+      new = (Node*)insert_entry(alloc, bitmap, edit, bit, key, val, hash);
+      break;
+    }
+
+    int idx = bit_index(bitmap->datamap, bit);
+    Entry *entry = &node_entries(bitmap)[idx];
+
+    /* a different key so push both entries down into a new sub-node */
+    if (entry->hash != hash || !eq_key(entry->key, key)) {
+
+      if (!update_val(update, key, HASHMAP_NOT_FOUND, &val)) { return root; }
+
+      Node *child = merge_entries(alloc, edit, (level + 1), entry, key, val, hash);
+
+      *result = ADDED;
+      new = (Node*)entry_to_child(alloc, bitmap, edit, bit, child);
+      break;
+    }
+
+    if (!update_val(update, key, entry->val, &val)) { return root; }
+
+    /* if the key/value pair already exists return the original root */
+    if (eq_val(entry->val, val)) { return root; }
+
+    /* otherwise replace the value */
+    BitmapIndexedNode *copy = edit_bitmap_indexed_node(alloc, bitmap, edit);
+    node_entries(copy)[idx].val = val;
+
+    *result = UPDATED;
+    new = (Node*)copy;
+    break;
+  }
+
+  /* the key's position is in a HashCollisionNode */
+  if (node->tag == HASH_COLLISION) {
+
+    new = hash_collision_assoc(alloc, (HashCollisionNode*)node, edit, level, key, val, hash, \
+                               eq_key, eq_val, update, result);
+    if (*result == UNCHANGED) { return root; }
+  }
+
+  /* copy the path back up to the root replacing each changed child */
+  while (level > 0) {
+
+    /* a node changed in place is already linked from its parent */
+    if (new == node) { return root; }
+
+    BitmapIndexedNode *parent = path[--level];
+    int idx = bit_index(parent->nodemap, bitpos(hash, level));
+
+    BitmapIndexedNode *copy = edit_bitmap_indexed_node(alloc, parent, edits[level]);
+    node_children(copy)[idx] = new;
+    node_release(alloc, node);
+
+    node = (Node*)parent;
+    new = (Node*)copy;
+  }
+  return new;
+}
+
+static Node *hash_collision_dissoc(Allocator *alloc, HashCollisionNode *node, void *key, \
+                                   hash_t hash, equal_fn eq_key, int *result)
+{
+  /* all the keys in the node share a single hash */
+  if (node->hash != hash) { return (Node*)node; }
+
+  /* not found */
+  int idx = hash_collision_index(node, key, eq_key);
+  if (idx < 0) { return (Node*)node; }
+
+  /* copy the array without the removed pair. if only one
+     is left the parent pulls it up */
+  HashCollisionNode *new = new_hash_collision_node(alloc, hash, node->count - 1);
+  memcpy(new->array, node->array, sizeof(Pair) * idx);
+  memcpy(new->array + idx, node->array + idx + 1, sizeof(Pair) * (node->count - idx - 1));
+
+  *result = REMOVED;
+  return (Node*)new;
+}
+
+static Node *node_dissoc(Allocator *alloc, Node *root, void *edit, void *key, hash_t hash, \
+                         equal_fn eq_key, int *result)
+{
+  /* the BitmapIndexedNodes walked through on the way down and the
+     edit token each can be changed in place with */
+  BitmapIndexedNode *path[MAX_DEPTH];
+  void *edits[MAX_DEPTH];
+
+  Node *node = root;
+  Node *new = NULL;
+  int level = 0;
+
+  *result = UNCHANGED;
+
+  /* walk down through the sub-nodes to the key's position */
+  while (node->tag == BITMAP_INDEXED) {
+
+    BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+    unsigned int bit = bitpos(hash, level);
+
+    /* nothing below a shared node can be changed in place */
+    if (node_shared(node)) { edit = NULL; }
+
+    if (bitmap->nodemap & bit) {
+      edits[level] = edit;
+      path[level++] = bitmap;
+      node = node_children(bitmap)[bit_index(bitmap->nodemap, bit)];
+      continue;
+    }
+
+    /* key doesn't exist in bitmap */
+    if (!(bitmap->datamap & bit)) { return root; }
+
+    /* not found */
+    Entry *entry = &node_entries(bitmap)[bit_index(bitmap->datamap, bit)];
+    if (entry->hash != hash || !eq_key(entry->key, key)) { return root; }
 
-  if (eq_key(node->key, key)) {
     *result = REMOVED;
+
+    /* removing the last entry leaves an empty map */
+    if (!bitmap->nodemap && popcount(bitmap->datamap) == 1) { return NULL; }
+
+    new = collapse(alloc, remove_entry(alloc, bitmap, edit, bit), bitmap, level);
+    break;
+  }
+
+  /* the key's position is in a HashCollisionNode */
+  if (node->tag == HASH_COLLISION) {
+
+    new = hash_collision_dissoc(alloc, (HashCollisionNode*)node, key, hash, eq_key, result);
+    if (*result == UNCHANGED) { return root; }
+  }
+
+  /* copy the path back up to the root replacing each changed child */
+  while (level > 0) {
+
+    /* a node changed in place is already linked from its parent */
+    if (new == node) { return root; }
+
+    BitmapIndexedNode *parent = path[--level];
+    unsigned int bit = bitpos(hash, level);
+
+    /* a sub-node left with a single entry is pulled up inline */
+    Entry entry;
+    if (single_entry(new, &entry)) {
+
+      BitmapIndexedNode *pulled = child_to_entry(alloc, parent, edits[level], bit, &entry);
+      node_release(alloc, new);
+
+      node = (Node*)parent;
+      new = collapse(alloc, pulled, parent, level);
+      continue;
+    }
+
+    /* otherwise replace the changed one */
+    BitmapIndexedNode *copy = edit_bitmap_indexed_node(alloc, parent, edits[level]);
+    node_children(copy)[bit_index(parent->nodemap, bit)] = new;
+    node_release(alloc, node);
+
+    node = (Node*)parent;
+    new = collapse(alloc, copy, parent, level);
+  }
+  return new;
+}
+
+/* the number of key/value pairs under node */
+static int node_count(Node *node)
+{
+  if (node->tag == HASH_COLLISION) {
+    return ((HashCollisionNode*)node)->count;
+  }
+
+  BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+  Node **children = node_children(bitmap);
+  int count = popcount(bitmap->datamap);
+
+  for (int i = 0; i < popcount(bitmap->nodemap); i++) {
+    count += node_count(children[i]);
+  }
+  return count;
+}
+
+/* the positions at level used by a slot. an entry or a HashCollisionNode
+   is treated as a sub-node at level holding just itself */
+static unsigned int slot_bitmap(Slot slot, int level)
+{
+  if (slot.entry) { return bitpos(slot.entry->hash, level); }
+
+  if (slot.node->tag == HASH_COLLISION) {
+    return bitpos(((HashCollisionNode*)slot.node)->hash, level);
+  }
+
+  BitmapIndexedNode *bitmap = (BitmapIndexedNode*)slot.node;
+  return bitmap->datamap | bitmap->nodemap;
+}
+
+/* the contents of position bit at level of a slot */
+static Slot slot_at(Slot slot, int level, unsigned int bit)
+{
+  Slot empty = {NULL, NULL};
+
+  if (!(slot_bitmap(slot, level) & bit)) { return empty; }
+
+  if (slot.entry || slot.node->tag == HASH_COLLISION) { return slot; }
+
+  BitmapIndexedNode *bitmap = (BitmapIndexedNode*)slot.node;
+  Slot found = {NULL, NULL};
+
+  if (bitmap->datamap & bit) {
+    found.entry = &node_entries(bitmap)[bit_index(bitmap->datamap, bit)];
+  }
+  else {
+    found.node = node_children(bitmap)[bit_index(bitmap->nodemap, bit)];
+  }
+  return found;
+}
+
+/* an entry or a HashCollisionNode as a HashCollisionNode */
+static HashCollisionNode *slot_collision(Allocator *alloc, Slot slot)
+{
+  if (slot.entry) {
+
+    HashCollisionNode *collision = new_hash_collision_node(alloc, slot.entry->hash, 1);
+    collision->array[0].key = slot.entry->key;
+    collision->array[0].val = slot.entry->val;
+    return collision;
+  }
+  return (HashCollisionNode*)slot.node;
+}
+
+/* the hash of an entry or a HashCollisionNode */
+static int slot_hash(Slot slot, hash_t *hash)
+{
+  if (slot.entry) {
+    *hash = slot.entry->hash;
+    return 1;
+  }
+  if (slot.node->tag == HASH_COLLISION) {
+    *hash = ((HashCollisionNode*)slot.node)->hash;
+    return 1;
+  }
+  return 0;
+}
+
+/* the value for a key in both maps. the value from a is kept if they're equal */
+static void *merge_val(void *key, void *val_a, void *val_b, equal_fn eq_val, merge_fn resolve)
+{
+  if (eq_val(val_a, val_b)) { return val_a; }
+
+  return resolve ? resolve(key, val_a, val_b) : val_b;
+}
+
+/* merge two HashCollisionNodes with the same hash */
+static Node *merge_collisions(Allocator *alloc, HashCollisionNode *a, HashCollisionNode *b, \
+                              equal_fn eq_key, equal_fn eq_val, merge_fn resolve, int *added)
+{
+  int changed = 0;
+  int n_added = 0;
+
+  /* if every key in b is already in a with an equal value keep a */
+  for (int i = 0; i < b->count; i++) {
+
+    int idx = hash_collision_index(a, b->array[i].key, eq_key);
+
+    if (idx < 0) { n_added++; }
+    else if (!eq_val(a->array[idx].val, b->array[i].val)) { changed = 1; }
+  }
+  if (!changed && !n_added) { return node_retain((Node*)a); }
+
+  /* copy the keys in a with their merged values followed by the keys only in b */
+  HashCollisionNode *new = new_hash_collision_node(alloc, a->hash, a->count + n_added);
+  memcpy(new->array, a->array, sizeof(Pair) * a->count);
+
+  int next = a->count;
+  for (int i = 0; i < b->count; i++) {
+
+    int idx = hash_collision_index(a, b->array[i].key, eq_key);
+
+    if (idx < 0) { new->array[next++] = b->array[i]; }
+    else {
+      new->array[idx].val = merge_val(a->array[idx].key, a->array[idx].val, \
+                                      b->array[i].val, eq_val, resolve);
+    }
+  }
+  *added += n_added;
+  return (Node*)new;
+}
+
+/* merge the contents of the same position in a and b where any sub-node is at
+   level. returns the merged sub-node, or NULL with the merged entry in entry.
+   sub-nodes of b made with alloc_b are copied when it isn't alloc */
+static Node *merge_slots(Allocator *alloc, Allocator *alloc_b, Slot a, Slot b, int level, \
+                         equal_fn eq_key, equal_fn eq_val, merge_fn resolve, int *added, \
+                         Entry *entry)
+{
+  /* only in b - use it as it is */
+  if (!a.entry && !a.node) {
+
+    if (b.entry) {
+      (*added)++;
+      *entry = *b.entry;
+      return NULL;
+    }
+    *added += node_count(b.node);
+    return (alloc_b == alloc) ? node_retain(b.node) : promote_node(alloc, b.node);
+  }
+
+  /* only in a or shared by both - use it as it is */
+  if ((!b.entry && !b.node) || (a.node && a.node == b.node)) {
+
+    if (a.entry) {
+      *entry = *a.entry;
+      return NULL;
+    }
+    return node_retain(a.node);
+  }
+
+  if (a.entry && b.entry) {
+
+    /* the same key so merge the values */
+    if (a.entry->hash == b.entry->hash && eq_key(a.entry->key, b.entry->key)) {
+
+      *entry = *a.entry;
+      entry->val = merge_val(a.entry->key, a.entry->val, b.entry->val, eq_val, resolve);
+      return NULL;
+    }
+
+    /* otherwise both entries go in a new sub-node */
+    (*added)++;
+    return merge_entries(alloc, NULL, level, a.entry, b.entry->key, b.entry->val, b.entry->hash);
+  }
+
+  /* entries and HashCollisionNodes with the same hash go in a single HashCollisionNode */
+  hash_t hash_a, hash_b;
+  if (slot_hash(a, &hash_a) && slot_hash(b, &hash_b) && hash_a == hash_b) {
+
+    HashCollisionNode *collision_a = slot_collision(alloc, a);
+    HashCollisionNode *collision_b = slot_collision(alloc, b);
+    Node *merged = merge_collisions(alloc, collision_a, collision_b, eq_key, eq_val, resolve, \
+                                    added);
+
+    /* drop the ones made from entries */
+    if (a.entry) { node_release(alloc, (Node*)collision_a); }
+    if (b.entry) { node_release(alloc, (Node*)collision_b); }
+
+    return merged;
+  }
+
+  /* otherwise merge them position by position */
+  return merge_positions(alloc, alloc_b, a, b, level, eq_key, eq_val, resolve, added);
+}
+
+/* merge two slots into a BitmapIndexedNode at level. where nothing
+   from b changes the node in a it's returned as it is */
+static Node *merge_positions(Allocator *alloc, Allocator *alloc_b, Slot a, Slot b, int level, \
+                             equal_fn eq_key, equal_fn eq_val, merge_fn resolve, int *added)
+{
+  Entry entries[32];
+  Node *children[32];
+  unsigned int datamap = 0;
+  unsigned int nodemap = 0;
+  int n_entries = 0;
+  int n_children = 0;
+
+  /* an entry or a HashCollisionNode in a always becomes a new node */
+  int changed = (a.entry || a.node->tag == HASH_COLLISION);
+
+  unsigned int positions = slot_bitmap(a, level) | slot_bitmap(b, level);
+  for (; positions; positions &= positions - 1) {
+
+    unsigned int bit = positions & -positions;
+    Slot slot_a = slot_at(a, level, bit);
+    Slot slot_b = slot_at(b, level, bit);
+
+    Entry *entry = &entries[n_entries];
+    Node *child = merge_slots(alloc, alloc_b, slot_a, slot_b, level + 1, eq_key, eq_val, \
+                              resolve, added, entry);
+    if (child) {
+      nodemap |= bit;
+      children[n_children++] = child;
+      changed |= (child != slot_a.node);
+    }
+    else {
+      datamap |= bit;
+      n_entries++;
+      changed |= (!slot_a.entry || entry->key != slot_a.entry->key || \
+                  entry->val != slot_a.entry->val);
+    }
+  }
+  if (!changed) {
+
+    /* the children are a's own */
+    for (int i = 0; i < n_children; i++) { node_release(alloc, children[i]); }
+    return node_retain(a.node);
+  }
+
+  BitmapIndexedNode *node = new_bitmap_indexed_node(alloc, NULL, datamap, nodemap);
+  memcpy(node_entries(node), entries, sizeof(Entry) * n_entries);
+  memcpy(node_children(node), children, sizeof(Node*) * n_children);
+
+  return collapse(alloc, node, NULL, level);
+}
+
+/* true if both HashCollisionNodes hold the same keys and values */
+static int hash_collision_equal(HashCollisionNode *a, HashCollisionNode *b, \
+                                equal_fn eq_key, equal_fn eq_val)
+{
+  if (a->hash != b->hash || a->count != b->count) { return 0; }
+
+  /* the pairs can be in different orders */
+  for (int i = 0; i < a->count; i++) {
+
+    int idx = hash_collision_index(b, a->array[i].key, eq_key);
+    if (idx < 0 || !eq_val(a->array[i].val, b->array[idx].val)) { return 0; }
+  }
+  return 1;
+}
+
+/* true if both nodes hold the same keys and values. sub-nodes shared by both
+   are equal without looking inside them. relies on the tries being built
+   with the same hash function so the same keys are in the same positions */
+static int node_equal(Node *a, Node *b, equal_fn eq_key, equal_fn eq_val)
+{
+  if (a == b) { return 1; }
+  if (a->tag != b->tag) { return 0; }
+
+  if (a->tag == HASH_COLLISION) {
+    return hash_collision_equal((HashCollisionNode*)a, (HashCollisionNode*)b, eq_key, eq_val);
+  }
+
+  BitmapIndexedNode *bitmap_a = (BitmapIndexedNode*)a;
+  BitmapIndexedNode *bitmap_b = (BitmapIndexedNode*)b;
+
+  if (bitmap_a->datamap != bitmap_b->datamap || bitmap_a->nodemap != bitmap_b->nodemap) {
+    return 0;
+  }
+
+  Entry *entries_a = node_entries(bitmap_a);
+  Entry *entries_b = node_entries(bitmap_b);
+
+  for (int i = 0; i < popcount(bitmap_a->datamap); i++) {
+
+    if (entries_a[i].hash != entries_b[i].hash || \
+        !eq_key(entries_a[i].key, entries_b[i].key) || \
+        !eq_val(entries_a[i].val, entries_b[i].val)) {
+      return 0;
+    }
+  }
+
+  Node **children_a = node_children(bitmap_a);
+  Node **children_b = node_children(bitmap_b);
+
+  for (int i = 0; i < popcount(bitmap_a->nodemap); i++) {
+    if (!node_equal(children_a[i], children_b[i], eq_key, eq_val)) { return 0; }
+  }
+  return 1;
+}
+
+/* true if every key in node is in map with an equal value. a key
+   missing from map isn't the same as one with a NULL value */
+static int node_contains(Node *node, Hashmap *map, equal_fn eq_val)
+{
+  if (node->tag == HASH_COLLISION) {
+
+    HashCollisionNode *collision = (HashCollisionNode*)node;
+
+    for (int i = 0; i < collision->count; i++) {
+
+      void *key = collision->array[i].key;
+      void **val = node_find(map->root, key, map->hash(key), map->eq_key);
+      if (!val || !eq_val(collision->array[i].val, *val)) { return 0; }
+    }
+    return 1;
+  }
+
+  BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+  Entry *entries = node_entries(bitmap);
+  Node **children = node_children(bitmap);
+
+  for (int i = 0; i < popcount(bitmap->datamap); i++) {
+
+    void **val = node_find(map->root, entries[i].key, map->hash(entries[i].key), map->eq_key);
+    if (!val || !eq_val(entries[i].val, *val)) { return 0; }
+  }
+  for (int i = 0; i < popcount(bitmap->nodemap); i++) {
+    if (!node_contains(children[i], map, eq_val)) { return 0; }
+  }
+  return 1;
+}
+
+/* apply fn to every key/value pair in a slot */
+static void visit_slot(Slot slot, visit_fn fn, void **acc)
+{
+  if (!fn) { return; }
+
+  if (slot.entry) { fn(slot.entry->key, slot.entry->val, acc); }
+  else if (slot.node) { node_visit(slot.node, fn, acc); }
+}
+
+/* report the differences between two HashCollisionNodes with the same hash */
+static void diff_collisions(HashCollisionNode *old, HashCollisionNode *new, Diff *diff)
+{
+  for (int i = 0; i < old->count; i++) {
+
+    Pair *pair = &old->array[i];
+    int idx = hash_collision_index(new, pair->key, diff->eq_key);
+
+    if (idx < 0) {
+      if (diff->on_removed) { diff->on_removed(pair->key, pair->val, diff->acc); }
+    }
+    else if (!diff->eq_val(pair->val, new->array[idx].val)) {
+      if (diff->on_changed) {
+        diff->on_changed(pair->key, pair->val, new->array[idx].val, diff->acc);
+      }
+    }
+  }
+
+  for (int i = 0; i < new->count; i++) {
+
+    Pair *pair = &new->array[i];
+    if (hash_collision_index(old, pair->key, diff->eq_key) < 0 && diff->on_added) {
+      diff->on_added(pair->key, pair->val, diff->acc);
+    }
+  }
+}
+
+/* report the differences between the contents of the same position
+   in two maps where any sub-node is at level */
+static void diff_slots(Slot old, Slot new, int level, Diff *diff)
+{
+  /* sub-nodes shared by both versions have no differences */
+  if (old.node && old.node == new.node) { return; }
+
+  if (!old.entry && !old.node) {
+    visit_slot(new, diff->on_added, diff->acc);
+    return;
+  }
+  if (!new.entry && !new.node) {
+    visit_slot(old, diff->on_removed, diff->acc);
+    return;
+  }
+
+  if (old.entry && new.entry) {
+
+    /* the same key so check the value */
+    if (old.entry->hash == new.entry->hash && diff->eq_key(old.entry->key, new.entry->key)) {
+
+      if (!diff->eq_val(old.entry->val, new.entry->val) && diff->on_changed) {
+        diff->on_changed(old.entry->key, old.entry->val, new.entry->val, diff->acc);
+      }
+      return;
+    }
+    visit_slot(old, diff->on_removed, diff->acc);
+    visit_slot(new, diff->on_added, diff->acc);
+    return;
+  }
+
+  /* entries and HashCollisionNodes with the same hash are compared as HashCollisionNodes */
+  hash_t hash_old, hash_new;
+  if (slot_hash(old, &hash_old) && slot_hash(new, &hash_new) && hash_old == hash_new) {
+
+    HashCollisionNode *collision_old = slot_collision(diff->alloc, old);
+    HashCollisionNode *collision_new = slot_collision(diff->alloc, new);
+    diff_collisions(collision_old, collision_new, diff);
+
+    /* drop the ones made from entries */
+    if (old.entry) { node_release(diff->alloc, (Node*)collision_old); }
+    if (new.entry) { node_release(diff->alloc, (Node*)collision_new); }
+    return;
+  }
+
+  /* otherwise compare them position by position */
+  unsigned int positions = slot_bitmap(old, level) | slot_bitmap(new, level);
+  for (; positions; positions &= positions - 1) {
+
+    unsigned int bit = positions & -positions;
+    diff_slots(slot_at(old, level, bit), slot_at(new, level, bit), level + 1, diff);
+  }
+}
+
+static void node_visit(Node *node, visit_fn fn, void **acc)
+{
+  if (node->tag == HASH_COLLISION) {
+
+    HashCollisionNode *collision = (HashCollisionNode*)node;
+
+    for (int i = 0; i < collision->count; i++) {
+      fn(collision->array[i].key, collision->array[i].val, acc);
+    }
+    return;
+  }
+
+  BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+  Entry *entries = node_entries(bitmap);
+  Node **children = node_children(bitmap);
+
+  int n_entries = popcount(bitmap->datamap);
+  for (int i = 0; i < n_entries; i++) {
+    fn(entries[i].key, entries[i].val, acc);
+  }
+
+  int n_children = popcount(bitmap->nodemap);
+  for (int i = 0; i < n_children; i++) {
+    node_visit(children[i], fn, acc);
+  }
+}
+
+/* add the nodes below and including node at depth to stats */
+static void node_stats(Node *node, int depth, HashmapStats *stats)
+{
+  stats->bytes += node_bytes(node);
+  if (depth > stats->max_depth) { stats->max_depth = depth; }
+
+  int d = (depth < HASHMAP_STATS_DEPTHS) ? depth : HASHMAP_STATS_DEPTHS - 1;
+
+  if (node->tag == HASH_COLLISION) {
+
+    int count = ((HashCollisionNode*)node)->count;
+
+    stats->collision_nodes++;
+    stats->depth[d] += count;
+    if (count > stats->max_collision) { stats->max_collision = count; }
+    return;
+  }
+
+  BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+  Node **children = node_children(bitmap);
+  int n_entries = popcount(bitmap->datamap);
+
+  stats->bitmap_nodes++;
+  stats->inline_entries += n_entries;
+  stats->depth[d] += n_entries;
+
+  for (int i = 0; i < popcount(bitmap->nodemap); i++) {
+    node_stats(children[i], depth + 1, stats);
+  }
+}
+
+/* the bytes allocated for a single node */
+static size_t node_bytes(Node *node)
+{
+  if (node->tag == HASH_COLLISION) {
+
+    HashCollisionNode *collision = (HashCollisionNode*)node;
+    return sizeof(*collision) + sizeof(Pair) * collision->count;
+  }
+
+  BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+  return sizeof(*bitmap) + array_size(bitmap->datamap, bitmap->nodemap);
+}
+
+/* the bytes of all the nodes below and including node */
+static size_t subtrie_bytes(Node *node)
+{
+  size_t bytes = node_bytes(node);
+  if (node->tag == HASH_COLLISION) { return bytes; }
+
+  BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+  Node **children = node_children(bitmap);
+
+  for (int i = 0; i < popcount(bitmap->nodemap); i++) {
+    bytes += subtrie_bytes(children[i]);
+  }
+  return bytes;
+}
+
+/* the bytes of the nodes in both a and b, which are at the same position
+   at level. a node shared by both is at the same position in each, except
+   that a HashCollisionNode can be a level higher in one where the sub-node
+   above it has been collapsed */
+static size_t shared_bytes(Node *a, Node *b, int level)
+{
+  if (a == b) { return subtrie_bytes(a); }
+
+  /* look for a HashCollisionNode in the matching position of the other */
+  if (a->tag == HASH_COLLISION && b->tag == HASH_COLLISION) { return 0; }
+
+  if (a->tag == HASH_COLLISION || b->tag == HASH_COLLISION) {
+
+    Node *collision = (a->tag == HASH_COLLISION) ? a : b;
+    BitmapIndexedNode *bitmap = (BitmapIndexedNode*)((a == collision) ? b : a);
+    unsigned int bit = bitpos(((HashCollisionNode*)collision)->hash, level);
+
+    if (!(bitmap->nodemap & bit)) { return 0; }
+
+    Node *child = node_children(bitmap)[bit_index(bitmap->nodemap, bit)];
+    return shared_bytes(child, collision, level + 1);
+  }
+
+  /* otherwise compare the sub-nodes in the positions both have */
+  BitmapIndexedNode *bitmap_a = (BitmapIndexedNode*)a;
+  BitmapIndexedNode *bitmap_b = (BitmapIndexedNode*)b;
+  size_t bytes = 0;
+
+  unsigned int positions = bitmap_a->nodemap & bitmap_b->nodemap;
+  for (; positions; positions &= positions - 1) {
+
+    unsigned int bit = positions & -positions;
+    bytes += shared_bytes(node_children(bitmap_a)[bit_index(bitmap_a->nodemap, bit)], \
+                          node_children(bitmap_b)[bit_index(bitmap_b->nodemap, bit)], \
+                          level + 1);
+  }
+  return bytes;
+}
+
+/* the same walk as node_visit but returning as soon as fn sets reduced */
+static void *node_reduce(Node *node, reduce_kv_fn fn, void *acc, int *reduced)
+{
+  if (node->tag == HASH_COLLISION) {
+
+    HashCollisionNode *collision = (HashCollisionNode*)node;
+
+    for (int i = 0; i < collision->count && !*reduced; i++) {
+      acc = fn(acc, collision->array[i].key, collision->array[i].val, reduced);
+    }
+    return acc;
+  }
+
+  BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+  Entry *entries = node_entries(bitmap);
+  Node **children = node_children(bitmap);
+
+  int n_entries = popcount(bitmap->datamap);
+  for (int i = 0; i < n_entries && !*reduced; i++) {
+    acc = fn(acc, entries[i].key, entries[i].val, reduced);
+  }
+
+  int n_children = popcount(bitmap->nodemap);
+  for (int i = 0; i < n_children && !*reduced; i++) {
+    acc = node_reduce(children[i], fn, acc, reduced);
+  }
+  return acc;
+}
+
+/* run fn on n workers each size bytes long. the first is run on the calling
+   thread and the rest on new threads, or also on the calling thread if their
+   thread can't be started. alloc holds the threads meanwhile */
+static void run_workers(Allocator *alloc, void *(*fn)(void *), void *workers, size_t size, \
+                        int n)
+{
+  pthread_t *threads = allocator_alloc_atomic(alloc, sizeof(pthread_t) * n);
+  int *started = allocator_alloc_atomic(alloc, sizeof(int) * n);
+
+  for (int i = 1; i < n; i++) {
+    started[i] = !pthread_create(&threads[i], NULL, fn, (char*)workers + (size * i));
+  }
+  fn(workers);
+
+  for (int i = 1; i < n; i++) {
+    if (started[i]) { pthread_join(threads[i], NULL); }
+    else { fn((char*)workers + (size * i)); }
+  }
+
+  allocator_free(alloc, threads);
+  allocator_free(alloc, started);
+}
+
+/* hash a slice of the keys and count how many go in each position at the root */
+static void *build_hash_worker(void *arg)
+{
+  BuildWorker *worker = arg;
+  BuildTasks *tasks = worker->tasks;
+
+  for (int i = worker->start; i < worker->end; i++) {
+
+    Entry *entry = &tasks->entries[i];
+    entry->key = tasks->keys[i];
+    entry->val = tasks->vals[i];
+    entry->hash = tasks->hash(entry->key);
+
+    worker->offsets[mask(entry->hash, 0)]++;
+  }
+  return NULL;
+}
+
+/* copy a slice of the entries to the space for their positions at the root */
+static void *build_scatter_worker(void *arg)
+{
+  BuildWorker *worker = arg;
+  BuildTasks *tasks = worker->tasks;
+
+  for (int i = worker->start; i < worker->end; i++) {
+
+    Entry *entry = &tasks->entries[i];
+    tasks->scratch[worker->offsets[mask(entry->hash, 0)]++] = *entry;
+  }
+  return NULL;
+}
+
+/* build the sub-nodes for the next position at the root until there are none left */
+static void *build_child_worker(void *arg)
+{
+  BuildWorker *worker = arg;
+  BuildTasks *tasks = worker->tasks;
+
+  int pos;
+  while ((pos = __atomic_fetch_add(&tasks->next, 1, __ATOMIC_RELAXED)) < 32) {
+
+    int start = tasks->starts[pos];
+    int size = tasks->sizes[pos];
+
+    if (size == 1) {
+      tasks->inline_entries[pos] = tasks->scratch[start];
+      tasks->counts[pos] = 1;
+    }
+    else if (size > 1) {
+      tasks->children[pos] = build_node(tasks->alloc, tasks->scratch + start, \
+                                        tasks->entries + start, size, 1, tasks->eq_key, \
+                                        &tasks->inline_entries[pos], &tasks->counts[pos]);
+    }
+  }
+  return NULL;
+}
+
+/* visit sub-tries from the shared tasks until there are none left */
+static void *visit_worker(void *arg)
+{
+  VisitWorker *worker = arg;
+  VisitTasks *tasks = worker->tasks;
+
+  int i;
+  while ((i = __atomic_fetch_add(&tasks->next, 1, __ATOMIC_RELAXED)) < tasks->count) {
+    node_visit(tasks->nodes[i], tasks->fn, &worker->acc);
+  }
+  return NULL;
+}
+
+/* move the cursor on to the next entry. returns 0 at the end of the map */
+static int cursor_advance(Cursor *cursor)
+{
+  if (cursor->image) { return image_cursor_advance(cursor); }
+
+  while (cursor->depth > 0) {
+
+    Frame *frame = &cursor->stack[cursor->depth - 1];
+
+    /* the frame holds the next pair in a HashCollisionNode */
+    if (frame->node->tag == HASH_COLLISION) {
+
+      HashCollisionNode *collision = (HashCollisionNode*)frame->node;
+      Pair *pair = &collision->array[frame->idx++];
+      cursor->key = pair->key;
+      cursor->val = pair->val;
+
+      /* pop the frame after the last pair */
+      if (frame->idx == collision->count) { cursor->depth--; }
+      return 1;
+    }
+
+    BitmapIndexedNode *bitmap = (BitmapIndexedNode*)frame->node;
+    int n_entries = popcount(bitmap->datamap);
+    int n_children = popcount(bitmap->nodemap);
+
+    /* the inline entries come first */
+    if (frame->idx < n_entries) {
+
+      Entry *entry = &node_entries(bitmap)[frame->idx++];
+      cursor->key = entry->key;
+      cursor->val = entry->val;
+      return 1;
+    }
+
+    /* then push each sub-node in turn */
+    if (frame->idx < n_entries + n_children) {
+
+      Frame *child = &cursor->stack[cursor->depth++];
+      child->node = node_children(bitmap)[frame->idx++ - n_entries];
+      child->idx = 0;
+      continue;
+    }
+
+    /* pop the finished node */
+    cursor->depth--;
+  }
+  return 0;
+}
+
+/* the cursor of a hashmap iterator follows it in the same allocation */
+static Cursor *iter_cursor(Iterator *iter)
+{
+  return (Cursor*)(iter + 1);
+}
+
+/* function to advance the iterator */
+static Iterator *hashmap_next_fn(Iterator *iter)
+{
+  assert(iter);
+
+  /* the value follows the key */
+  if (!iter->data) {
+    Iterator *new = iterator_step(iter);
+    new->value = iter_cursor(new)->val;
+    new->data = (void *)1;
+    return new;
+  }
+
+  /* the cursor is part of the iterator so a copy leaves
+     earlier iterators unaffected */
+  Iterator *new = iterator_step(iter);
+  Cursor *next = iter_cursor(new);
+
+  /* check for the end of the data */
+  if (!cursor_advance(next)) {
+    iterator_release(new);
     return NULL;
   }
-  else {
-    /* not found */
-    *result = UNCHANGED;
-    return self;
+
+  new->value = next->key;
+  new->data = (void *)0;
+
+  return new;
+}
+
+/* add size bytes to the buffer, writing it out whenever it fills */
+static void write_bytes(Writer *writer, const void *data, size_t size)
+{
+  writer->offset += size;
+
+  while (size > 0 && !writer->failed) {
+
+    size_t n = WRITE_BUFFER_SIZE - writer->used;
+    if (n > size) { n = size; }
+
+    memcpy(writer->buf + writer->used, data, n);
+    writer->used += n;
+    data = (const char*)data + n;
+    size -= n;
+
+    if (writer->used == WRITE_BUFFER_SIZE) { write_flush(writer); }
   }
 }
 
-static Node *bitmap_indexed_dissoc(Node *self, int level, void *key, hash_t hash, \
-                                   equal_fn eq_key, equal_fn eq_val, int *result)
+static void write_flush(Writer *writer)
 {
-  BitmapIndexedNode *node = (BitmapIndexedNode*)self;
+  const char *buf = writer->buf;
 
-  int bit = bitpos(hash, level);
-  int idx = bit_index(node->bitmap, bit);
+  while (writer->used > 0 && !writer->failed) {
 
-  /* a child node already exists */
-  if (node->bitmap & bit) {
+    ssize_t n = write(writer->fd, buf, writer->used);
 
-    /* dissoc a child node at the correct index */
-    Node *child = node->children[idx];
-    Node *new = child->type->dissoc(child, (level + 1), key, hash, \
-                                    eq_key, eq_val, result);
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n <= 0) {
+      writer->failed = 1;
+      return;
+    }
+    buf += n;
+    writer->used -= n;
+  }
+}
 
-    if (*result != UNCHANGED) {
+/* write obj with its size, unless it has been written already, and return its offset */
+static uint64_t write_encoded(Writer *writer, HashmapCodec *codec, IdentityTable *table, \
+                              void *obj)
+{
+  uint64_t offset = identity_get(table, (uintptr_t)obj);
+  if (offset) { return offset; }
 
-      /* copy the node */
-      BitmapIndexedNode *copy = copy_bitmap_indexed_node(node);
+  offset = writer->offset;
+  identity_put(table, (uintptr_t)obj, offset);
 
-      /* if the new node is now empty */
-      if (!new) {
-        /* clear bit */
-	copy->bitmap &= ~bit;
+  uint64_t size = codec->size(obj);
+  size_t padded = (size + 7) & ~(uint64_t)7;
 
-        /* if the whole BitmapIndexedNode is now empty return NULL instead */
-        if (!copy->bitmap) { return NULL; }
+  write_bytes(writer, &size, sizeof(size));
 
-        /* count the number of 1s in the whole bitmap */
-	int nodes = popcount(copy->bitmap);
+  /* encode straight into the buffer if there's room */
+  if (padded > WRITE_BUFFER_SIZE - writer->used) { write_flush(writer); }
 
-        /* allocate storage dynamically */
-	copy->children = GC_MALLOC(sizeof(Node*) * nodes);
+  if (padded <= WRITE_BUFFER_SIZE - writer->used) {
 
-        /* copy all the existing child nodes */
-        memcpy(copy->children, node->children, sizeof(Node*) * idx);
-        /* shifting over the ones at > idx to replace the deleted one */
-        memcpy(&copy->children[idx], &node->children[idx + 1], sizeof(Node*) * (nodes - idx));
+    char *buf = writer->buf + writer->used;
+    memset(buf + size, 0, padded - size);
+    codec->encode(obj, buf);
 
-        return (Node*)copy;
-      }
-      else {
-        /* count the number of 1s in the bitmap */
-	int nodes = popcount(copy->bitmap);
+    writer->used += padded;
+    writer->offset += padded;
+    return offset;
+  }
 
-        /* allocate storage dynamically */
-	copy->children = GC_MALLOC(sizeof(Node*) * nodes);
+  char *buf = allocator_alloc_atomic(writer->alloc, padded);
+  memset(buf + size, 0, padded - size);
+  codec->encode(obj, buf);
+  write_bytes(writer, buf, padded);
+  allocator_free(writer->alloc, buf);
 
-        /* copy all the existing child nodes */
-        memcpy(copy->children, node->children, sizeof(Node*) * nodes);
-        /* replace the changed one */
-        copy->children[idx] = new;
+  return offset;
+}
 
-        return (Node*)copy;
-      }
+/* write the keys, values and sub-nodes of node and then node itself unless
+   it has been written already as part of another version. returns the
+   offset of node */
+static uint64_t write_node(Writer *writer, Node *node, HashmapCodec *key_codec, \
+                           HashmapCodec *val_codec)
+{
+  uint64_t offset = identity_get(writer->nodes, (uintptr_t)node);
+  if (offset) { return offset; }
+
+  ImageNode header = {node->tag, 0, 0, 0, 0};
+
+  if (node->tag == HASH_COLLISION) {
+
+    HashCollisionNode *collision = (HashCollisionNode*)node;
+    ImagePair *pairs = allocator_alloc_atomic(writer->alloc, sizeof(ImagePair) * collision->count);
+
+    for (int i = 0; i < collision->count; i++) {
+      pairs[i].key = write_encoded(writer, key_codec, writer->keys, collision->array[i].key);
+      pairs[i].val = write_encoded(writer, val_codec, writer->vals, collision->array[i].val);
     }
-    else {
-      return self;
+    header.count = collision->count;
+    header.hash = collision->hash;
+
+    offset = writer->offset;
+    write_bytes(writer, &header, sizeof(header));
+    write_bytes(writer, pairs, sizeof(ImagePair) * collision->count);
+    allocator_free(writer->alloc, pairs);
+
+    identity_put(writer->nodes, (uintptr_t)node, offset);
+    return offset;
+  }
+
+  BitmapIndexedNode *bitmap = (BitmapIndexedNode*)node;
+  Entry *entries = node_entries(bitmap);
+  Node **children = node_children(bitmap);
+  int n_entries = popcount(bitmap->datamap);
+  int n_children = popcount(bitmap->nodemap);
+
+  ImageEntry image_entries[32];
+  uint64_t image_children[32];
+
+  for (int i = 0; i < n_entries; i++) {
+    image_entries[i].hash = entries[i].hash;
+    image_entries[i].key = write_encoded(writer, key_codec, writer->keys, entries[i].key);
+    image_entries[i].val = write_encoded(writer, val_codec, writer->vals, entries[i].val);
+  }
+  for (int i = 0; i < n_children; i++) {
+    image_children[i] = write_node(writer, children[i], key_codec, val_codec);
+  }
+  header.datamap = bitmap->datamap;
+  header.nodemap = bitmap->nodemap;
+
+  offset = writer->offset;
+  write_bytes(writer, &header, sizeof(header));
+  write_bytes(writer, image_entries, sizeof(ImageEntry) * n_entries);
+  write_bytes(writer, image_children, sizeof(uint64_t) * n_children);
+
+  identity_put(writer->nodes, (uintptr_t)node, offset);
+  return offset;
+}
+
+static size_t identity_slot(IdentityTable *table, uintptr_t key)
+{
+  size_t i = (size_t)(((uint64_t)key * 0x9e3779b97f4a7c15ull) >> 32) & (table->capacity - 1);
+
+  while (table->keys[i] && table->keys[i] != key) { i = (i + 1) & (table->capacity - 1); }
+  return i;
+}
+
+/* capacity must be a power of 2 */
+static void identity_init(IdentityTable *table, Allocator *alloc, size_t capacity)
+{
+  /* the keys are addresses or offsets that shouldn't keep anything alive */
+  table->alloc = alloc;
+  table->keys = allocator_alloc_atomic(alloc, sizeof(uintptr_t) * capacity);
+  memset(table->keys, 0, sizeof(uintptr_t) * capacity);
+  table->vals = allocator_alloc(alloc, sizeof(uintptr_t) * capacity);
+  table->capacity = capacity;
+  table->count = 0;
+}
+
+static void identity_free(IdentityTable *table)
+{
+  allocator_free(table->alloc, table->keys);
+  allocator_free(table->alloc, table->vals);
+}
+
+/* returns the value for key or 0 if there is none */
+static uintptr_t identity_get(IdentityTable *table, uintptr_t key)
+{
+  if (!key) { return 0; }
+  return table->vals[identity_slot(table, key)];
+}
+
+/* a key of 0 (a NULL key or value) isn't stored */
+static void identity_put(IdentityTable *table, uintptr_t key, uintptr_t val)
+{
+  if (!key) { return; }
+
+  /* keep the table at most half full */
+  if (2 * (table->count + 1) > table->capacity) {
+
+    IdentityTable old = *table;
+    identity_init(table, old.alloc, old.capacity * 2);
+
+    for (size_t i = 0; i < old.capacity; i++) {
+      if (old.keys[i]) { identity_put(table, old.keys[i], old.vals[i]); }
     }
+    identity_free(&old);
   }
-  /* node doesn't exist in bitmap */
-  else {
-    *result = UNCHANGED;
-    return self;
+
+  size_t i = identity_slot(table, key);
+  if (!table->keys[i]) { table->count++; }
+  table->keys[i] = key;
+  table->vals[i] = val;
+}
+
+/* read the rest of fd into a buffer that keys and values can be decoded in place in */
+static char *read_all(int fd, Allocator *alloc, size_t *size)
+{
+  struct stat st;
+  size_t capacity = 65536;
+
+  /* the whole of a file can be read at once */
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size >= capacity) {
+    capacity = st.st_size + 1;
+  }
+
+  char *buf = allocator_alloc_atomic(alloc, capacity);
+  size_t used = 0;
+
+  for (;;) {
+
+    if (used == capacity) {
+      char *bigger = allocator_alloc_atomic(alloc, capacity * 2);
+      memcpy(bigger, buf, used);
+      allocator_free(alloc, buf);
+      buf = bigger;
+      capacity *= 2;
+    }
+
+    ssize_t n = read(fd, buf + used, capacity - used);
+
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n < 0) {
+      allocator_free(alloc, buf);
+      return NULL;
+    }
+    if (n == 0) { break; }
+    used += n;
   }
+
+  *size = used;
+  return buf;
 }
 
-static Node *hash_collision_dissoc(Node *self, int level, void *key, hash_t hash, \
-                                   equal_fn eq_key, equal_fn eq_val, int *result)
+/* check the header and trailer of an image and return its table of versions */
+static const ImageVersion *image_versions(const char *base, size_t size, uint64_t *n)
 {
-  HashCollisionNode *head = (HashCollisionNode*)self;
-  HashCollisionNode *node = head;
+  if (size < sizeof(ImageHeader) + sizeof(ImageTrailer) || size % 8) { return NULL; }
 
-  /* check if the key exists */
-  while (node) {
-    if (eq_key(node->key, key)) {
-      /* found it - exit the loop */
-      break;
+  const ImageHeader *header = (const ImageHeader*)base;
+  const ImageTrailer *trailer = (const ImageTrailer*)(base + size - sizeof(*trailer));
+
+  if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 || \
+      header->version != IMAGE_VERSION || header->hash_size != sizeof(hash_t)) {
+    return NULL;
+  }
+
+  /* the nodes are between the header and the table */
+  uint64_t space = size - sizeof(*header) - sizeof(*trailer);
+  if (trailer->versions == 0 || trailer->versions > space / sizeof(ImageVersion)) {
+    return NULL;
+  }
+
+  uint64_t start = size - sizeof(*trailer) - sizeof(ImageVersion) * trailer->versions;
+  const ImageVersion *table = (const ImageVersion*)(base + start);
+
+  for (uint64_t i = 0; i < trailer->versions; i++) {
+
+    /* only an empty map has no root */
+    uint64_t root = table[i].root;
+    if (!root != !table[i].count) { return NULL; }
+    if (root && (root % 8 || root < sizeof(*header) || root + sizeof(ImageNode) > start)) {
+      return NULL;
     }
-    /* keep looking */
-    node = node->next;
   }
-  /* not found */
-  if (!node) {
-    *result = UNCHANGED;
-    return (Node*)node;
+
+  *n = trailer->versions;
+  return table;
+}
+
+static inline ImageNode *image_node(Image *image, uint64_t offset)
+{
+  return (ImageNode*)(image->base + offset);
+}
+
+static inline ImageEntry *image_entries(ImageNode *node)
+{
+  return (ImageEntry*)(node + 1);
+}
+
+static inline uint64_t *image_children(ImageNode *node)
+{
+  return (uint64_t*)(image_entries(node) + popcount(node->datamap));
+}
+
+static inline ImagePair *image_pairs(ImageNode *node)
+{
+  return (ImagePair*)(node + 1);
+}
+
+static inline void *image_decode(Image *image, HashmapCodec *codec, uint64_t offset)
+{
+  const uint64_t *size = (const uint64_t*)(image->base + offset);
+  return codec->decode(size + 1, *size);
+}
+
+/* check that root and everything below it lies before limit, so that
+   nothing read while walking the image can be outside it. checked holds
+   the nodes, keys and values already checked, e.g. as part of another
+   version */
+static int image_check(Image *image, IdentityTable *checked, uint64_t root, uint64_t limit)
+{
+  return !root || image_check_node(image, checked, root, limit, 0);
+}
+
+/* check the node at offset and everything below it. the writer puts each
+   node after the keys, values and sub-nodes it refers to, so all of them
+   must lie between the header and the node, and the node before limit,
+   the start of whatever refers to it. that also means a walk always ends.
+   depth is the level of the node and checked maps the offsets of the
+   nodes already checked to their heights, and those of keys and values
+   to IMAGE_ENCODED. returns the height of the node, which with depth has
+   to fit in a cursor, or 0 if it is corrupt */
+static int image_check_node(Image *image, IdentityTable *checked, uint64_t offset, \
+                            uint64_t limit, int depth)
+{
+  if (depth >= MAX_DEPTH || offset % 8 || offset < sizeof(ImageHeader) || offset >= limit || \
+      limit - offset < sizeof(ImageNode)) {
+    return 0;
   }
 
-  /* if the key is at the head and there are only two entries we
-     replace the HashCollisioNode with a LeaftNode */
-  if ((node == head) && node->next && !node->next->next) {
+  /* an offset read as a key or value can't be read as a node too */
+  uintptr_t seen = identity_get(checked, offset);
+  if (seen == IMAGE_ENCODED) { return 0; }
 
-    *result = REMOVED;
-    LeafNode *new = new_leaf_node(node->next->key, node->next->val, node->next->hash);
-    return (Node*)new;
+  int height = seen;
+  if (height) { return (depth + height <= MAX_DEPTH) ? height : 0; }
+
+  ImageNode *node = image_node(image, offset);
+  uint64_t space = limit - offset - sizeof(ImageNode);
+
+  if (node->tag == HASH_COLLISION) {
+
+    if (!node->count || node->count > space / sizeof(ImagePair)) { return 0; }
+
+    ImagePair *pairs = image_pairs(node);
+    for (uint32_t i = 0; i < node->count; i++) {
+      if (!image_check_encoded(image, checked, pairs[i].key, offset) || \
+          !image_check_encoded(image, checked, pairs[i].val, offset)) {
+        return 0;
+      }
+    }
+    height = 1;
+
+  } else {
+
+    int n_entries = popcount(node->datamap);
+    int n_children = popcount(node->nodemap);
+
+    if (node->tag != BITMAP_INDEXED || (node->datamap & node->nodemap) || \
+        sizeof(ImageEntry) * n_entries + sizeof(uint64_t) * n_children > space) {
+      return 0;
+    }
+
+    ImageEntry *entries = image_entries(node);
+    for (int i = 0; i < n_entries; i++) {
+      if (!image_check_encoded(image, checked, entries[i].key, offset) || \
+          !image_check_encoded(image, checked, entries[i].val, offset)) {
+        return 0;
+      }
+    }
+
+    /* a BitmapIndexedNode leaves room below it for a HashCollisionNode
+       so the level never runs past the bits of the hash */
+    height = 2;
+    uint64_t *children = image_children(node);
+    for (int i = 0; i < n_children; i++) {
+
+      int child = image_check_node(image, checked, children[i], offset, depth + 1);
+      if (!child) { return 0; }
+      if (child + 1 > height) { height = child + 1; }
+    }
   }
 
-  /* if the key is at the tail and there are only two entries we
-     replace the HashCollisioNnode with a LeaftNode */
-  if ((node == head->next) && !node->next) {
+  if (depth + height > MAX_DEPTH) { return 0; }
 
-    *result = REMOVED;
-    LeafNode *new = new_leaf_node(head->key, head->val, head->hash);
-    return (Node*)new;
+  identity_put(checked, offset, height);
+  return height;
+}
+
+/* check that the encoded key or value at offset lies before limit and
+   isn't also read as a node. it's marked in checked if so */
+static int image_check_encoded(Image *image, IdentityTable *checked, uint64_t offset, \
+                               uint64_t limit)
+{
+  if (offset % 8 || offset < sizeof(ImageHeader) || offset >= limit || \
+      limit - offset < sizeof(uint64_t)) {
+    return 0;
   }
 
-  /* if the key exists at the head of the list of more than
-     two entries we return the rest of the HashCollisionNodes */
-  if (node == (HashCollisionNode*)self) {
+  uintptr_t seen = identity_get(checked, offset);
+  if (seen == IMAGE_ENCODED) { return 1; }
+  if (seen) { return 0; }
 
-    *result = REMOVED;
-    return (Node*)node->next;
+  uint64_t size = *(const uint64_t*)(image->base + offset);
+  if (size > limit - offset - sizeof(uint64_t)) { return 0; }
+
+  identity_put(checked, offset, IMAGE_ENCODED);
+  return 1;
+}
+
+/* check the hash of the first key under root against the hash stored with it */
+static int image_check_hash(Image *image, uint64_t root, hash_fn hash)
+{
+  if (!root) { return 1; }
+
+  ImageNode *node = image_node(image, root);
+
+  /* every sub-node holds at least one key */
+  while (node->tag == BITMAP_INDEXED && !node->datamap) {
+    if (!node->nodemap) { return 0; }
+    node = image_node(image, image_children(node)[0]);
   }
 
-  /* otherwise the key is in the middle of a list so we
-     have to make a copy of the list from the head to
-     the removed key and connect it to the tail */
-  HashCollisionNode *prev = node->next;
-  HashCollisionNode *curr = head;
-  HashCollisionNode *copy = NULL;
+  if (node->tag == HASH_COLLISION) {
+    void *key = image_decode(image, &image->key_codec, image_pairs(node)[0].key);
+    return hash(key) == (hash_t)node->hash;
+  }
+
+  ImageEntry *entry = &image_entries(node)[0];
+  void *key = image_decode(image, &image->key_codec, entry->key);
+  return hash(key) == (hash_t)entry->hash;
+}
+
+/* decode a key or value once however many nodes refer to it. keys and
+   values have tables of their own as they're decoded differently */
+static void *load_encoded(Loader *loader, IdentityTable *table, HashmapCodec *codec, \
+                          uint64_t offset)
+{
+  void *obj = (void*)identity_get(table, offset);
+  if (obj) { return obj; }
+
+  obj = image_decode(&loader->image, codec, offset);
+  identity_put(table, offset, (uintptr_t)obj);
+
+  return obj;
+}
 
-  /* copy the nodes */
-  while (curr != node) {
+/* make the node at offset, or return the one already made from it */
+static Node *load_node(Loader *loader, uint64_t offset)
+{
+  Node *node = (Node*)identity_get(&loader->nodes, offset);
+  if (node) { return node_retain(node); }
+
+  Image *image = &loader->image;
+  ImageNode *saved = image_node(image, offset);
+
+  if (saved->tag == HASH_COLLISION) {
+
+    HashCollisionNode *collision = new_hash_collision_node(loader->alloc, saved->hash, \
+                                                           saved->count);
+    ImagePair *pairs = image_pairs(saved);
+
+    for (uint32_t i = 0; i < saved->count; i++) {
+      collision->array[i].key = load_encoded(loader, &loader->keys, &image->key_codec, \
+                                             pairs[i].key);
+      collision->array[i].val = load_encoded(loader, &loader->vals, &image->val_codec, \
+                                             pairs[i].val);
+    }
+    node = (Node*)collision;
+
+  } else {
 
-    copy = new_hash_collision_node(curr->key, curr->val, curr->hash);
-    copy->next = prev;
-    prev = copy;
-    curr = curr->next;
+    BitmapIndexedNode *bitmap = new_bitmap_indexed_node(loader->alloc, NULL, saved->datamap, \
+                                                        saved->nodemap);
+    Entry *entries = node_entries(bitmap);
+    Node **children = node_children(bitmap);
+    ImageEntry *saved_entries = image_entries(saved);
+    uint64_t *saved_children = image_children(saved);
+
+    for (int i = 0; i < popcount(saved->datamap); i++) {
+      entries[i].hash = saved_entries[i].hash;
+      entries[i].key = load_encoded(loader, &loader->keys, &image->key_codec, \
+                                    saved_entries[i].key);
+      entries[i].val = load_encoded(loader, &loader->vals, &image->val_codec, \
+                                    saved_entries[i].val);
+    }
+    for (int i = 0; i < popcount(saved->nodemap); i++) {
+      children[i] = load_node(loader, saved_children[i]);
+    }
+    node = (Node*)bitmap;
+  }
+
+  identity_put(&loader->nodes, offset, (uintptr_t)node);
+  return node;
+}
+
+static void *image_get(Hashmap *map, void *key, hash_t hash)
+{
+  Image *image = map->image;
+  if (!image->root) { return NULL; }
+
+  ImageNode *node = image_node(image, image->root);
+
+  for (int level = 0; ; level++) {
+
+    if (node->tag == HASH_COLLISION) {
+
+      if ((hash_t)node->hash != hash) { return NULL; }
+
+      ImagePair *pairs = image_pairs(node);
+      for (uint32_t i = 0; i < node->count; i++) {
+        if (map->eq_key(image_decode(image, &image->key_codec, pairs[i].key), key)) {
+          return image_decode(image, &image->val_codec, pairs[i].val);
+        }
+      }
+      return NULL;
+    }
+
+    unsigned int bit = bitpos(hash, level);
+
+    if (node->datamap & bit) {
+
+      ImageEntry *entry = &image_entries(node)[bit_index(node->datamap, bit)];
+
+      if ((hash_t)entry->hash == hash && \
+          map->eq_key(image_decode(image, &image->key_codec, entry->key), key)) {
+        return image_decode(image, &image->val_codec, entry->val);
+      }
+      return NULL;
+    }
+
+    if (!(node->nodemap & bit)) { return NULL; }
+    node = image_node(image, image_children(node)[bit_index(node->nodemap, bit)]);
   }
-  *result = REMOVED;
-  return (Node*)copy;
 }
 
-static void leaf_visit(Node *self, visit_fn fn, void **acc)
+static void image_visit(Image *image, uint64_t offset, visit_fn fn, void **acc)
 {
-  LeafNode* node = (LeafNode*)self;
-  fn(node->key, node->val, acc);
+  ImageNode *node = image_node(image, offset);
+
+  if (node->tag == HASH_COLLISION) {
+
+    ImagePair *pairs = image_pairs(node);
+    for (uint32_t i = 0; i < node->count; i++) {
+      fn(image_decode(image, &image->key_codec, pairs[i].key), \
+         image_decode(image, &image->val_codec, pairs[i].val), acc);
+    }
+    return;
+  }
+
+  ImageEntry *entries = image_entries(node);
+  for (int i = 0; i < popcount(node->datamap); i++) {
+    fn(image_decode(image, &image->key_codec, entries[i].key), \
+       image_decode(image, &image->val_codec, entries[i].val), acc);
+  }
+
+  uint64_t *children = image_children(node);
+  for (int i = 0; i < popcount(node->nodemap); i++) {
+    image_visit(image, children[i], fn, acc);
+  }
 }
 
-static void bitmap_indexed_visit(Node *self, visit_fn fn, void **acc)
+static void *image_reduce(Image *image, uint64_t offset, reduce_kv_fn fn, void *acc, \
+                          int *reduced)
 {
-  BitmapIndexedNode *node = (BitmapIndexedNode*)self;
-  int nodes = popcount(node->bitmap);
+  ImageNode *node = image_node(image, offset);
 
-  for (int i=0; i < nodes; i++) {
-    Node *child = node->children[i];
-    child->type->visitor(child, fn, acc);
+  if (node->tag == HASH_COLLISION) {
+
+    ImagePair *pairs = image_pairs(node);
+    for (uint32_t i = 0; i < node->count && !*reduced; i++) {
+      acc = fn(acc, image_decode(image, &image->key_codec, pairs[i].key), \
+               image_decode(image, &image->val_codec, pairs[i].val), reduced);
+    }
+    return acc;
+  }
+
+  ImageEntry *entries = image_entries(node);
+  for (int i = 0; i < popcount(node->datamap) && !*reduced; i++) {
+    acc = fn(acc, image_decode(image, &image->key_codec, entries[i].key), \
+             image_decode(image, &image->val_codec, entries[i].val), reduced);
   }
+
+  uint64_t *children = image_children(node);
+  for (int i = 0; i < popcount(node->nodemap) && !*reduced; i++) {
+    acc = image_reduce(image, children[i], fn, acc, reduced);
+  }
+  return acc;
 }
 
-static void hash_collision_visit(Node *self, visit_fn fn, void **acc)
+/* the same as cursor_advance for a mapped map, whose frames hold ImageNodes */
+static int image_cursor_advance(Cursor *cursor)
 {
-  HashCollisionNode *node = (HashCollisionNode*)self;
+  Image *image = cursor->image;
+
+  while (cursor->depth > 0) {
+
+    Frame *frame = &cursor->stack[cursor->depth - 1];
+    ImageNode *node = (ImageNode*)frame->node;
+
+    if (node->tag == HASH_COLLISION) {
+
+      ImagePair *pair = &image_pairs(node)[frame->idx++];
+      cursor->key = image_decode(image, &image->key_codec, pair->key);
+      cursor->val = image_decode(image, &image->val_codec, pair->val);
+
+      if (frame->idx == (int)node->count) { cursor->depth--; }
+      return 1;
+    }
+
+    int n_entries = popcount(node->datamap);
+    int n_children = popcount(node->nodemap);
+
+    if (frame->idx < n_entries) {
+
+      ImageEntry *entry = &image_entries(node)[frame->idx++];
+      cursor->key = image_decode(image, &image->key_codec, entry->key);
+      cursor->val = image_decode(image, &image->val_codec, entry->val);
+      return 1;
+    }
 
-  while (node) {
-    fn(node->key, node->val, acc);
-    node = node->next;
+    if (frame->idx < n_entries + n_children) {
+
+      Frame *child = &cursor->stack[cursor->depth++];
+      child->node = (Node*)image_node(image, image_children(node)[frame->idx++ - n_entries]);
+      child->idx = 0;
+      continue;
+    }
+
+    cursor->depth--;
   }
+  return 0;
+}
+
+static size_t str_size(void *obj)
+{
+  return strlen(obj) + 1;
+}
+
+static void str_encode(void *obj, void *buf)
+{
+  memcpy(buf, obj, strlen(obj) + 1);
 }
 
-/* function to visit each node and create a list of key/val pairs */
-static void iterator_visit(void *key, void *val, void **acc)
+static void *str_decode(const void *buf, size_t size)
 {
-  /* acc holds a pointer to the list being generated */
-  list *lst = *(struct list **)acc;
+  return (void*)buf;
+}
 
-  /* create a list node to hold the next value */
-  list *lst_val = GC_MALLOC(sizeof(*lst_val));
-  lst_val->data = val;
-  lst_val->next = lst;
+HashmapCodec hashmap_str_codec = {str_size, str_encode, str_decode};
 
-  /* create a list node to hold the next key */
-  list *lst_key = GC_MALLOC(sizeof(*lst_key));
-  lst_key->data = key;
-  lst_key->next = lst_val;
+static size_t int_size(void *obj)
+{
+  return sizeof(uintptr_t);
+}
 
-  /* return the updated list in acc */
-  *acc = lst_key;
+static void int_encode(void *obj, void *buf)
+{
+  memcpy(buf, &obj, sizeof(uintptr_t));
 }
 
-/* function to advance the iterator */
-static Iterator *hashmap_next_fn(Iterator *iter)
+static void *int_decode(const void *buf, size_t size)
 {
-  assert(iter);
+  void *obj;
+  memcpy(&obj, buf, sizeof(uintptr_t));
+  return obj;
+}
 
-  /* iter->current points to a hashmap entry */
-  list *current = iter->current;
+HashmapCodec hashmap_int_codec = {int_size, int_encode, int_decode};
 
-  /* check for the end of the data */
-  if (!current->next) { return NULL; }
+/* seed for the default hash - any value will do */
+static uint64_t hash_seed = 0x2d358dccaa6c78a5ull;
 
-  /* advance the pointer */
-  current = current->next;
+/* odd constants with well mixed bits for the default hash */
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
 
-  /* create a new iterator */
-  Iterator *new = iterator_copy(iter);
+uint64_t hashmap_seed(uint64_t seed)
+{
+  uint64_t old = hash_seed;
+  hash_seed = seed;
+  return old;
+}
 
-  /* set the iterator values */
-  new->current = current;
-  new->value = current->data;
+/* multiply into 128 bits and fold the halves together */
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
 
-  return new;
+/* unaligned reads of 8 and 4 bytes */
+static inline uint64_t hash_read64(const unsigned char *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t hash_read32(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
 }
 
 /*
-   default hash implementation djb2 * this algorithm was
-   first reported by Dan Bernstein * many years ago in comp.lang.c
+   default hash implementation. reads 16 bytes at a time and mixes them with a
+   128 bit multiply in the style of wyhash (https://github.com/wangyi-fudan/wyhash).
+   much faster than a byte at a time on long keys and starts from hash_seed
 */
 static hash_t hash_str(void *obj)
 {
-  hash_t hash = 5381;
+  const unsigned char *p = obj;
+  size_t len = strlen(obj);
+  uint64_t seed = hash_seed ^ hash_mix(len ^ HASH_P0, HASH_P1);
+  uint64_t a = 0, b = 0;
+
+  size_t left = len;
+  for (; left > 16; left -= 16, p += 16) {
+    seed = hash_mix(hash_read64(p) ^ HASH_P1, hash_read64(p + 8) ^ seed);
+  }
 
-  int c;
-  while ((c = *(char*)obj++)) {
-    hash = ((hash << 5) + hash) + c;
+  /* the last 1-16 bytes, reading overlapping words where needed */
+  if (left >= 8) {
+    a = hash_read64(p);
+    b = hash_read64(p + left - 8);
   }
-  return hash;
+  else if (left >= 4) {
+    a = hash_read32(p);
+    b = hash_read32(p + left - 4);
+  }
+  else if (left > 0) {
+    a = ((uint64_t)p[0] << 16) | ((uint64_t)p[left >> 1] << 8) | p[left - 1];
+  }
+
+  uint64_t hash = hash_mix(hash_mix(a ^ HASH_P1, b ^ seed) ^ HASH_P0, len ^ HASH_P1);
+
+  /* fold to 32 bits unless hash_t is 64 */
+  return (hash_t)(hash ^ (hash >> 32));
 }
 
 /* default comparison operation */
@@ -17,25 +17,102 @@
 #ifndef _PERSISTENT_HASHMAP_H
 #define _PERSISTENT_HASHMAP_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "../../iterator/iterator.h"
+#include "../../allocator/allocator.h"
 
 /* External Interface */
 
-/* type for hashes */
+/* type for hashes. 32 bits unless built with -DHASHMAP_HASH_64, which
+   makes the trie deeper and collisions rarer in very large maps. code
+   using the hashmap must be built with the same setting */
+#ifdef HASHMAP_HASH_64
+typedef uint64_t hash_t;
+#else
 typedef unsigned int hash_t;
+#endif
 
 /* type for Hashmaps */
 typedef struct Hashmap Hashmap;
 
+/* the number of depths counted by hashmap_stats. enough for 64 bit hashes */
+#define HASHMAP_STATS_DEPTHS 16
+
+/* the shape and memory use of a hashmap filled in by hashmap_stats */
+typedef struct HashmapStats {
+  /* the number of each kind of node */
+  int bitmap_nodes;
+  int collision_nodes;
+
+  /* key/value pairs stored inline in BitmapIndexedNodes. the
+     rest are in HashCollisionNodes */
+  int inline_entries;
+
+  /* the most keys in a single HashCollisionNode */
+  int max_collision;
+
+  /* the deepest node (the root is at depth 0) and the number
+     of key/value pairs held at each depth */
+  int max_depth;
+  int depth[HASHMAP_STATS_DEPTHS];
+
+  /* bytes allocated for the map and all its nodes. nodes hold their
+     arrays of entries and sub-nodes in the same allocation */
+  size_t bytes;
+
+  /* the average number of entries and sub-nodes in a BitmapIndexedNode */
+  double fan_out;
+} HashmapStats;
+
+/* how keys or values are written by hashmap_serialize and read back by
+   hashmap_open_mmap. size gives the bytes needed for obj and encode writes
+   them to buf. decode gets a pointer to those bytes in the mapped file and
+   can return it directly, which avoids copying, as long as the map isn't
+   used after hashmap_close_mmap */
+typedef struct HashmapCodec {
+  size_t (*size)(void *obj);
+  void (*encode)(void *obj, void *buf);
+  void *(*decode)(const void *buf, size_t size);
+} HashmapCodec;
+
+/* codec for NUL terminated strings. decoded strings point into the file */
+extern HashmapCodec hashmap_str_codec;
+
+/* codec for integers stored directly in the pointer */
+extern HashmapCodec hashmap_int_codec;
+
 /* type signature for generic equality function */
 typedef int (*equal_fn)(void *val1, void *val2);
 
 /* type signature for generic hash function */
 typedef hash_t (*hash_fn)(void *key);
 
+/* type signature for a function choosing the value for a key in two maps */
+typedef void *(*merge_fn)(void *key, void *val1, void *val2);
+
+/* type signature for a function called with a key whose value changed */
+typedef void (*change_fn)(void *key, void *old_val, void *new_val, void **result);
+
 /* type signature for a generic function to apply to all nodes */
 typedef void (*visit_fn)(void *key, void *val, void **result);
 
+/* type signature for a function adding a partial result to an accumulator */
+typedef void (*combine_fn)(void **acc, void *part);
+
+/* type signature for a function returning the new value for key given its
+   current value, or HASHMAP_NOT_FOUND if key isn't in the map */
+typedef void *(*update_fn)(void *key, void *val, void *ctx);
+
+/* passed to an update_fn in place of the value of a missing key. returning
+   it from an update_fn leaves the key out of the map */
+extern void *const HASHMAP_NOT_FOUND;
+
+/* type signature for a function folding a key/value pair into an accumulator.
+   setting *reduced to 1 stops the fold after this pair */
+typedef void *(*reduce_kv_fn)(void *acc, void *key, void *val, int *reduced);
+
 /*
 create a new hashmap. provide three functions that:
 - returns a hash given a key
@@ -44,6 +121,34 @@ create a new hashmap. provide three functions that:
 */
 Hashmap *hashmap_make(hash_fn hash, equal_fn eql_keys, equal_fn eql_vals);
 
+/* the same as hashmap_make but the map and every version made from it are
+   allocated from alloc instead of the default allocator */
+Hashmap *hashmap_make_with_allocator(hash_fn hash, equal_fn eql_keys, equal_fn eql_vals, \
+                                     Allocator *alloc);
+
+/*
+create a hashmap holding the n key/value pairs in keys and vals using
+the same functions as hashmap_make. if a key appears more than once the
+last value for it is used. faster than adding the pairs one at a time
+*/
+Hashmap *hashmap_from_arrays(hash_fn hash, equal_fn eql_keys, equal_fn eql_vals, \
+                             void **keys, void **vals, int n);
+
+/* the same as hashmap_from_arrays but the map is allocated from alloc */
+Hashmap *hashmap_from_arrays_with_allocator(hash_fn hash, equal_fn eql_keys, equal_fn eql_vals, \
+                                            void **keys, void **vals, int n, Allocator *alloc);
+
+/* the same as hashmap_from_arrays but shares the work between nthreads
+   threads. hash must be safe to call from several threads at once */
+Hashmap *hashmap_from_arrays_parallel(hash_fn hash, equal_fn eql_keys, equal_fn eql_vals, \
+                                      void **keys, void **vals, int n, int nthreads);
+
+/* the same as hashmap_from_arrays_parallel but the map is allocated from
+   alloc, which must also be safe to use from several threads at once */
+Hashmap *hashmap_from_arrays_parallel_with_allocator(hash_fn hash, equal_fn eql_keys, \
+                                                     equal_fn eql_vals, void **keys, void **vals, \
+                                                     int n, int nthreads, Allocator *alloc);
+
 /* true if there are no key/value pairs */
 int hashmap_empty(Hashmap *map);
 
@@ -57,12 +162,183 @@ Hashmap *hashmap_assoc(Hashmap* map, void* key, void* val);
    (and associated val) removed if it exists */
 Hashmap *hashmap_dissoc(Hashmap* map, void* key);
 
+/* returns a hashmap that is the same as map but with the value of key set
+   to fn(key, val, ctx), where val is the current value or HASHMAP_NOT_FOUND.
+   the trie is walked and key hashed once, and map itself is returned if the
+   new value is equal to the old one. if fn returns HASHMAP_NOT_FOUND the
+   key is removed */
+Hashmap *hashmap_update(Hashmap *map, void *key, update_fn fn, void *ctx);
+
+/* returns a hashmap with the key/value pairs of both a and b. where a key
+   is in both with different values the value is resolve(key, val_a, val_b),
+   or val_b if resolve is NULL. parts of the tries that are shared or only
+   in one of the maps are reused as they are, so merging versions of the
+   same map takes time in proportion to their differences. the result uses
+   a's allocator, so parts only in b are copied when b was made with another
+   one. both maps must use the same hash function */
+Hashmap *hashmap_merge(Hashmap *a, Hashmap *b, merge_fn resolve);
+
+/* true if a and b hold equal keys with equal values (using the functions
+   of a). versions of the same map only compare the parts that differ */
+int hashmap_equal(Hashmap *a, Hashmap *b);
+
+/* calls on_added for every key/value pair in new but not old, on_removed for
+   every pair in old but not new and on_changed for every key in both with
+   different values, passing acc to each. any of them can be NULL. parts of
+   the maps shared by both are skipped so comparing versions of the same map
+   takes time in proportion to their differences. both maps must use the
+   same hash function */
+void hashmap_diff(Hashmap *old, Hashmap *new, visit_fn on_added, visit_fn on_removed, \
+                  change_fn on_changed, void **acc);
+
+/* returns a transient copy of map that can be updated in place
+   with hashmap_assoc_mut and hashmap_dissoc_mut. map is unaffected */
+Hashmap *hashmap_transient(Hashmap *map);
+
+/* adds key and val to a transient map in place and returns it */
+Hashmap *hashmap_assoc_mut(Hashmap *map, void *key, void *val);
+
+/* removes key (and associated val) from a transient map in place and returns it */
+Hashmap *hashmap_dissoc_mut(Hashmap *map, void *key);
+
+/* the same as hashmap_update but changes a transient map in place and returns it */
+Hashmap *hashmap_update_mut(Hashmap *map, void *key, update_fn fn, void *ctx);
+
+/* ends the updates to a transient map and returns it as a normal
+   persistent hashmap. the transient can't be updated afterwards */
+Hashmap *hashmap_persistent(Hashmap *map);
+
+/* returns a copy of map with every node allocated from alloc, e.g.
+   &allocator_gc, so it can outlive the Region map was made in. the
+   keys and values aren't copied. map must not be a transient */
+Hashmap *hashmap_promote(Hashmap *map, Allocator *alloc);
+
+/*
+   built with -DPERSISTENT_REFCOUNT maps and their nodes are freed by
+   reference counts instead of the garbage collector. every function
+   returning a map returns a reference owned by the caller, which drops
+   it with hashmap_release. hashmap_assoc, hashmap_dissoc, hashmap_update
+   and their _with_hash forms take over the reference to the map passed
+   to them, so call hashmap_retain first to keep using the old version.
+   while a map and the nodes on the path to a key have a single owner they
+   are changed in place rather than copied. the other functions only
+   borrow the maps passed to them. iterators don't hold a reference so
+   the map must outlive them, and are freed as described in iterator.h.
+   in the normal build both functions do nothing
+*/
+
+/* adds a reference to map and returns it */
+Hashmap *hashmap_retain(Hashmap *map);
+
+/* drops a reference to map, freeing it and any nodes no
+   longer used by another map if it was the last */
+void hashmap_release(Hashmap *map);
+
 /* returns the value associated with key if it exists in map or NULL */
 void *hashmap_get(Hashmap* map, void* key);
 
+/* sets the seed of the default string hash used when hashmap_make is given
+   a NULL hash function. call it before making any maps with the default as
+   changing it makes their keys unreachable. a secret random seed stops keys
+   being chosen to collide. returns the seed it replaces */
+uint64_t hashmap_seed(uint64_t seed);
+
+/* returns the hash of key using the hash function of map. the result can
+   be passed to the _with_hash functions of any map using the same function */
+hash_t hashmap_hash(Hashmap *map, void *key);
+
+/* the same as hashmap_assoc, hashmap_dissoc and hashmap_get but using a
+   hash already computed by hashmap_hash instead of hashing key again */
+Hashmap *hashmap_assoc_with_hash(Hashmap* map, void* key, void* val, hash_t hash);
+
+Hashmap *hashmap_dissoc_with_hash(Hashmap* map, void* key, hash_t hash);
+
+void *hashmap_get_with_hash(Hashmap* map, void* key, hash_t hash);
+
+/* looks up the n keys and stores the value associated with each (or NULL)
+   at the same index of vals. faster than calling hashmap_get in a loop as
+   the lookups are interleaved so their memory accesses overlap */
+void hashmap_get_many(Hashmap *map, void **keys, int n, void **vals);
+
 /* return an iterator for a hashmap */
 Iterator *hashmap_iterator_make(Hashmap *map);
 
 /* applies fn to every key/value pair along with acc which accumulates the result */
 void hashmap_visit(Hashmap* map, visit_fn fn, void **acc);
+
+/* the same as hashmap_visit but shares the work between nthreads threads.
+   each thread applies fn with its own partial result, which starts as NULL,
+   and each partial result is then added to acc by calling combine. fn must
+   be safe to call from several threads at once */
+void hashmap_visit_parallel(Hashmap *map, visit_fn fn, combine_fn combine, void **acc, \
+                            int nthreads);
+
+/* folds every key/value pair into an accumulator starting from init by
+   calling acc = fn(acc, key, val, &reduced). unlike hashmap_visit the
+   traversal ends as soon as fn sets reduced. returns the final acc */
+void *hashmap_reduce(Hashmap *map, reduce_kv_fn fn, void *init);
+
+/* fills in stats with the shape and memory use of map. walks the whole map */
+void hashmap_stats(Hashmap *map, HashmapStats *stats);
+
+/* returns the bytes of nodes used by both a and b. versions of the same map
+   share the parts that are unchanged between them, and only those parts
+   are walked. both maps must use the same hash function */
+size_t hashmap_shared_bytes(Hashmap *a, Hashmap *b);
+
+/* writes map to fd as an image that hashmap_open_mmap can use in place.
+   the nodes are written with offsets in place of pointers, each after the
+   keys, values and sub-nodes it refers to, so fd can be a pipe. returns 0
+   or -1 with errno set if a write fails */
+int hashmap_serialize(Hashmap *map, int fd, HashmapCodec *key_codec, HashmapCodec *val_codec);
+
+/* writes the n maps in versions to fd as one image, in the same way as
+   hashmap_serialize. nodes, keys and values shared between the versions
+   are found by address and written once, so versions made from each
+   other take little more space than the newest alone. the versions must
+   use the same hash function */
+int hashmap_serialize_versions(Hashmap **versions, int n, int fd, HashmapCodec *key_codec, \
+                               HashmapCodec *val_codec);
+
+/* reads an image written by hashmap_serialize or hashmap_serialize_versions
+   from fd and rebuilds the maps in memory in the order they were written.
+   the nodes, keys and values shared between the versions when they were
+   written are shared again. decoding in place points into a buffer kept
+   alive by the collector. the image is checked as hashmap_open_mmap
+   checks it before anything is loaded. sets n to the number of maps and
+   returns them, or NULL with errno set on failure. the caller owns a
+   reference to each map and frees the array with hashmap_free_versions */
+Hashmap **hashmap_load_versions(int fd, hash_fn hash, equal_fn eq_keys, equal_fn eq_vals, \
+                                HashmapCodec *key_codec, HashmapCodec *val_codec, int *n);
+
+/* the same as hashmap_load_versions but the maps, the array and the
+   buffer are allocated from alloc */
+Hashmap **hashmap_load_versions_with_allocator(int fd, hash_fn hash, equal_fn eq_keys, \
+                                               equal_fn eq_vals, HashmapCodec *key_codec, \
+                                               HashmapCodec *val_codec, int *n, Allocator *alloc);
+
+/* frees an array returned by hashmap_load_versions along with the buffer
+   keys and values were decoded in place in, e.g. by hashmap_str_codec.
+   the maps are released separately and any with keys or values decoded
+   in place can't be used afterwards. with the collector it can be left
+   to the collector */
+void hashmap_free_versions(Hashmap **versions);
+
+/* maps the file at path written by hashmap_serialize and returns a read-only
+   map that answers hashmap_get, hashmap_get_many, the iterator, hashmap_visit
+   and hashmap_reduce straight from the file without loading it. keys and
+   values are decoded as they're returned. hash and eq_keys (NULL for the
+   defaults) must match the map that was written, including the seed of the
+   default hash. the file must have been written on a machine with the same
+   byte order and hash size. if the file holds several versions from
+   hashmap_serialize_versions the last one is used. every node is checked
+   to lie inside the file when it's opened, so a truncated or corrupt file
+   is refused rather than read out of bounds. returns NULL with errno set
+   on failure, EINVAL if the file isn't a valid image */
+Hashmap *hashmap_open_mmap(const char *path, hash_fn hash, equal_fn eq_keys, \
+                           HashmapCodec *key_codec, HashmapCodec *val_codec);
+
+/* unmaps the file behind a map from hashmap_open_mmap. map is empty
+   afterwards and keys and values decoded in place are no longer valid */
+void hashmap_close_mmap(Hashmap *map);
 #endif
@@ -0,0 +1,565 @@
+/*
+    Copyright (C) 2020 Duncan Watts
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 3 or later.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PERSISTENT_HASHMAP_DECLARE_H
+#define _PERSISTENT_HASHMAP_DECLARE_H
+
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+   PERSISTENT_HASHMAP_DECLARE(name, K, V, hash_expr, eq_expr) generates a
+   persistent map type called name from keys of type K to values of type
+   V, using the same trie as Hashmap. keys and values are stored by value
+   and hash_expr(key) and eq_expr(key1, key2), which can be functions or
+   function-like macros, are called directly so the compiler can inline
+   them. for example
+
+     static inline hash_t hash_u64(uint64_t key) { return key ^ (key >> 32); }
+     #define EQUAL_U64(a, b) ((a) == (b))
+     PERSISTENT_HASHMAP_DECLARE(u64map, uint64_t, uint64_t, hash_u64, EQUAL_U64)
+
+   declares
+
+     u64map *u64map_make(void);
+     int u64map_count(u64map *map);
+     uint64_t *u64map_find(u64map *map, uint64_t key);
+     u64map *u64map_assoc(u64map *map, uint64_t key, uint64_t val);
+     u64map *u64map_dissoc(u64map *map, uint64_t key);
+     void u64map_visit(u64map *map, void (*fn)(uint64_t key, uint64_t val, void *ctx),
+                       void *ctx);
+
+   as static functions. values are compared byte by byte to decide if
+   assoc changes the map. K and V can't need more alignment than a pointer.
+   maps and nodes come from the default allocator at the time they're made
+*/
+
+#define PERSISTENT_HASHMAP_BITS 5
+
+/* the deepest a trie can be: one level for every PERSISTENT_HASHMAP_BITS
+   bits of the hash plus one for a collision node */
+#define PERSISTENT_HASHMAP_MAX_DEPTH \
+  (((sizeof(hash_t) * 8) + PERSISTENT_HASHMAP_BITS - 1) / PERSISTENT_HASHMAP_BITS + 1)
+
+/* copy the n items of size bytes at src to dst. if remove is set the item
+   at idx is left out and if insert isn't NULL it is added at idx */
+static inline void persistent_hashmap_splice(void *dst, void *src, size_t size, int n, \
+                                             int idx, int remove, void *insert)
+{
+  if (remove) {
+
+    memcpy(dst, src, size * idx);
+    memcpy((char*)dst + size * idx, (char*)src + size * (idx + 1), size * (n - idx - 1));
+  }
+  else if (insert) {
+
+    memcpy(dst, src, size * idx);
+    memcpy((char*)dst + size * idx, insert, size);
+    memcpy((char*)dst + size * (idx + 1), (char*)src + size * idx, size * (n - idx));
+  }
+  else {
+    memcpy(dst, src, size * n);
+  }
+}
+
+#define PERSISTENT_HASHMAP_DECLARE(name, K, V, hash_expr, eq_expr) \
+typedef struct name name; \
+typedef struct name##_node name##_node; \
+\
+/* a key/value pair stored inline in a bitmap indexed node */ \
+typedef struct name##_entry { \
+  K key; \
+  V val; \
+  hash_t hash; \
+} name##_entry; \
+\
+/* a key/value pair in a collision node */ \
+typedef struct name##_pair { \
+  K key; \
+  V val; \
+} name##_pair; \
+\
+/* a bitmap indexed node when count is 0. array holds the entries \
+   followed by the sub-nodes, both in bit order, as in Hashmap. otherwise \
+   a collision node where array holds the count pairs whose keys share hash */ \
+struct name##_node { \
+  unsigned int datamap; \
+  unsigned int nodemap; \
+  int count; \
+  hash_t hash; \
+  void *array[]; \
+}; \
+\
+struct name { \
+  int count; \
+  name##_node *root; \
+}; \
+\
+static inline unsigned int name##_bitpos(hash_t hash, int level) \
+{ \
+  return 1u << ((hash >> (PERSISTENT_HASHMAP_BITS * level)) & 0x01f); \
+} \
+\
+static inline int name##_index(unsigned int bitmap, unsigned int bit) \
+{ \
+  return __builtin_popcount(bitmap & (bit - 1)); \
+} \
+\
+static inline name##_entry *name##_entries(name##_node *node) \
+{ \
+  return (name##_entry*)node->array; \
+} \
+\
+/* the bytes taken by the entries, padded so the sub-nodes after them are aligned */ \
+static inline size_t name##_entries_size(unsigned int datamap) \
+{ \
+  size_t size = sizeof(name##_entry) * __builtin_popcount(datamap); \
+  return (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1); \
+} \
+\
+static inline name##_node **name##_children(name##_node *node) \
+{ \
+  return (name##_node**)((char*)node->array + name##_entries_size(node->datamap)); \
+} \
+\
+static inline name##_pair *name##_pairs(name##_node *node) \
+{ \
+  return (name##_pair*)node->array; \
+} \
+\
+static inline size_t name##_size(name##_node *node) \
+{ \
+  if (node->count) { return sizeof(name##_pair) * node->count; } \
+\
+  return name##_entries_size(node->datamap) + \
+         (sizeof(name##_node*) * __builtin_popcount(node->nodemap)); \
+} \
+\
+static inline name##_node *name##_new_node(unsigned int datamap, unsigned int nodemap) \
+{ \
+  name##_node *node = allocator_alloc(allocator_default(), sizeof(*node) + \
+                                      name##_entries_size(datamap) + \
+                                      (sizeof(name##_node*) * __builtin_popcount(nodemap))); \
+  node->datamap = datamap; \
+  node->nodemap = nodemap; \
+  node->count = 0; \
+\
+  return node; \
+} \
+\
+static inline name##_node *name##_new_collision(hash_t hash, int count) \
+{ \
+  name##_node *node = allocator_alloc(allocator_default(), \
+                                      sizeof(*node) + sizeof(name##_pair) * count); \
+  node->datamap = 0; \
+  node->nodemap = 0; \
+  node->count = count; \
+  node->hash = hash; \
+\
+  return node; \
+} \
+\
+static inline name##_node *name##_copy_node(name##_node *node) \
+{ \
+  name##_node *copy = allocator_alloc(allocator_default(), sizeof(*node) + name##_size(node)); \
+  memcpy(copy, node, sizeof(*node) + name##_size(node)); \
+\
+  return copy; \
+} \
+\
+static inline name *name##_new_map(name##_node *root, int count) \
+{ \
+  name *map = allocator_alloc(allocator_default(), sizeof(*map)); \
+  map->root = root; \
+  map->count = count; \
+\
+  return map; \
+} \
+\
+/* return a node with the same entries and sub-nodes as node except that the \
+   entry at remove_bit is left out, the entry at insert_bit is set to entry, \
+   the sub-node at child_bit is set to child or, if child is NULL, left out */ \
+static inline name##_node *name##_rebuild(name##_node *node, unsigned int remove_bit, \
+                                          unsigned int insert_bit, name##_entry *entry, \
+                                          unsigned int child_bit, name##_node *child) \
+{ \
+  unsigned int datamap = (node->datamap & ~remove_bit) | insert_bit; \
+  unsigned int nodemap = child ? (node->nodemap | child_bit) : (node->nodemap & ~child_bit); \
+  name##_node *new = name##_new_node(datamap, nodemap); \
+\
+  /* at most one entry and one sub-node are added or removed */ \
+  persistent_hashmap_splice(name##_entries(new), name##_entries(node), sizeof(name##_entry), \
+                            __builtin_popcount(node->datamap), \
+                            name##_index(node->datamap, remove_bit | insert_bit), \
+                            remove_bit, entry); \
+  persistent_hashmap_splice(name##_children(new), name##_children(node), \
+                            sizeof(name##_node*), __builtin_popcount(node->nodemap), \
+                            name##_index(node->nodemap, child_bit), \
+                            child ? 0 : child_bit, child ? &child : NULL); \
+  return new; \
+} \
+\
+/* create the smallest sub-node at level holding both the entry and the new one */ \
+static inline name##_node *name##_merge_entries(int level, name##_entry *entry, \
+                                                name##_entry *new) \
+{ \
+  /* the whole hash is the same so create a collision node holding both */ \
+  if (entry->hash == new->hash) { \
+\
+    name##_node *collision = name##_new_collision(new->hash, 2); \
+    name##_pairs(collision)[0].key = entry->key; \
+    name##_pairs(collision)[0].val = entry->val; \
+    name##_pairs(collision)[1].key = new->key; \
+    name##_pairs(collision)[1].val = new->val; \
+\
+    return collision; \
+  } \
+\
+  unsigned int entry_bit = name##_bitpos(entry->hash, level); \
+  unsigned int new_bit = name##_bitpos(new->hash, level); \
+\
+  /* can't put two entries in the same position so push them down a level */ \
+  if (entry_bit == new_bit) { \
+\
+    name##_node *node = name##_new_node(0, entry_bit); \
+    name##_children(node)[0] = name##_merge_entries(level + 1, entry, new); \
+\
+    return node; \
+  } \
+\
+  /* otherwise store both entries inline in bit order */ \
+  name##_node *node = name##_new_node(entry_bit | new_bit, 0); \
+  int new_idx = name##_index(node->datamap, new_bit); \
+\
+  name##_entries(node)[new_idx] = *new; \
+  name##_entries(node)[1 - new_idx] = *entry; \
+\
+  return node; \
+} \
+\
+/* create the smallest sub-node at level holding both the collision node \
+   and a new entry with a different hash */ \
+static inline name##_node *name##_merge_collision(int level, name##_node *collision, \
+                                                  name##_entry *new) \
+{ \
+  unsigned int collision_bit = name##_bitpos(collision->hash, level); \
+  unsigned int new_bit = name##_bitpos(new->hash, level); \
+\
+  /* both in the same position so push them down a level */ \
+  if (collision_bit == new_bit) { \
+\
+    name##_node *node = name##_new_node(0, collision_bit); \
+    name##_children(node)[0] = name##_merge_collision(level + 1, collision, new); \
+\
+    return node; \
+  } \
+\
+  /* otherwise store the new entry inline next to the collision node */ \
+  name##_node *node = name##_new_node(new_bit, collision_bit); \
+  name##_entries(node)[0] = *new; \
+  name##_children(node)[0] = collision; \
+\
+  return node; \
+} \
+\
+/* returns an empty map */ \
+static inline name *name##_make(void) \
+{ \
+  return name##_new_map(NULL, 0); \
+} \
+\
+/* returns the number of key/value pairs in map */ \
+static inline int name##_count(name *map) \
+{ \
+  return map->count; \
+} \
+\
+/* returns a pointer to the value associated with key or NULL if it isn't \
+   in map. the value belongs to the map and must not be changed */ \
+static inline V *name##_find(name *map, K key) \
+{ \
+  name##_node *node = map->root; \
+  if (!node) { return NULL; } \
+\
+  hash_t hash = hash_expr(key); \
+\
+  /* keep looking down a level until the key's position is found */ \
+  for (int level = 0; !node->count; level++) { \
+\
+    unsigned int bit = name##_bitpos(hash, level); \
+\
+    /* if the entry is inline compare the hash before the key */ \
+    if (node->datamap & bit) { \
+      name##_entry *entry = &name##_entries(node)[name##_index(node->datamap, bit)]; \
+\
+      if (entry->hash == hash && eq_expr(entry->key, key)) { return &entry->val; } \
+      return NULL; \
+    } \
+    /* not found */ \
+    if (!(node->nodemap & bit)) { return NULL; } \
+\
+    node = name##_children(node)[name##_index(node->nodemap, bit)]; \
+  } \
+\
+  /* all the keys in a collision node share a single hash */ \
+  if (node->hash != hash) { return NULL; } \
+\
+  for (int i = 0; i < node->count; i++) { \
+    if (eq_expr(name##_pairs(node)[i].key, key)) { return &name##_pairs(node)[i].val; } \
+  } \
+  return NULL; \
+} \
+\
+/* returns a map that is the same as map but with key associated with val. \
+   map itself is returned if key already has a value with the same bytes */ \
+static inline name *name##_assoc(name *map, K key, V val) \
+{ \
+  name##_entry new_entry = {key, val, hash_expr(key)}; \
+  hash_t hash = new_entry.hash; \
+\
+  /* if there are no entries create a root node holding the entry */ \
+  if (!map->root) { \
+\
+    name##_node *root = name##_new_node(name##_bitpos(hash, 0), 0); \
+    name##_entries(root)[0] = new_entry; \
+\
+    return name##_new_map(root, 1); \
+  } \
+\
+  /* the nodes walked through on the way down */ \
+  name##_node *path[PERSISTENT_HASHMAP_MAX_DEPTH]; \
+\
+  name##_node *node = map->root; \
+  name##_node *new = NULL; \
+  int added = 1; \
+  int level = 0; \
+\
+  /* walk down through the sub-nodes to the key's position */ \
+  while (!node->count) { \
+\
+    unsigned int bit = name##_bitpos(hash, level); \
+\
+    if (node->nodemap & bit) { \
+      path[level++] = node; \
+      node = name##_children(node)[name##_index(node->nodemap, bit)]; \
+      continue; \
+    } \
+\
+    /* an empty position so store the new entry inline */ \
+    if (!(node->datamap & bit)) { \
+      new = name##_rebuild(node, 0, bit, &new_entry, 0, NULL); \
+      break; \
+    } \
+\
+    int idx = name##_index(node->datamap, bit); \
+    name##_entry *entry = &name##_entries(node)[idx]; \
+\
+    /* a different key so push both entries down into a new sub-node */ \
+    if (entry->hash != hash || !(eq_expr(entry->key, key))) { \
+\
+      name##_node *child = name##_merge_entries(level + 1, entry, &new_entry); \
+      new = name##_rebuild(node, bit, 0, NULL, bit, child); \
+      break; \
+    } \
+\
+    /* if the key/value pair already exists return the original map */ \
+    if (!memcmp(&entry->val, &val, sizeof(V))) { return map; } \
+\
+    /* otherwise replace the value */ \
+    new = name##_copy_node(node); \
+    name##_entries(new)[idx].val = val; \
+    added = 0; \
+    break; \
+  } \
+\
+  /* the key's position is in a collision node */ \
+  if (node->count) { \
+\
+    if (node->hash != hash) { \
+      new = name##_merge_collision(level, node, &new_entry); \
+    } \
+    else { \
+      int idx = 0; \
+      while (idx < node->count && !(eq_expr(name##_pairs(node)[idx].key, key))) { idx++; } \
+\
+      /* a new key goes on the end of a copy of the pairs */ \
+      if (idx == node->count) { \
+\
+        new = name##_new_collision(hash, node->count + 1); \
+        memcpy(name##_pairs(new), name##_pairs(node), sizeof(name##_pair) * node->count); \
+      } \
+      else { \
+        if (!memcmp(&name##_pairs(node)[idx].val, &val, sizeof(V))) { return map; } \
+\
+        new = name##_copy_node(node); \
+        added = 0; \
+      } \
+      name##_pairs(new)[idx].key = key; \
+      name##_pairs(new)[idx].val = val; \
+    } \
+  } \
+\
+  /* copy the path back up to the root replacing each changed child */ \
+  while (level > 0) { \
+\
+    name##_node *parent = path[--level]; \
+    name##_node *copy = name##_copy_node(parent); \
+    name##_children(copy)[name##_index(parent->nodemap, name##_bitpos(hash, level))] = new; \
+\
+    new = copy; \
+  } \
+  return name##_new_map(new, map->count + added); \
+} \
+\
+/* if node only holds a single entry copy it to entry and return 1 */ \
+static inline int name##_single_entry(name##_node *node, name##_entry *entry) \
+{ \
+  if (node->count) { \
+\
+    if (node->count != 1) { return 0; } \
+\
+    entry->key = name##_pairs(node)[0].key; \
+    entry->val = name##_pairs(node)[0].val; \
+    entry->hash = node->hash; \
+    return 1; \
+  } \
+\
+  if (node->nodemap || __builtin_popcount(node->datamap) != 1) { return 0; } \
+\
+  *entry = name##_entries(node)[0]; \
+  return 1; \
+} \
+\
+/* a sub-node holding nothing but a collision node is replaced by it */ \
+static inline name##_node *name##_collapse(name##_node *node, int level) \
+{ \
+  if (level > 0 && !node->datamap && __builtin_popcount(node->nodemap) == 1) { \
+\
+    name##_node *child = name##_children(node)[0]; \
+    if (child->count) { return child; } \
+  } \
+  return node; \
+} \
+\
+/* returns a map that is the same as map but with key \
+   (and associated val) removed if it exists */ \
+static inline name *name##_dissoc(name *map, K key) \
+{ \
+  if (!map->root) { return map; } \
+\
+  /* the nodes walked through on the way down */ \
+  name##_node *path[PERSISTENT_HASHMAP_MAX_DEPTH]; \
+\
+  hash_t hash = hash_expr(key); \
+  name##_node *node = map->root; \
+  name##_node *new = NULL; \
+  int level = 0; \
+\
+  /* walk down through the sub-nodes to the key's position */ \
+  while (!node->count) { \
+\
+    unsigned int bit = name##_bitpos(hash, level); \
+\
+    if (node->nodemap & bit) { \
+      path[level++] = node; \
+      node = name##_children(node)[name##_index(node->nodemap, bit)]; \
+      continue; \
+    } \
+\
+    /* not found */ \
+    if (!(node->datamap & bit)) { return map; } \
+\
+    name##_entry *entry = &name##_entries(node)[name##_index(node->datamap, bit)]; \
+    if (entry->hash != hash || !(eq_expr(entry->key, key))) { return map; } \
+\
+    /* removing the last entry leaves an empty map */ \
+    if (!node->nodemap && __builtin_popcount(node->datamap) == 1) { \
+      return name##_new_map(NULL, 0); \
+    } \
+\
+    new = name##_collapse(name##_rebuild(node, bit, 0, NULL, 0, NULL), level); \
+    break; \
+  } \
+\
+  /* the key's position is in a collision node */ \
+  if (node->count) { \
+\
+    if (node->hash != hash) { return map; } \
+\
+    int idx = 0; \
+    while (idx < node->count && !(eq_expr(name##_pairs(node)[idx].key, key))) { idx++; } \
+    if (idx == node->count) { return map; } \
+\
+    /* copy the pairs without the removed one. if only one is \
+       left the parent pulls it up */ \
+    new = name##_new_collision(hash, node->count - 1); \
+    memcpy(name##_pairs(new), name##_pairs(node), sizeof(name##_pair) * idx); \
+    memcpy(name##_pairs(new) + idx, name##_pairs(node) + idx + 1, \
+           sizeof(name##_pair) * (node->count - idx - 1)); \
+  } \
+\
+  /* copy the path back up to the root replacing each changed child */ \
+  while (level > 0) { \
+\
+    name##_node *parent = path[--level]; \
+    unsigned int bit = name##_bitpos(hash, level); \
+\
+    /* a sub-node left with a single entry is pulled up inline */ \
+    name##_entry entry; \
+    if (name##_single_entry(new, &entry)) { \
+      new = name##_collapse(name##_rebuild(parent, 0, bit, &entry, bit, NULL), level); \
+      continue; \
+    } \
+\
+    /* otherwise replace the changed one */ \
+    name##_node *copy = name##_copy_node(parent); \
+    name##_children(copy)[name##_index(parent->nodemap, bit)] = new; \
+\
+    new = name##_collapse(copy, level); \
+  } \
+  return name##_new_map(new, map->count - 1); \
+} \
+\
+static inline void name##_visit_node(name##_node *node, \
+                                     void (*fn)(K key, V val, void *ctx), void *ctx) \
+{ \
+  if (node->count) { \
+\
+    for (int i = 0; i < node->count; i++) { \
+      fn(name##_pairs(node)[i].key, name##_pairs(node)[i].val, ctx); \
+    } \
+    return; \
+  } \
+\
+  int n_entries = __builtin_popcount(node->datamap); \
+  for (int i = 0; i < n_entries; i++) { \
+    fn(name##_entries(node)[i].key, name##_entries(node)[i].val, ctx); \
+  } \
+\
+  int n_children = __builtin_popcount(node->nodemap); \
+  for (int i = 0; i < n_children; i++) { \
+    name##_visit_node(name##_children(node)[i], fn, ctx); \
+  } \
+} \
+\
+/* applies fn to every key/value pair along with ctx */ \
+static inline void name##_visit(name *map, void (*fn)(K key, V val, void *ctx), void *ctx) \
+{ \
+  if (map->root) { name##_visit_node(map->root, fn, ctx); } \
+}
+
+#endif
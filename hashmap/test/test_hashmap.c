@@ -1,10 +1,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef PERSISTENT_REFCOUNT
+/* the reference counted build doesn't link the collector */
+#define GC_MALLOC(size) calloc(1, (size))
+#else
 #include <gc.h>
+#endif
 
 #include "../../Unity/src/unity.h"
 #include "../src/hashmap.h"
+#include "../src/hashmap_declare.h"
+
+#ifdef PERSISTENT_REFCOUNT
+/* the reference counted build takes over the map passed to these but the
+   tests keep using the old versions, so they hold on to their own reference */
+#define hashmap_assoc(map, key, val) hashmap_assoc(hashmap_retain(map), key, val)
+#define hashmap_assoc_with_hash(map, key, val, hash) \
+  hashmap_assoc_with_hash(hashmap_retain(map), key, val, hash)
+#define hashmap_dissoc(map, key) hashmap_dissoc(hashmap_retain(map), key)
+#define hashmap_dissoc_with_hash(map, key, hash) \
+  hashmap_dissoc_with_hash(hashmap_retain(map), key, hash)
+#define hashmap_update(map, key, fn, ctx) hashmap_update(hashmap_retain(map), key, fn, ctx)
+#endif
 
 /* included for time and rand functions */
 #include <time.h>
@@ -15,7 +36,7 @@
 
 /* number of items to add to test lists */
 #define TEST_ITERATIONS 10000
-#define TEST_ITERATIONS_COLLISIONS 1000
+#define TEST_ITERATIONS_COLLISIONS 5000
 
 /* utility functions */
 char *make_string (char* prefix, int i) {
@@ -532,6 +553,122 @@ void test_hashmap_visit_count(void) {
   }
 }
 
+/* test function that adds a count from one thread to the total */
+void add_count_fn(void **acc, void *part) {
+  *(uintptr_t *)acc += (uintptr_t)part;
+}
+
+/* test function that sums the keys */
+void sum_fn(void *key, void *val, void **acc) {
+  *(uintptr_t *)acc += (uintptr_t)key;
+}
+
+void test_hashmap_visit_parallel(void) {
+
+  int thread_counts[] = {0, 1, 2, 3, 8, 64};
+  Hashmap *map = hashmap_make(hash_int, equal_int, equal_int);
+  uintptr_t expected = 0;
+
+  for (uintptr_t i = 1; i <= TEST_ITERATIONS; i++) {
+
+    map = hashmap_assoc(map, (void*)i, (void*)i);
+    expected += i;
+
+    /* a range of sizes from a single entry upwards */
+    if (i != 1 && i != 10 && i != 100 && i != TEST_ITERATIONS) { continue; }
+
+    for (int t = 0; t < sizeof(thread_counts) / sizeof(int); t++) {
+
+      uintptr_t count = 0;
+      hashmap_visit_parallel(map, counter_fn, add_count_fn, (void **)&count, thread_counts[t]);
+      TEST_ASSERT_EQUAL_INT(i, count);
+
+      uintptr_t sum = 0;
+      hashmap_visit_parallel(map, sum_fn, add_count_fn, (void **)&sum, thread_counts[t]);
+      TEST_ASSERT_EQUAL_INT(expected, sum);
+    }
+  }
+
+  /* keys in HashCollisionNodes */
+  Hashmap *collisions = hashmap_make(hash_collision, equal_str, equal_str);
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+    collisions = hashmap_assoc(collisions, make_test_key(i), make_test_val(i));
+  }
+
+  uintptr_t count = 0;
+  hashmap_visit_parallel(collisions, counter_fn, add_count_fn, (void **)&count, 8);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS_COLLISIONS, count);
+
+  /* an empty map */
+  count = 0;
+  hashmap_visit_parallel(hashmap_make(NULL, NULL, NULL), counter_fn, add_count_fn, \
+                         (void **)&count, 8);
+  TEST_ASSERT_EQUAL_INT(0, count);
+}
+
+/* test function that counts the pairs and stops after stop_at */
+static uintptr_t stop_at;
+
+void *count_until_fn(void *acc, void *key, void *val, int *reduced) {
+
+  uintptr_t count = (uintptr_t)acc + 1;
+  if (count == stop_at) { *reduced = 1; }
+  return (void *)count;
+}
+
+/* test function that stops at the first key equal to the one in stop_at */
+void *find_fn(void *acc, void *key, void *val, int *reduced) {
+
+  if ((uintptr_t)key == stop_at) {
+    *reduced = 1;
+    return val;
+  }
+  return acc;
+}
+
+void test_hashmap_reduce(void) {
+
+  Hashmap *map = hashmap_make(hash_int, equal_int, equal_int);
+
+  /* an empty map returns init */
+  stop_at = 0;
+  TEST_ASSERT_EQUAL_PTR((void *)5, hashmap_reduce(map, count_until_fn, (void *)5));
+
+  for (uintptr_t i = 1; i <= TEST_ITERATIONS; i++) {
+    map = hashmap_assoc(map, (void*)i, (void*)(i * 2));
+  }
+
+  /* every pair */
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, (uintptr_t)hashmap_reduce(map, count_until_fn, (void *)0));
+
+  /* stopping part way through */
+  uintptr_t stops[] = {1, 2, 33, 1000, TEST_ITERATIONS - 1};
+  for (int i = 0; i < sizeof(stops) / sizeof(stops[0]); i++) {
+
+    stop_at = stops[i];
+    TEST_ASSERT_EQUAL_INT(stops[i], (uintptr_t)hashmap_reduce(map, count_until_fn, (void *)0));
+  }
+
+  /* searching for a key */
+  for (uintptr_t i = 1; i <= TEST_ITERATIONS; i += 97) {
+
+    stop_at = i;
+    TEST_ASSERT_EQUAL_INT(i * 2, (uintptr_t)hashmap_reduce(map, find_fn, NULL));
+  }
+
+  /* stopping inside a HashCollisionNode */
+  Hashmap *collisions = hashmap_make(hash_collision, equal_str, equal_str);
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+    collisions = hashmap_assoc(collisions, make_test_key(i), make_test_val(i));
+  }
+
+  stop_at = 0;
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS_COLLISIONS, \
+                        (uintptr_t)hashmap_reduce(collisions, count_until_fn, (void *)0));
+  stop_at = TEST_ITERATIONS_COLLISIONS / 2;
+  TEST_ASSERT_EQUAL_INT(stop_at, (uintptr_t)hashmap_reduce(collisions, count_until_fn, (void *)0));
+}
+
 void test_hashmap_visit_list(void) {
 
   Hashmap *map = hashmap_make(hash_str, equal_str, equal_str);
@@ -632,26 +769,1640 @@ void test_hashmap_iterator(void) {
   TEST_ASSERT_EQUAL_INT(hashmap_count(map), count);
 }
 
+/* test function that counts each time a key is updated */
+void *increment_fn(void *key, void *val, void *ctx) {
 
-int main(int argc, char **argv) {
+  (*(int *)ctx)++;
+  if (val == HASHMAP_NOT_FOUND) { return (void *)1; }
+  return (void *)((uintptr_t)val + 1);
+}
 
-  UNITY_BEGIN();
+/* test function that takes one off a count and removes the key at zero */
+void *decrement_fn(void *key, void *val, void *ctx) {
 
-  RUN_TEST(test_hashmap_new);
-  RUN_TEST(test_hashmap_get);
-  RUN_TEST(test_hashmap_count);
+  if (val == HASHMAP_NOT_FOUND || val == (void *)1) { return HASHMAP_NOT_FOUND; }
+  return (void *)((uintptr_t)val - 1);
+}
 
-  RUN_TEST(test_hashmap_assoc);
-  RUN_TEST(test_hashmap_dissoc);
+/* test function that leaves the value as it is */
+void *same_fn(void *key, void *val, void *ctx) {
+  return val;
+}
+
+void test_hashmap_update(void) {
+
+  int calls = 0;
+  Hashmap *map = hashmap_make(hash_int, equal_int, equal_int);
+
+  /* count each key i % 100 */
+  for (uintptr_t i = 0; i < TEST_ITERATIONS; i++) {
+    map = hashmap_update(map, (void *)(i % 100), increment_fn, &calls);
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, calls);
+  TEST_ASSERT_EQUAL_INT(100, hashmap_count(map));
+
+  for (uintptr_t i = 0; i < 100; i++) {
+    TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS / 100, (uintptr_t)hashmap_get(map, (void *)i));
+  }
+
+  /* no change returns the same map, including for a missing key */
+  TEST_ASSERT_EQUAL_PTR(map, hashmap_update(map, (void *)5, same_fn, NULL));
+  TEST_ASSERT_EQUAL_PTR(map, hashmap_update(map, (void *)1000, same_fn, NULL));
+  TEST_ASSERT_EQUAL_PTR(map, hashmap_update(map, (void *)1000, decrement_fn, NULL));
+
+  /* counting down removes the keys without touching the original */
+  Hashmap *counted = map;
+  for (int n = 0; n < TEST_ITERATIONS / 100; n++) {
+    for (uintptr_t i = 0; i < 100; i++) {
+      map = hashmap_update(map, (void *)i, decrement_fn, NULL);
+    }
+  }
+  TEST_ASSERT_EQUAL_INT(0, hashmap_count(map));
+  TEST_ASSERT_EQUAL_INT(100, hashmap_count(counted));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS / 100, (uintptr_t)hashmap_get(counted, (void *)7));
+
+  /* the same in place on a transient */
+  Hashmap *trans = hashmap_transient(counted);
+  for (uintptr_t i = 0; i < 200; i++) {
+    TEST_ASSERT_EQUAL_PTR(trans, hashmap_update_mut(trans, (void *)i, increment_fn, &calls));
+  }
+  for (uintptr_t i = 0; i < 200; i += 2) {
+    trans = hashmap_update_mut(trans, (void *)i, decrement_fn, NULL);
+  }
+  map = hashmap_persistent(trans);
+  TEST_ASSERT_EQUAL_INT(150, hashmap_count(map));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS / 100, (uintptr_t)hashmap_get(map, (void *)0));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS / 100 + 1, (uintptr_t)hashmap_get(map, (void *)1));
+  TEST_ASSERT_NULL(hashmap_get(map, (void *)100));
+  TEST_ASSERT_EQUAL_INT(1, (uintptr_t)hashmap_get(map, (void *)101));
+
+  /* keys in HashCollisionNodes */
+  Hashmap *collisions = hashmap_make(hash_collision, equal_str, equal_int);
+  for (int n = 0; n < 3; n++) {
+    for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+      collisions = hashmap_update(collisions, make_test_key(i), increment_fn, &calls);
+    }
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS_COLLISIONS, hashmap_count(collisions));
+
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+
+    char *key = make_test_key(i);
+    TEST_ASSERT_EQUAL_INT(3, (uintptr_t)hashmap_get(collisions, key));
+    TEST_ASSERT_EQUAL_PTR(collisions, hashmap_update(collisions, key, same_fn, NULL));
+
+    /* remove every other key */
+    for (int n = 0; n < 3 && i % 2; n++) {
+      collisions = hashmap_update(collisions, key, decrement_fn, NULL);
+    }
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS_COLLISIONS - TEST_ITERATIONS_COLLISIONS / 2, \
+                        hashmap_count(collisions));
+}
+
+void test_hashmap_transient(void) {
+
+  /* build a map in place from the empty map */
+  Hashmap *map = hashmap_transient(hashmap_make(hash_str, equal_str, equal_str));
+
+  shuffle(integers, TEST_ITERATIONS);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    char *key = make_test_key(integers[i]);
+    char *val = make_test_val(integers[i]);
+
+    /* the transient is updated in place */
+    TEST_ASSERT_EQUAL_PTR(map, hashmap_assoc_mut(map, key, val));
+    TEST_ASSERT_EQUAL_INT(i + 1, hashmap_count(map));
+  }
+  map = hashmap_persistent(map);
+
+  /* check all vals are present */
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    char* key = make_test_key(integers[i]);
+    char* val = make_test_val(integers[i]);
+    TEST_ASSERT_EQUAL_STRING(val, hashmap_get(map, key));
+  }
+
+  /* update and remove keys in a transient made from an existing map */
+  Hashmap *original_map = str_map;
+  Hashmap *trans = hashmap_transient(original_map);
+
+  shuffle(integers, TEST_ITERATIONS);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    char* key = make_test_key(integers[i]);
+    char* val = make_test_val(integers[i]);
+
+    if (i % 2) {
+      trans = hashmap_assoc_mut(trans, key, make_updated_val(val));
+    } else {
+      trans = hashmap_dissoc_mut(trans, key);
+    }
+  }
+  map = hashmap_persistent(trans);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS / 2, hashmap_count(map));
+
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    char* key = make_test_key(integers[i]);
+    char* val = make_test_val(integers[i]);
+
+    if (i % 2) {
+      TEST_ASSERT_EQUAL_STRING(make_updated_val(val), hashmap_get(map, key));
+    } else {
+      TEST_ASSERT_NULL(hashmap_get(map, key));
+    }
+    /* check the original map is unaffected */
+    TEST_ASSERT_EQUAL_STRING(val, hashmap_get(original_map, key));
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(original_map));
+
+  /* persistent updates to the result don't affect the old version */
+  Hashmap *new_map = hashmap_dissoc(map, make_test_key(integers[1]));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS / 2 - 1, hashmap_count(new_map));
+  TEST_ASSERT_NOT_NULL(hashmap_get(map, make_test_key(integers[1])));
+}
+
+void test_hashmap_iterator_lazy(void) {
+
+  Hashmap *map = collisions_map;
+
+  /* walk part way through the map and save the iterator */
+  Iterator *iter = hashmap_iterator_make(map);
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+    iter = iterator_next(iter);
+  }
+  Iterator *saved = iterator_copy(iter);
+
+  /* finish the walk checking every key is present */
+  int count = 0;
+  while (iter) {
+
+    char* iter_key = (char*)iterator_value(iter);
+    iter = iterator_next(iter);
+
+    char* iter_val = (char*)iterator_value(iter);
+    iter = iterator_next(iter);
+
+    TEST_ASSERT_EQUAL_STRING(iter_val, hashmap_get(map, iter_key));
+    count++;
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS_COLLISIONS / 2, count);
+
+  /* the saved iterator still continues from the same place */
+  count = 0;
+  while (saved) {
+    saved = iterator_next(iterator_next(saved));
+    count++;
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS_COLLISIONS / 2, count);
+}
+
+void test_hashmap_with_hash(void) {
+
+  Hashmap *map = str_map;
+  Hashmap *other_map = hashmap_make(hash_str, equal_str, equal_str);
+
+  shuffle(integers, TEST_ITERATIONS);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    char* key = make_test_key(integers[i]);
+    char* val = make_test_val(integers[i]);
+
+    /* hash once and reuse it in both maps */
+    hash_t hash = hashmap_hash(map, key);
+    TEST_ASSERT_EQUAL_INT(hash_str(key), hash);
+
+    TEST_ASSERT_EQUAL_STRING(val, hashmap_get_with_hash(map, key, hash));
+    TEST_ASSERT_NULL(hashmap_get_with_hash(other_map, key, hash));
+
+    other_map = hashmap_assoc_with_hash(other_map, key, val, hash);
+    TEST_ASSERT_EQUAL_STRING(val, hashmap_get(other_map, key));
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(other_map));
+
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    char* key = make_test_key(integers[i]);
+    other_map = hashmap_dissoc_with_hash(other_map, key, hashmap_hash(other_map, key));
+    TEST_ASSERT_NULL(hashmap_get(other_map, key));
+  }
+  TEST_ASSERT_EQUAL_INT(0, hashmap_count(other_map));
+}
+
+void test_hashmap_get_many(void) {
+
+  Hashmap *map = str_map;
+  int n = TEST_ITERATIONS * 2;
+
+  void **keys = GC_MALLOC(sizeof(void*) * n);
+  void **vals = GC_MALLOC(sizeof(void*) * n);
+
+  /* half the keys are in the map and half are missing */
+  shuffle(integers, TEST_ITERATIONS);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    keys[i * 2] = make_test_key(integers[i]);
+    keys[i * 2 + 1] = make_test_key(integers[i] + TEST_ITERATIONS);
+  }
+
+  hashmap_get_many(map, keys, n, vals);
+
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    TEST_ASSERT_EQUAL_STRING(make_test_val(integers[i]), vals[i * 2]);
+    TEST_ASSERT_NULL(vals[i * 2 + 1]);
+  }
+
+  /* a batch that doesn't divide evenly */
+  hashmap_get_many(map, keys, 37, vals);
+  for (int i = 0; i < 37; i++) {
+    TEST_ASSERT_EQUAL_PTR(hashmap_get(map, keys[i]), vals[i]);
+  }
+
+  /* lookups ending in HashCollisionNodes */
+  map = collisions_map;
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+    map = hashmap_assoc(map, make_test_key(i), make_test_val(i));
+  }
+  hashmap_get_many(map, keys, n, vals);
+  for (int i = 0; i < n; i++) {
+    TEST_ASSERT_EQUAL_PTR(hashmap_get(map, keys[i]), vals[i]);
+  }
+
+  /* an empty map */
+  map = hashmap_make(hash_str, equal_str, equal_str);
+  hashmap_get_many(map, keys, n, vals);
+  for (int i = 0; i < n; i++) {
+    TEST_ASSERT_NULL(vals[i]);
+  }
+}
+
+void test_hashmap_from_arrays(void) {
+
+  /* each key appears twice and the second value should win */
+  int n = TEST_ITERATIONS * 2;
+  void **keys = GC_MALLOC(sizeof(void*) * n);
+  void **vals = GC_MALLOC(sizeof(void*) * n);
+
+  shuffle(integers, TEST_ITERATIONS);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    char *key = make_test_key(integers[i]);
+    char *val = make_test_val(integers[i]);
+
+    keys[i] = key;
+    vals[i] = val;
+    keys[n - i - 1] = make_test_key(integers[i]);
+    vals[n - i - 1] = make_updated_val(val);
+  }
+
+  Hashmap *map = hashmap_from_arrays(hash_str, equal_str, equal_str, keys, vals, n);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(map));
+
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    TEST_ASSERT_EQUAL_STRING(vals[n - i - 1], hashmap_get(map, keys[i]));
+  }
+
+  /* the result is a normal map */
+  map = hashmap_dissoc(map, keys[0]);
+  TEST_ASSERT_NULL(hashmap_get(map, keys[0]));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS - 1, hashmap_count(map));
+
+  /* keys with few hash values go in HashCollisionNodes */
+  map = hashmap_from_arrays(hash_collision, equal_str, equal_str, keys, vals, n);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(map));
+
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    TEST_ASSERT_EQUAL_STRING(vals[n - i - 1], hashmap_get(map, keys[i]));
+  }
+
+  /* every key with the same hash */
+  map = hashmap_from_arrays(hash_constant, equal_str, equal_str, keys, vals, 100);
+  TEST_ASSERT_EQUAL_INT(100, hashmap_count(map));
+  TEST_ASSERT_EQUAL_STRING(vals[50], hashmap_get(map, keys[50]));
+
+  /* a single key given twice */
+  void *single_keys[] = {"key", "key"};
+  void *single_vals[] = {"val_1", "val_2"};
+  map = hashmap_from_arrays(hash_constant, equal_str, equal_str, single_keys, single_vals, 2);
+  TEST_ASSERT_EQUAL_INT(1, hashmap_count(map));
+  TEST_ASSERT_EQUAL_STRING("val_2", hashmap_get(map, "key"));
+  map = hashmap_dissoc(map, "key");
+  TEST_ASSERT_TRUE(hashmap_empty(map));
+
+  /* no keys */
+  map = hashmap_from_arrays(hash_str, equal_str, equal_str, keys, vals, 0);
+  TEST_ASSERT_TRUE(hashmap_empty(map));
+}
+
+/* test function that keeps the value from the first map */
+void *keep_first_fn(void *key, void *val1, void *val2) {
+  return val1;
+}
+
+void test_hashmap_merge(void) {
+
+  Hashmap *base = str_map;
+
+  /* a updates the first tenth of the keys and b updates the
+     second tenth and adds some new ones */
+  Hashmap *a = base;
+  Hashmap *b = base;
+  int n = TEST_ITERATIONS / 10;
+
+  shuffle(integers, TEST_ITERATIONS);
+  for (int i = 0; i < n; i++) {
+
+    char *key = make_test_key(integers[i]);
+    a = hashmap_assoc(a, key, make_updated_val(make_test_val(integers[i])));
+
+    key = make_test_key(integers[n + i]);
+    b = hashmap_assoc(b, key, make_updated_val(make_test_val(integers[n + i])));
+
+    key = make_test_key(TEST_ITERATIONS + i);
+    b = hashmap_assoc(b, key, make_test_val(TEST_ITERATIONS + i));
+  }
+
+  /* by default the values in b win */
+  Hashmap *merged = hashmap_merge(a, b, NULL);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS + n, hashmap_count(merged));
+
+  for (int i = 0; i < n; i++) {
+
+    char *key = make_test_key(integers[i]);
+    TEST_ASSERT_EQUAL_STRING(hashmap_get(b, key), hashmap_get(merged, key));
+
+    key = make_test_key(integers[n + i]);
+    TEST_ASSERT_EQUAL_STRING(hashmap_get(b, key), hashmap_get(merged, key));
+
+    key = make_test_key(TEST_ITERATIONS + i);
+    TEST_ASSERT_EQUAL_STRING(make_test_val(TEST_ITERATIONS + i), hashmap_get(merged, key));
+  }
+  for (int i = n * 2; i < TEST_ITERATIONS; i++) {
+
+    char *key = make_test_key(integers[i]);
+    TEST_ASSERT_EQUAL_STRING(make_test_val(integers[i]), hashmap_get(merged, key));
+  }
+
+  /* keys in both maps with different values are resolved */
+  merged = hashmap_merge(a, b, keep_first_fn);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS + n, hashmap_count(merged));
+
+  for (int i = 0; i < n * 2; i++) {
+
+    char *key = make_test_key(integers[i]);
+    TEST_ASSERT_EQUAL_STRING(hashmap_get(a, key), hashmap_get(merged, key));
+  }
+
+  /* merging nothing new returns the original map */
+  TEST_ASSERT_EQUAL_PTR(a, hashmap_merge(a, a, NULL));
+  TEST_ASSERT_EQUAL_PTR(a, hashmap_merge(a, base, keep_first_fn));
+  TEST_ASSERT_EQUAL_PTR(a, hashmap_merge(a, hashmap_make(hash_str, equal_str, equal_str), NULL));
+
+  merged = hashmap_merge(hashmap_make(hash_str, equal_str, equal_str), a, NULL);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(merged));
+
+  /* maps of HashCollisionNodes */
+  a = hashmap_make(hash_collision, equal_str, equal_str);
+  b = hashmap_make(hash_collision, equal_str, equal_str);
+
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+
+    if (i % 3 != 0) { a = hashmap_assoc(a, make_test_key(i), make_test_val(i)); }
+    if (i % 2 != 0) { b = hashmap_assoc(b, make_test_key(i), make_test_key(i)); }
+  }
+
+  merged = hashmap_merge(a, b, NULL);
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+
+    char *val = (i % 2 != 0) ? make_test_key(i) : (i % 3 != 0) ? make_test_val(i) : NULL;
+
+    if (val) { TEST_ASSERT_EQUAL_STRING(val, hashmap_get(merged, make_test_key(i))); }
+    else { TEST_ASSERT_NULL(hashmap_get(merged, make_test_key(i))); }
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS_COLLISIONS - ((TEST_ITERATIONS_COLLISIONS + 5) / 6), \
+                        hashmap_count(merged));
+}
+
+void test_hashmap_equal(void) {
+
+  Hashmap *map = str_map;
+
+  TEST_ASSERT_TRUE(hashmap_equal(map, map));
+  TEST_ASSERT_TRUE(hashmap_equal(hashmap_make(hash_str, equal_str, equal_str), \
+                                 hashmap_make(hash_str, equal_str, equal_str)));
+  TEST_ASSERT_FALSE(hashmap_equal(map, hashmap_make(hash_str, equal_str, equal_str)));
+
+  /* update a value then put back an equal copy of the original */
+  char *key = make_test_key(integers[0]);
+  char *val = make_test_val(integers[0]);
+
+  Hashmap *updated = hashmap_assoc(map, key, make_updated_val(val));
+  TEST_ASSERT_FALSE(hashmap_equal(map, updated));
+
+  Hashmap *restored = hashmap_assoc(updated, key, make_test_val(integers[0]));
+  TEST_ASSERT_TRUE(hashmap_equal(map, restored));
+
+  /* remove a key and add a different one */
+  Hashmap *replaced = hashmap_assoc(hashmap_dissoc(map, key), "new_key", val);
+  TEST_ASSERT_EQUAL_INT(hashmap_count(map), hashmap_count(replaced));
+  TEST_ASSERT_FALSE(hashmap_equal(map, replaced));
+
+  /* the same keys and vals added in a different order share no nodes */
+  Hashmap *other = hashmap_make(hash_str, equal_str, equal_str);
+  Hashmap *other_hash = hashmap_make(hash_collision, equal_str, equal_str);
+
+  shuffle(integers, TEST_ITERATIONS);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    other = hashmap_assoc(other, make_test_key(integers[i]), make_test_val(integers[i]));
+    other_hash = hashmap_assoc(other_hash, make_test_key(integers[i]), \
+                               make_test_val(integers[i]));
+  }
+  TEST_ASSERT_TRUE(hashmap_equal(map, other));
+  TEST_ASSERT_TRUE(hashmap_equal(other, map));
+
+  /* maps with different hash functions */
+  TEST_ASSERT_TRUE(hashmap_equal(map, other_hash));
+  TEST_ASSERT_TRUE(hashmap_equal(other_hash, map));
+  TEST_ASSERT_FALSE(hashmap_equal(updated, other_hash));
+  TEST_ASSERT_FALSE(hashmap_equal(other_hash, updated));
+
+  /* HashCollisionNodes holding the same keys in different orders */
+  Hashmap *collisions = hashmap_make(hash_constant, equal_str, equal_str);
+  Hashmap *reversed = hashmap_make(hash_constant, equal_str, equal_str);
+
+  for (int i = 0; i < 100; i++) {
+    collisions = hashmap_assoc(collisions, make_test_key(i), make_test_val(i));
+    reversed = hashmap_assoc(reversed, make_test_key(99 - i), make_test_val(99 - i));
+  }
+  TEST_ASSERT_TRUE(hashmap_equal(collisions, reversed));
+
+  reversed = hashmap_assoc(reversed, make_test_key(50), "changed");
+  TEST_ASSERT_FALSE(hashmap_equal(collisions, reversed));
+
+  /* NULL values with different hash functions, in entries and
+     HashCollisionNodes, aren't mistaken for missing keys */
+  Hashmap *nulls = hashmap_make(hash_str, equal_str, equal_int);
+  Hashmap *nulls_collision = hashmap_make(hash_collision, equal_str, equal_int);
+  for (int i = 0; i < 100; i++) {
+    nulls = hashmap_assoc(nulls, make_test_key(i), NULL);
+    nulls_collision = hashmap_assoc(nulls_collision, make_test_key(i), NULL);
+  }
+  TEST_ASSERT_TRUE(hashmap_equal(nulls, nulls_collision));
+  TEST_ASSERT_TRUE(hashmap_equal(nulls_collision, nulls));
+
+  Hashmap *moved = hashmap_assoc(hashmap_dissoc(nulls, make_test_key(0)), "other", NULL);
+  TEST_ASSERT_FALSE(hashmap_equal(moved, nulls_collision));
+  TEST_ASSERT_FALSE(hashmap_equal(nulls_collision, moved));
+}
+
+/* counts of the differences found by hashmap_diff */
+struct diff_counts {
+  int added;
+  int removed;
+  int changed;
+};
+
+void added_fn(void *key, void *val, void **acc) {
+  ((struct diff_counts *)acc)->added++;
+}
+
+void removed_fn(void *key, void *val, void **acc) {
+  ((struct diff_counts *)acc)->removed++;
+}
+
+void changed_fn(void *key, void *old_val, void *new_val, void **acc) {
+
+  TEST_ASSERT_FALSE(equal_str(old_val, new_val));
+  ((struct diff_counts *)acc)->changed++;
+}
+
+void test_hashmap_diff(void) {
+
+  Hashmap *old = str_map;
+  Hashmap *new = old;
+  int n = TEST_ITERATIONS / 10;
+
+  /* update, remove and add n keys */
+  shuffle(integers, TEST_ITERATIONS);
+  for (int i = 0; i < n; i++) {
+
+    char *key = make_test_key(integers[i]);
+    new = hashmap_assoc(new, key, make_updated_val(make_test_val(integers[i])));
+
+    new = hashmap_dissoc(new, make_test_key(integers[n + i]));
+    new = hashmap_assoc(new, make_test_key(TEST_ITERATIONS + i), "added");
+  }
+  /* an equal value isn't a change */
+  new = hashmap_assoc(new, make_test_key(integers[n * 2]), make_test_val(integers[n * 2]));
+
+  struct diff_counts counts = {0, 0, 0};
+  hashmap_diff(old, new, added_fn, removed_fn, changed_fn, (void **)&counts);
+
+  TEST_ASSERT_EQUAL_INT(n, counts.added);
+  TEST_ASSERT_EQUAL_INT(n, counts.removed);
+  TEST_ASSERT_EQUAL_INT(n, counts.changed);
+
+  /* the other way round */
+  struct diff_counts reverse = {0, 0, 0};
+  hashmap_diff(new, old, added_fn, removed_fn, changed_fn, (void **)&reverse);
+
+  TEST_ASSERT_EQUAL_INT(n, reverse.added);
+  TEST_ASSERT_EQUAL_INT(n, reverse.removed);
+  TEST_ASSERT_EQUAL_INT(n, reverse.changed);
+
+  /* no differences */
+  struct diff_counts none = {0, 0, 0};
+  hashmap_diff(old, old, added_fn, removed_fn, changed_fn, (void **)&none);
+  hashmap_diff(new, new, NULL, NULL, NULL, (void **)&none);
+
+  TEST_ASSERT_EQUAL_INT(0, none.added + none.removed + none.changed);
+
+  /* everything added to an empty map */
+  struct diff_counts all = {0, 0, 0};
+  hashmap_diff(hashmap_make(hash_str, equal_str, equal_str), old, added_fn, removed_fn, \
+               changed_fn, (void **)&all);
+
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, all.added);
+  TEST_ASSERT_EQUAL_INT(0, all.removed + all.changed);
+
+  /* maps of HashCollisionNodes */
+  old = hashmap_make(hash_collision, equal_str, equal_str);
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+    old = hashmap_assoc(old, make_test_key(i), make_test_val(i));
+  }
+  new = old;
+  for (int i = 0; i < 10; i++) {
+    new = hashmap_assoc(new, make_test_key(i), "changed");
+    new = hashmap_dissoc(new, make_test_key(10 + i));
+    new = hashmap_assoc(new, make_test_key(TEST_ITERATIONS_COLLISIONS + i), "added");
+  }
+
+  struct diff_counts collisions = {0, 0, 0};
+  hashmap_diff(old, new, added_fn, removed_fn, changed_fn, (void **)&collisions);
+
+  TEST_ASSERT_EQUAL_INT(10, collisions.added);
+  TEST_ASSERT_EQUAL_INT(10, collisions.removed);
+  TEST_ASSERT_EQUAL_INT(10, collisions.changed);
+}
+
+/* adds, finds and removes keys that all collide */
+void check_collisions(hash_fn hash) {
+
+  Hashmap *map = hashmap_make(hash, equal_str, equal_str);
+
+  char **keys = GC_MALLOC(sizeof(char*) * TEST_ITERATIONS_COLLISIONS);
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+    keys[i] = make_test_key(i);
+  }
+
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+    map = hashmap_assoc(map, keys[i], keys[i]);
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS_COLLISIONS, hashmap_count(map));
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+    TEST_ASSERT_EQUAL_PTR(keys[i], hashmap_get(map, keys[i]));
+  }
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+    map = hashmap_dissoc(map, keys[i]);
+  }
+
+  TEST_ASSERT_EQUAL_INT(0, hashmap_count(map));
+}
+
+void test_hashmap_collisions_many(void) {
+
+  check_collisions(hash_collision);
+  check_collisions(hash_constant);
+}
+
+void test_hashmap_default_hash(void) {
+
+  Hashmap *map = hashmap_make(NULL, NULL, NULL);
+
+  /* equal strings in different buffers have the same hash */
+  char *key = make_test_key(1);
+  TEST_ASSERT_TRUE(hashmap_hash(map, key) == hashmap_hash(map, make_test_key(1)));
+  TEST_ASSERT_TRUE(hashmap_hash(map, key) != hashmap_hash(map, make_test_key(2)));
+
+  /* every length up to a few words */
+  char buf[BUFFER_SIZE * 2] = {0};
+  hash_t hashes[BUFFER_SIZE * 2];
+
+  for (int len = 0; len < BUFFER_SIZE * 2 - 1; len++) {
+
+    buf[len] = 'a';
+    hashes[len] = hashmap_hash(map, buf);
+
+    for (int i = 0; i < len; i++) {
+      TEST_ASSERT_TRUE(hashes[i] != hashes[len]);
+    }
+  }
+
+  /* the seed changes the hash */
+  uint64_t original = hashmap_seed(1);
+  hash_t hash = hashmap_hash(map, key);
+  hashmap_seed(2);
+  TEST_ASSERT_TRUE(hash != hashmap_hash(map, key));
+
+  /* maps made after setting the seed work as normal */
+  map = hashmap_make(NULL, NULL, NULL);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    map = hashmap_assoc(map, make_test_key(i), make_test_val(i));
+  }
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    TEST_ASSERT_EQUAL_STRING(make_test_val(i), hashmap_get(map, make_test_key(i)));
+  }
+
+  /* the tests after this one use the original seed */
+  TEST_ASSERT_EQUAL_INT(2, hashmap_seed(original));
+}
+
+void test_hashmap_from_arrays_parallel(void) {
+
+  /* each key appears twice and the second value should win */
+  int n = TEST_ITERATIONS * 2;
+  void **keys = GC_MALLOC(sizeof(void*) * n);
+  void **vals = GC_MALLOC(sizeof(void*) * n);
+
+  shuffle(integers, TEST_ITERATIONS);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    keys[i] = make_test_key(integers[i]);
+    vals[i] = make_test_val(integers[i]);
+    keys[n - i - 1] = make_test_key(integers[i]);
+    vals[n - i - 1] = make_updated_val(vals[i]);
+  }
+
+  Hashmap *expected = hashmap_from_arrays(hash_str, equal_str, equal_str, keys, vals, n);
+  Hashmap *collisions = hashmap_from_arrays(hash_collision, equal_str, equal_str, keys, vals, n);
+
+  int thread_counts[] = {1, 2, 3, 8, 64};
+  for (int t = 0; t < sizeof(thread_counts) / sizeof(int); t++) {
+
+    Hashmap *map = hashmap_from_arrays_parallel(hash_str, equal_str, equal_str, \
+                                                keys, vals, n, thread_counts[t]);
+    TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(map));
+    TEST_ASSERT_TRUE(hashmap_equal(expected, map));
+
+    for (int i = 0; i < TEST_ITERATIONS; i++) {
+      TEST_ASSERT_EQUAL_STRING(vals[n - i - 1], hashmap_get(map, keys[i]));
+    }
+
+    map = hashmap_from_arrays_parallel(hash_collision, equal_str, equal_str, \
+                                       keys, vals, n, thread_counts[t]);
+    TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(map));
+    TEST_ASSERT_TRUE(hashmap_equal(collisions, map));
+  }
+
+  /* fewer keys than threads */
+  Hashmap *map = hashmap_from_arrays_parallel(hash_str, equal_str, equal_str, keys, vals, 3, 8);
+  TEST_ASSERT_EQUAL_INT(3, hashmap_count(map));
+
+  map = hashmap_from_arrays_parallel(hash_str, equal_str, equal_str, keys, vals, 0, 8);
+  TEST_ASSERT_TRUE(hashmap_empty(map));
+}
+
+
+void test_hashmap_stats(void) {
+
+  HashmapStats stats;
+
+  /* an empty map */
+  Hashmap *map = hashmap_make(hash_int, equal_int, equal_int);
+  hashmap_stats(map, &stats);
+  TEST_ASSERT_EQUAL_INT(0, stats.bitmap_nodes);
+  TEST_ASSERT_EQUAL_INT(0, stats.inline_entries);
+  TEST_ASSERT_TRUE(stats.bytes > 0);
+
+  /* every pair is counted once at some depth */
+  for (int s = 0; s < 2; s++) {
+
+    map = s ? collisions_map : int_map;
+    hashmap_stats(map, &stats);
+
+    int pairs = 0;
+    for (int d = 0; d < HASHMAP_STATS_DEPTHS; d++) { pairs += stats.depth[d]; }
+    TEST_ASSERT_EQUAL_INT(hashmap_count(map), pairs);
+    TEST_ASSERT_TRUE(stats.max_depth > 0 && stats.max_depth < HASHMAP_STATS_DEPTHS);
+    TEST_ASSERT_TRUE(stats.depth[stats.max_depth] > 0);
+    TEST_ASSERT_TRUE(stats.fan_out >= 1 && stats.fan_out <= 32);
+
+    /* the map shares all of its nodes with itself */
+    size_t shared = hashmap_shared_bytes(map, map);
+    TEST_ASSERT_TRUE(shared < stats.bytes && shared + 64 >= stats.bytes);
+  }
+
+  /* int_map has unique hashes so there are no HashCollisionNodes */
+  hashmap_stats(int_map, &stats);
+  TEST_ASSERT_EQUAL_INT(0, stats.collision_nodes);
+  TEST_ASSERT_EQUAL_INT(0, stats.max_collision);
+  TEST_ASSERT_EQUAL_INT(hashmap_count(int_map), stats.inline_entries);
+
+  /* collisions_map only has 4 different hashes */
+  hashmap_stats(collisions_map, &stats);
+  TEST_ASSERT_EQUAL_INT(4, stats.collision_nodes);
+  TEST_ASSERT_EQUAL_INT(0, stats.inline_entries);
+  TEST_ASSERT_TRUE(stats.max_collision >= TEST_ITERATIONS_COLLISIONS / 4);
+
+  /* a new version shares all but the path to the changed key */
+  hashmap_stats(int_map, &stats);
+  Hashmap *updated = hashmap_assoc(int_map, (void*)1, "updated");
+  size_t shared = hashmap_shared_bytes(int_map, updated);
+  TEST_ASSERT_TRUE(shared < stats.bytes);
+  TEST_ASSERT_TRUE(shared > stats.bytes * 9 / 10);
+  TEST_ASSERT_EQUAL_INT(shared, hashmap_shared_bytes(updated, int_map));
+
+  /* maps built separately share nothing */
+  Hashmap *copy = hashmap_make(hash_int, equal_int, equal_int);
+  for (uintptr_t i = 0; i < 100; i++) { copy = hashmap_assoc(copy, (void*)i, (void*)i); }
+  TEST_ASSERT_EQUAL_INT(0, hashmap_shared_bytes(int_map, copy));
+  TEST_ASSERT_EQUAL_INT(0, hashmap_shared_bytes(int_map, hashmap_make(hash_int, NULL, NULL)));
+}
+
+/* writes map to a temporary file and maps it back in */
+Hashmap *serialize_and_open(Hashmap *map, hash_fn hash, HashmapCodec *val_codec) {
+
+  char path[] = "/tmp/test_hashmap_XXXXXX";
+  int fd = mkstemp(path);
+  TEST_ASSERT_TRUE(fd >= 0);
+  TEST_ASSERT_EQUAL_INT(0, hashmap_serialize(map, fd, &hashmap_str_codec, val_codec));
+  close(fd);
+
+  Hashmap *mapped = hashmap_open_mmap(path, hash, equal_str, &hashmap_str_codec, val_codec);
+  unlink(path);
+  return mapped;
+}
+
+void test_hashmap_mmap(void) {
+
+  Hashmap *maps[] = {str_map, int_vals_map, collisions_map};
+  hash_fn hashes[] = {hash_str, hash_str, hash_collision};
+  HashmapCodec *codecs[] = {&hashmap_str_codec, &hashmap_int_codec, &hashmap_str_codec};
+
+  for (int m = 0; m < 3; m++) {
+
+    Hashmap *map = maps[m];
+    Hashmap *mapped = serialize_and_open(map, hashes[m], codecs[m]);
+    TEST_ASSERT_NOT_NULL(mapped);
+    TEST_ASSERT_EQUAL_INT(hashmap_count(map), hashmap_count(mapped));
+
+    /* every key is found with an equal value */
+    int n = hashmap_count(map);
+    for (int i = 0; i < n; i++) {
+
+      char *key = make_test_key(i);
+      void *val = hashmap_get(mapped, key);
+
+      if (codecs[m] == &hashmap_int_codec) {
+        TEST_ASSERT_EQUAL_PTR(hashmap_get(map, key), val);
+      } else {
+        TEST_ASSERT_EQUAL_STRING(hashmap_get(map, key), val);
+      }
+    }
+    TEST_ASSERT_NULL(hashmap_get(mapped, "missing"));
+    TEST_ASSERT_NULL(hashmap_get(mapped, make_test_key(n)));
+
+    /* visit, reduce and the iterator see every pair */
+    uintptr_t count = 0;
+    hashmap_visit(mapped, counter_fn, (void **)&count);
+    TEST_ASSERT_EQUAL_INT(n, count);
+
+    stop_at = 0;
+    TEST_ASSERT_EQUAL_INT(n, (uintptr_t)hashmap_reduce(mapped, count_until_fn, NULL));
+    stop_at = 10;
+    TEST_ASSERT_EQUAL_INT(10, (uintptr_t)hashmap_reduce(mapped, count_until_fn, NULL));
+
+    count = 0;
+    for (Iterator *iter = hashmap_iterator_make(mapped); iter; count++) {
+
+      char *key = iterator_value(iter);
+      iter = iterator_next(iter);
+      TEST_ASSERT_TRUE(hashmap_get(mapped, key) == iterator_value(iter));
+      iter = iterator_next(iter);
+    }
+    TEST_ASSERT_EQUAL_INT(n, count);
+
+    /* the batched lookup gives the same values */
+    void *keys[3] = {make_test_key(0), "missing", make_test_key(n - 1)};
+    void *vals[3];
+    hashmap_get_many(mapped, keys, 3, vals);
+    TEST_ASSERT_TRUE(vals[0] == hashmap_get(mapped, keys[0]));
+    TEST_ASSERT_NULL(vals[1]);
+    TEST_ASSERT_TRUE(vals[2] == hashmap_get(mapped, keys[2]));
+
+    hashmap_close_mmap(mapped);
+    TEST_ASSERT_TRUE(hashmap_empty(mapped));
+    TEST_ASSERT_NULL(hashmap_get(mapped, keys[0]));
+  }
+
+  /* an empty map */
+  Hashmap *empty = serialize_and_open(hashmap_make(hash_str, equal_str, equal_str), hash_str, \
+                                      &hashmap_str_codec);
+  TEST_ASSERT_NOT_NULL(empty);
+  TEST_ASSERT_TRUE(hashmap_empty(empty));
+  TEST_ASSERT_NULL(hashmap_get(empty, "missing"));
+  TEST_ASSERT_NULL(hashmap_iterator_make(empty));
+  hashmap_close_mmap(empty);
+
+  /* opening with a different hash function fails */
+  TEST_ASSERT_NULL(serialize_and_open(str_map, hash_collision, &hashmap_str_codec));
+
+  /* as does opening a file that isn't a map */
+  TEST_ASSERT_NULL(hashmap_open_mmap("/dev/null", NULL, NULL, &hashmap_str_codec, \
+                                     &hashmap_str_codec));
+  TEST_ASSERT_NULL(hashmap_open_mmap("/missing", NULL, NULL, &hashmap_str_codec, \
+                                     &hashmap_str_codec));
+}
+
+void test_hashmap_versions(void) {
+
+  Hashmap *bases[] = {str_map, collisions_map};
+  hash_fn hashes[] = {hash_str, hash_collision};
+
+  for (int m = 0; m < 2; m++) {
+
+    /* versions each made from the last with a few changes */
+    int n = 20;
+    Hashmap **versions = GC_MALLOC(sizeof(Hashmap*) * n);
+    versions[0] = bases[m];
+
+    for (int v = 1; v < n; v++) {
+
+      versions[v] = versions[v - 1];
+      for (int i = 0; i < 5; i++) {
+        int k = rand() % hashmap_count(bases[m]);
+        versions[v] = hashmap_assoc(versions[v], make_test_key(k), make_test_val(v * 100 + i));
+      }
+      if (v == n / 2) { versions[v] = hashmap_dissoc(versions[v], make_test_key(1)); }
+    }
+
+    char path[] = "/tmp/test_hashmap_XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL_INT(0, hashmap_serialize_versions(versions, n, fd, &hashmap_str_codec, \
+                                                        &hashmap_str_codec));
+    off_t size = lseek(fd, 0, SEEK_END);
+
+    /* written together the versions take far less space than written separately */
+    char single_path[] = "/tmp/test_hashmap_XXXXXX";
+    int single = mkstemp(single_path);
+    TEST_ASSERT_EQUAL_INT(0, hashmap_serialize(versions[0], single, &hashmap_str_codec, \
+                                               &hashmap_str_codec));
+    off_t single_size = lseek(single, 0, SEEK_END);
+    close(single);
+    unlink(single_path);
+    TEST_ASSERT_TRUE(size < single_size * n / 2);
+
+    /* changing a HashCollisionNode copies all of it but otherwise
+       only the path to the changed key is new */
+    if (m == 0) { TEST_ASSERT_TRUE(size < single_size * 2); }
+
+    /* every version comes back the same */
+    lseek(fd, 0, SEEK_SET);
+    int n_loaded = 0;
+    Hashmap **loaded = hashmap_load_versions(fd, hashes[m], equal_str, equal_str, \
+                                             &hashmap_str_codec, &hashmap_str_codec, &n_loaded);
+    close(fd);
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(n, n_loaded);
+
+    for (int v = 0; v < n; v++) {
+      TEST_ASSERT_EQUAL_INT(hashmap_count(versions[v]), hashmap_count(loaded[v]));
+      TEST_ASSERT_TRUE(hashmap_equal(versions[v], loaded[v]));
+    }
+    TEST_ASSERT_NULL(hashmap_get(loaded[n - 1], make_test_key(1)));
+
+    /* with the same sharing between them */
+    HashmapStats stats;
+    for (int v = 1; v < n; v++) {
+
+      hashmap_stats(loaded[v], &stats);
+      size_t shared = hashmap_shared_bytes(loaded[v - 1], loaded[v]);
+      TEST_ASSERT_EQUAL_INT(hashmap_shared_bytes(versions[v - 1], versions[v]), shared);
+      if (m == 0) { TEST_ASSERT_TRUE(shared > stats.bytes / 2); }
+    }
+
+    /* the loaded maps can be changed like any other */
+    Hashmap *changed = hashmap_assoc(loaded[0], "new", "val");
+    TEST_ASSERT_EQUAL_STRING("val", hashmap_get(changed, "new"));
+    TEST_ASSERT_NULL(hashmap_get(loaded[0], "new"));
+
+    /* mapping the file gives the newest version */
+    Hashmap *mapped = hashmap_open_mmap(path, hashes[m], equal_str, &hashmap_str_codec, \
+                                        &hashmap_str_codec);
+    TEST_ASSERT_NOT_NULL(mapped);
+    TEST_ASSERT_EQUAL_INT(hashmap_count(versions[n - 1]), hashmap_count(mapped));
+    TEST_ASSERT_EQUAL_STRING(hashmap_get(versions[n - 1], make_test_key(2)), \
+                             hashmap_get(mapped, make_test_key(2)));
+    hashmap_close_mmap(mapped);
+    unlink(path);
+  }
+
+  /* a file that isn't a map */
+  int fd = open("/dev/null", O_RDONLY);
+  int n_loaded = 0;
+  TEST_ASSERT_NULL(hashmap_load_versions(fd, NULL, NULL, NULL, &hashmap_str_codec, \
+                                         &hashmap_str_codec, &n_loaded));
+  close(fd);
+}
+
+/* loads and maps the first size bytes of image, walking whatever opens
+   without reading its keys or values. returns the number that opened.
+   everything is made in a region so nothing is left behind */
+int open_image(char *image, size_t size, hash_fn hash) {
+
+  Region *region = region_begin();
+  char path[] = "/tmp/test_hashmap_XXXXXX";
+  int fd = mkstemp(path);
+  TEST_ASSERT_TRUE(fd >= 0);
+  TEST_ASSERT_EQUAL_INT(size, write(fd, image, size));
+  lseek(fd, 0, SEEK_SET);
+
+  int opened = 0;
+  int n = 0;
+  errno = 0;
+  Hashmap **loaded = hashmap_load_versions(fd, hash, equal_str, equal_str, &hashmap_str_codec, \
+                                           &hashmap_str_codec, &n);
+  close(fd);
+
+  if (loaded) {
+    for (int i = 0; i < n; i++) {
+      uintptr_t count = 0;
+      hashmap_visit(loaded[i], counter_fn, (void **)&count);
+      hashmap_release(loaded[i]);
+    }
+    opened++;
+  }
+  else { TEST_ASSERT_EQUAL_INT(EINVAL, errno); }
+
+  errno = 0;
+  Hashmap *mapped = hashmap_open_mmap(path, hash, equal_str, &hashmap_str_codec, \
+                                      &hashmap_str_codec);
+  unlink(path);
+
+  if (mapped) {
+    uintptr_t count = 0;
+    hashmap_visit(mapped, counter_fn, (void **)&count);
+    for (Iterator *iter = hashmap_iterator_make(mapped); iter; ) { iter = iterator_next(iter); }
+    hashmap_close_mmap(mapped);
+    hashmap_release(mapped);
+    opened++;
+  }
+  else { TEST_ASSERT_EQUAL_INT(EINVAL, errno); }
+
+  region_end(region);
+  return opened;
+}
+
+void test_hashmap_image_corrupt(void) {
+
+  hash_fn hashes[] = {hash_str, hash_collision};
+
+  for (int m = 0; m < 2; m++) {
+
+    Hashmap *map = hashmap_make(hashes[m], equal_str, equal_str);
+    for (int i = 0; i < 100; i++) {
+      map = hashmap_assoc(map, make_test_key(i), make_test_val(i));
+    }
+
+    char path[] = "/tmp/test_hashmap_XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_EQUAL_INT(0, hashmap_serialize(map, fd, &hashmap_str_codec, &hashmap_str_codec));
+    size_t size = lseek(fd, 0, SEEK_END);
+    char *image = GC_MALLOC(size);
+    TEST_ASSERT_EQUAL_INT(size, pread(fd, image, size, 0));
+    close(fd);
+    unlink(path);
+
+    TEST_ASSERT_EQUAL_INT(2, open_image(image, size, hashes[m]));
+
+    /* every truncated image is refused */
+    for (size_t len = 0; len < size; len += 4) {
+      TEST_ASSERT_EQUAL_INT(0, open_image(image, len, hashes[m]));
+    }
+
+    /* a sub-node pointing back at its parent */
+    uint64_t root;
+    memcpy(&root, image + size - 2 * sizeof(uint64_t), sizeof(root));
+    uint32_t datamap, nodemap;
+    memcpy(&datamap, image + root + 8, sizeof(datamap));
+    memcpy(&nodemap, image + root + 12, sizeof(nodemap));
+    TEST_ASSERT_TRUE(nodemap != 0);
+
+    char *corrupt = GC_MALLOC(size);
+    memcpy(corrupt, image, size);
+    memcpy(corrupt + root + 24 + 24 * __builtin_popcount(datamap), &root, sizeof(root));
+    TEST_ASSERT_EQUAL_INT(0, open_image(corrupt, size, hashes[m]));
+
+    /* a sub-node at the offset of a value. the value is made to look
+       like an empty node so only reading it as both gives it away */
+    if (datamap) {
+
+      uint64_t val, zero = 0;
+      memcpy(&val, image + root + 24 + 16, sizeof(val));
+      memcpy(corrupt, image, size);
+      memcpy(corrupt + val, &zero, sizeof(zero));
+      memcpy(corrupt + val + 8, &zero, sizeof(zero));
+      memcpy(corrupt + root + 24 + 24 * __builtin_popcount(datamap), &val, sizeof(val));
+      TEST_ASSERT_EQUAL_INT(0, open_image(corrupt, size, hashes[m]));
+    }
+
+    /* a key longer than the image */
+    uint64_t huge = (uint64_t)1 << 40;
+    memcpy(corrupt, image, size);
+    memcpy(corrupt + 16, &huge, sizeof(huge));
+    TEST_ASSERT_EQUAL_INT(0, open_image(corrupt, size, hashes[m]));
+
+    /* any word overwritten either opens or is refused without reading
+       outside the image */
+    for (size_t offset = 16; offset + 16 <= size; offset += 8) {
+
+      uint64_t word;
+      memcpy(&word, image + offset, sizeof(word));
+      uint64_t values[] = {0, ~word, word + 8, word - 8, offset, offset + 8, (uint64_t)size};
+
+      for (int v = 0; v < 7; v++) {
+        memcpy(corrupt, image, size);
+        memcpy(corrupt + offset, &values[v], sizeof(values[v]));
+        open_image(corrupt, size, hashes[m]);
+      }
+    }
+  }
+}
+
+/* an allocator that counts what goes through it, from any thread */
+typedef struct Counts {
+  int allocs;
+  int frees;
+} Counts;
+
+void *counting_alloc(void *ctx, size_t size) {
+  __atomic_add_fetch(&((Counts *)ctx)->allocs, 1, __ATOMIC_RELAXED);
+  return GC_MALLOC(size);
+}
+
+void counting_free(void *ctx, void *ptr) {
+  __atomic_add_fetch(&((Counts *)ctx)->frees, 1, __ATOMIC_RELAXED);
+#ifdef PERSISTENT_REFCOUNT
+  free(ptr);
+#endif
+}
+
+void test_hashmap_allocator(void) {
+
+  Counts counts = {0, 0};
+  Allocator counting = {counting_alloc, NULL, counting_free, &counts};
+  Allocator *original = allocator_default();
+
+  /* every version of a map uses the allocator it was made with */
+  Hashmap *map = hashmap_make_with_allocator(hash_str, equal_str, equal_str, &counting);
+  TEST_ASSERT_EQUAL_INT(1, counts.allocs);
+
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    map = hashmap_assoc(map, make_test_key(i), make_test_val(i));
+  }
+  int allocs = counts.allocs;
+  TEST_ASSERT_TRUE(allocs > TEST_ITERATIONS);
+
+  map = hashmap_dissoc(map, make_test_key(0));
+  TEST_ASSERT_TRUE(counts.allocs > allocs);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS - 1, hashmap_count(map));
+  TEST_ASSERT_EQUAL_STRING(make_test_val(1), hashmap_get(map, make_test_key(1)));
+
+  /* maps made with the default allocator don't use it */
+  allocs = counts.allocs;
+  Hashmap *other = hashmap_assoc(hashmap_make(hash_str, equal_str, equal_str), "key", "val");
+  TEST_ASSERT_EQUAL_INT(allocs, counts.allocs);
+
+  /* until it becomes the default */
+  allocator_set_default(&counting);
+  TEST_ASSERT_EQUAL_PTR(&counting, allocator_default());
+
+  char **keys = GC_MALLOC(sizeof(char*) * TEST_ITERATIONS);
+  char **vals = GC_MALLOC(sizeof(char*) * TEST_ITERATIONS);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    keys[i] = make_test_key(i);
+    vals[i] = make_test_val(i);
+  }
+  int frees = counts.frees;
+  Hashmap *built = hashmap_from_arrays(hash_str, equal_str, equal_str, (void **)keys, \
+                                       (void **)vals, TEST_ITERATIONS);
+  allocator_set_default(NULL);
+  TEST_ASSERT_EQUAL_PTR(original, allocator_default());
+
+  /* the temporary arrays are handed back */
+  TEST_ASSERT_TRUE(counts.allocs > allocs);
+  TEST_ASSERT_EQUAL_INT(frees + 2, counts.frees);
+  TEST_ASSERT_TRUE(hashmap_equal(built, hashmap_assoc(map, make_test_key(0), make_test_val(0))));
+
+  /* and other is unaffected */
+  allocs = counts.allocs;
+  other = hashmap_assoc(other, "key2", "val2");
+  TEST_ASSERT_EQUAL_INT(allocs, counts.allocs);
+  TEST_ASSERT_EQUAL_INT(2, hashmap_count(other));
+
+  /* building and loading maps can be given an allocator too */
+  char path[] = "/tmp/test_hashmap_XXXXXX";
+  int fd = mkstemp(path);
+  TEST_ASSERT_EQUAL_INT(0, hashmap_serialize(built, fd, &hashmap_str_codec, &hashmap_str_codec));
+  unlink(path);
+
+  Counts default_counts = {0, 0};
+  Allocator default_counting = {counting_alloc, NULL, counting_free, &default_counts};
+  allocator_set_default(&default_counting);
+  allocs = counts.allocs;
+
+  Hashmap *given = hashmap_from_arrays_with_allocator(hash_str, equal_str, equal_str, \
+                                                      (void **)keys, (void **)vals, \
+                                                      TEST_ITERATIONS, &counting);
+  Hashmap *given_parallel = hashmap_from_arrays_parallel_with_allocator(hash_str, equal_str, \
+                                                                        equal_str, (void **)keys, \
+                                                                        (void **)vals, \
+                                                                        TEST_ITERATIONS, 4, \
+                                                                        &counting);
+  int n = 0;
+  lseek(fd, 0, SEEK_SET);
+  Hashmap **loaded = hashmap_load_versions_with_allocator(fd, hash_str, equal_str, equal_str, \
+                                                          &hashmap_str_codec, \
+                                                          &hashmap_str_codec, &n, &counting);
+  close(fd);
+
+  allocator_set_default(NULL);
+  TEST_ASSERT_EQUAL_INT(0, default_counts.allocs);
+  TEST_ASSERT_TRUE(counts.allocs > allocs);
+
+  TEST_ASSERT_EQUAL_INT(1, n);
+  TEST_ASSERT_TRUE(hashmap_equal(built, given));
+  TEST_ASSERT_TRUE(hashmap_equal(built, given_parallel));
+  TEST_ASSERT_TRUE(hashmap_equal(built, loaded[0]));
+  hashmap_free_versions(loaded);
+
+  /* a merge is allocated like its first map, so what it takes from
+     a second map made with another allocator is copied */
+  Counts b_counts = {0, 0};
+  Allocator b_counting = {counting_alloc, NULL, counting_free, &b_counts};
+  Hashmap *a_map = hashmap_make_with_allocator(hash_str, equal_str, equal_str, &counting);
+  Hashmap *b_map = hashmap_make_with_allocator(hash_str, equal_str, equal_str, &b_counting);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    b_map = hashmap_assoc(b_map, keys[i], vals[i]);
+  }
+  a_map = hashmap_assoc(a_map, keys[0], "a");
+
+  allocs = b_counts.allocs;
+  Hashmap *merged = hashmap_merge(a_map, b_map, NULL);
+  Hashmap *copied = hashmap_merge(hashmap_make_with_allocator(hash_str, equal_str, equal_str, \
+                                                              &counting), b_map, NULL);
+  TEST_ASSERT_EQUAL_INT(allocs, b_counts.allocs);
+  TEST_ASSERT_EQUAL_INT(0, hashmap_shared_bytes(merged, b_map));
+  TEST_ASSERT_EQUAL_INT(0, hashmap_shared_bytes(copied, b_map));
+  TEST_ASSERT_TRUE(hashmap_equal(built, merged));
+  TEST_ASSERT_TRUE(hashmap_equal(built, copied));
+
+  /* and b is untouched when the merges go */
+  frees = b_counts.frees;
+  hashmap_release(merged);
+  hashmap_release(copied);
+  TEST_ASSERT_EQUAL_INT(frees, b_counts.frees);
+  TEST_ASSERT_TRUE(hashmap_equal(built, b_map));
+}
+
+void test_hashmap_region(void) {
+
+  Allocator *original = allocator_default();
+  Region *region = region_begin();
+  TEST_ASSERT_EQUAL_PTR(region_allocator(region), allocator_default());
+
+  /* a chain of versions made inside the region */
+  Hashmap *map = hashmap_make(hash_str, equal_str, equal_str);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    map = hashmap_assoc(map, make_test_key(i), make_test_val(i));
+  }
+  map = hashmap_dissoc(map, make_test_key(0));
+  TEST_ASSERT_TRUE(region_size(region) > 0);
+
+  /* regions nest and maps keep using the one they were made in */
+  Region *inner = region_begin();
+  size_t size = region_size(region);
+  Hashmap *scratch = hashmap_assoc(hashmap_make(NULL, NULL, NULL), "inner", "val");
+  TEST_ASSERT_EQUAL_INT(1, hashmap_count(scratch));
+  TEST_ASSERT_TRUE(region_size(inner) > 0);
+  TEST_ASSERT_EQUAL_INT(size, region_size(region));
+
+  hashmap_assoc(map, "inner", "val");
+  TEST_ASSERT_TRUE(region_size(region) > size);
+  region_end(inner);
+  TEST_ASSERT_EQUAL_PTR(region_allocator(region), allocator_default());
+
+  /* the workers of a parallel build share the region */
+  char **keys = GC_MALLOC(sizeof(char*) * TEST_ITERATIONS);
+  char **vals = GC_MALLOC(sizeof(char*) * TEST_ITERATIONS);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    keys[i] = make_test_key(i);
+    vals[i] = make_test_val(i);
+  }
+  Hashmap *built = hashmap_from_arrays_parallel(hash_str, equal_str, equal_str, (void **)keys, \
+                                                (void **)vals, TEST_ITERATIONS, 4);
+  TEST_ASSERT_TRUE(hashmap_equal(built, hashmap_assoc(map, make_test_key(0), make_test_val(0))));
+
+  /* versions of a map made outside the region don't use it, so they
+     outlive it too. a copy promoted into the region does use it */
+  size = region_size(region);
+  Hashmap *derived = hashmap_dissoc(hashmap_assoc(str_map, "derived", "val"), make_test_key(1));
+  TEST_ASSERT_EQUAL_INT(size, region_size(region));
+
+  Hashmap *local = hashmap_promote(str_map, region_allocator(region));
+  local = hashmap_assoc(local, "derived", "val");
+  TEST_ASSERT_TRUE(region_size(region) > size);
+  TEST_ASSERT_EQUAL_STRING("val", hashmap_get(local, "derived"));
+
+  /* so does merging the region's map into an outer one */
+  Hashmap *outer = hashmap_make_with_allocator(hash_str, equal_str, equal_str, original);
+  outer = hashmap_merge(hashmap_assoc(outer, "outer", "val"), map, NULL);
+
+  /* the promoted copy outlives the region */
+  Hashmap *promoted = hashmap_promote(map, original);
+  TEST_ASSERT_TRUE(hashmap_equal(map, promoted));
+  region_end(region);
+  TEST_ASSERT_EQUAL_PTR(original, allocator_default());
+
+  TEST_ASSERT_EQUAL_STRING("val", hashmap_get(derived, "derived"));
+  TEST_ASSERT_NULL(hashmap_get(derived, make_test_key(1)));
+  TEST_ASSERT_EQUAL_INT(hashmap_count(str_map), hashmap_count(derived));
+
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(outer));
+  TEST_ASSERT_EQUAL_STRING("val", hashmap_get(outer, "outer"));
+  for (int i = 1; i < TEST_ITERATIONS; i++) {
+    TEST_ASSERT_EQUAL_STRING(make_test_val(i), hashmap_get(outer, make_test_key(i)));
+  }
+
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS - 1, hashmap_count(promoted));
+  TEST_ASSERT_NULL(hashmap_get(promoted, make_test_key(0)));
+  for (int i = 1; i < TEST_ITERATIONS; i++) {
+    TEST_ASSERT_EQUAL_STRING(make_test_val(i), hashmap_get(promoted, make_test_key(i)));
+  }
+
+  /* and can be changed like any other map */
+  promoted = hashmap_assoc(promoted, make_test_key(0), make_test_val(0));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(promoted));
+
+  /* collision nodes are copied too */
+  TEST_ASSERT_TRUE(hashmap_equal(collisions_map, hashmap_promote(collisions_map, original)));
+}
+
+/* maps specialised for string keys and for 64 bit keys and values */
+#define HASH_STR(key) hash_str((void *)(key))
+#define HASH_COLLISION(key) hash_collision((void *)(key))
+#define EQUAL_STR(key1, key2) (strcmp((key1), (key2)) == 0)
+
+static inline hash_t hash_u64(uint64_t key) {
+  return (hash_t)(key ^ (key >> 29) ^ (key >> 47));
+}
+#define EQUAL_U64(key1, key2) ((key1) == (key2))
+
+PERSISTENT_HASHMAP_DECLARE(strmap, const char *, void *, HASH_STR, EQUAL_STR)
+PERSISTENT_HASHMAP_DECLARE(collmap, const char *, int, HASH_COLLISION, EQUAL_STR)
+PERSISTENT_HASHMAP_DECLARE(u64map, uint64_t, uint64_t, hash_u64, EQUAL_U64)
+PERSISTENT_HASHMAP_DECLARE(u32map, uint32_t, uint32_t, hash_u64, EQUAL_U64)
+
+/* test function that sums the values of a u64map */
+void u64_sum_fn(uint64_t key, uint64_t val, void *ctx) {
+  *(uint64_t *)ctx += val;
+}
+
+void test_hashmap_declare(void) {
+
+  /* string keys in the same order as str_map */
+  strmap *map = strmap_make();
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    map = strmap_assoc(map, make_test_key(integers[i]), make_test_val(integers[i]));
+    TEST_ASSERT_EQUAL_INT(i + 1, strmap_count(map));
+  }
+
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    char *key = make_test_key(i);
+    TEST_ASSERT_EQUAL_STRING(make_test_val(i), *strmap_find(map, key));
+    TEST_ASSERT_EQUAL_STRING(hashmap_get(str_map, key), *strmap_find(map, key));
+  }
+  TEST_ASSERT_NULL(strmap_find(map, "missing"));
+
+  /* the same value returns the same map */
+  void *val = *strmap_find(map, make_test_key(5));
+  TEST_ASSERT_EQUAL_PTR(map, strmap_assoc(map, make_test_key(5), val));
+  TEST_ASSERT_EQUAL_PTR(map, strmap_dissoc(map, "missing"));
+
+  /* remove every other key leaving the original unchanged */
+  strmap *removed = map;
+  for (int i = 0; i < TEST_ITERATIONS; i += 2) {
+    removed = strmap_dissoc(removed, make_test_key(i));
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS / 2, strmap_count(removed));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, strmap_count(map));
+
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    TEST_ASSERT_NOT_NULL(strmap_find(map, make_test_key(i)));
+    TEST_ASSERT_EQUAL_INT(i % 2, strmap_find(removed, make_test_key(i)) != NULL);
+  }
+
+  /* keys in collision nodes with values stored unboxed */
+  collmap *collisions = collmap_make();
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+    collisions = collmap_assoc(collisions, make_test_key(i), i);
+  }
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+    collisions = collmap_assoc(collisions, make_test_key(i), i * 2);
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS_COLLISIONS, collmap_count(collisions));
+
+  for (int i = 0; i < TEST_ITERATIONS_COLLISIONS; i++) {
+
+    TEST_ASSERT_EQUAL_INT(i * 2, *collmap_find(collisions, make_test_key(i)));
+    collisions = collmap_dissoc(collisions, make_test_key(i));
+    TEST_ASSERT_NULL(collmap_find(collisions, make_test_key(i)));
+  }
+  TEST_ASSERT_EQUAL_INT(0, collmap_count(collisions));
+
+  /* 64 bit keys and values */
+  u64map *ints = u64map_make();
+  uint64_t expected = 0;
+  for (uint64_t i = 0; i < TEST_ITERATIONS; i++) {
+
+    ints = u64map_assoc(ints, i << 33, i);
+    expected += i;
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, u64map_count(ints));
+
+  uint64_t sum = 0;
+  u64map_visit(ints, u64_sum_fn, &sum);
+  TEST_ASSERT_TRUE(sum == expected);
+
+  for (uint64_t i = 0; i < TEST_ITERATIONS; i++) {
+
+    TEST_ASSERT_TRUE(*u64map_find(ints, i << 33) == i);
+    ints = u64map_dissoc(ints, i << 33);
+  }
+  TEST_ASSERT_EQUAL_INT(0, u64map_count(ints));
+
+  /* entries that don't fill a whole number of pointers */
+  u32map *small = u32map_make();
+  for (uint32_t i = 0; i < TEST_ITERATIONS; i++) { small = u32map_assoc(small, i, i * 3); }
+  for (uint32_t i = 0; i < TEST_ITERATIONS; i += 2) { small = u32map_dissoc(small, i); }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS / 2, u32map_count(small));
+
+  for (uint32_t i = 0; i < TEST_ITERATIONS; i++) {
+    uint32_t *val = u32map_find(small, i);
+    if (i % 2) { TEST_ASSERT_EQUAL_INT(i * 3, *val); }
+    else { TEST_ASSERT_NULL(val); }
+  }
+}
+
+#ifdef PERSISTENT_REFCOUNT
+/* the rest of the tests own their references */
+#undef hashmap_assoc
+#undef hashmap_assoc_with_hash
+#undef hashmap_dissoc
+#undef hashmap_dissoc_with_hash
+#undef hashmap_update
+#endif
+
+void test_hashmap_refcount(void) {
+
+  Counts counts = {0, 0};
+  Allocator counting = {counting_alloc, NULL, counting_free, &counts};
+
+  /* half the keys have one of a few hashes so some are in HashCollisionNodes */
+  Hashmap *map = hashmap_make_with_allocator(hash_str, equal_str, equal_str, &counting);
+  Hashmap *collisions = hashmap_make_with_allocator(hash_collision, equal_str, equal_str, \
+                                                    &counting);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    map = hashmap_assoc(map, make_test_key(i), make_test_val(i));
+    if (i % 2) { collisions = hashmap_assoc(collisions, make_test_key(i), make_test_val(i)); }
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(map));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS / 2, hashmap_count(collisions));
+
+  /* a retained version is left as it is */
+  Hashmap *old = hashmap_retain(map);
+  map = hashmap_assoc(map, make_test_key(0), "changed");
+  map = hashmap_dissoc(map, make_test_key(1));
+  TEST_ASSERT_TRUE(map != old);
+  TEST_ASSERT_EQUAL_STRING("changed", hashmap_get(map, make_test_key(0)));
+  TEST_ASSERT_EQUAL_STRING(make_test_val(0), hashmap_get(old, make_test_key(0)));
+  TEST_ASSERT_EQUAL_STRING(make_test_val(1), hashmap_get(old, make_test_key(1)));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(old));
+
+  /* merging and transients only borrow their maps */
+  Hashmap *merged = hashmap_merge(map, old, NULL);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(merged));
+  TEST_ASSERT_EQUAL_STRING(make_test_val(0), hashmap_get(merged, make_test_key(0)));
+  TEST_ASSERT_EQUAL_STRING(make_test_val(1), hashmap_get(merged, make_test_key(1)));
+  TEST_ASSERT_EQUAL_STRING("changed", hashmap_get(map, make_test_key(0)));
+
+  Hashmap *extra = hashmap_make_with_allocator(hash_str, equal_str, equal_str, &counting);
+  extra = hashmap_assoc(extra, "extra", "val");
+  Hashmap *unchanged = hashmap_merge(merged, old, NULL);
+  Hashmap *added = hashmap_merge(merged, extra, NULL);
+  TEST_ASSERT_EQUAL_PTR(merged, unchanged);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS + 1, hashmap_count(added));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(merged));
+
+  hashmap_release(old);
+  hashmap_release(merged);
+  hashmap_release(unchanged);
+  hashmap_release(added);
+  hashmap_release(extra);
+
+  Hashmap *transient = hashmap_transient(collisions);
+  for (int i = 0; i < TEST_ITERATIONS; i += 2) {
+    transient = hashmap_assoc_mut(transient, make_test_key(i), make_test_val(i));
+  }
+  transient = hashmap_dissoc_mut(transient, make_test_key(1));
+  transient = hashmap_persistent(transient);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS - 1, hashmap_count(transient));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS / 2, hashmap_count(collisions));
+  TEST_ASSERT_EQUAL_STRING(make_test_val(1), hashmap_get(collisions, make_test_key(1)));
+  hashmap_release(transient);
+
+  /* a transient and the version it came from share every node at first,
+     so only the reference counts keep each from changing the other */
+  Hashmap *shared = hashmap_make_with_allocator(hash_str, equal_str, equal_str, &counting);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    shared = hashmap_assoc(shared, make_test_key(i), make_test_val(i));
+  }
+  transient = hashmap_transient(shared);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    transient = hashmap_assoc_mut(transient, make_test_key(i), "transient");
+    if (i % 5 == 0) { transient = hashmap_dissoc_mut(transient, make_test_key(i)); }
+  }
+  for (int i = 1; i < TEST_ITERATIONS; i += 2) {
+    shared = hashmap_assoc(shared, make_test_key(i), "persistent");
+  }
+  transient = hashmap_persistent(transient);
+
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, hashmap_count(shared));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS - (TEST_ITERATIONS + 4) / 5, hashmap_count(transient));
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    char *expected = (i % 2) ? "persistent" : make_test_val(i);
+    TEST_ASSERT_EQUAL_STRING(expected, hashmap_get(shared, make_test_key(i)));
+    if (i % 5 == 0) { TEST_ASSERT_NULL(hashmap_get(transient, make_test_key(i))); }
+    else { TEST_ASSERT_EQUAL_STRING("transient", hashmap_get(transient, make_test_key(i))); }
+  }
+  hashmap_release(shared);
+  hashmap_release(transient);
+
+  /* removing the keys from both kinds of node */
+  for (int i = 0; i < TEST_ITERATIONS; i += 3) {
+
+    map = hashmap_update(map, make_test_key(i), same_fn, NULL);
+    map = hashmap_dissoc(map, make_test_key(i));
+    collisions = hashmap_dissoc(collisions, make_test_key(i));
+    TEST_ASSERT_NULL(hashmap_get(map, make_test_key(i)));
+    TEST_ASSERT_NULL(hashmap_get(collisions, make_test_key(i)));
+  }
+  TEST_ASSERT_EQUAL_STRING(make_test_val(2), hashmap_get(map, make_test_key(2)));
+  TEST_ASSERT_EQUAL_STRING(make_test_val(5), hashmap_get(collisions, make_test_key(5)));
+
+  /* iterators come from the default allocator and are handed back at the
+     end of a walk or when released part way through */
+  Counts iter_counts = {0, 0};
+  Allocator iter_counting = {counting_alloc, NULL, counting_free, &iter_counts};
+  allocator_set_default(&iter_counting);
+
+  int count = 0;
+  for (Iterator *iter = hashmap_iterator_make(collisions); iter; count++) {
+    iter = iterator_next(iterator_next(iter));
+  }
+  TEST_ASSERT_EQUAL_INT(hashmap_count(collisions), count);
+
+  Iterator *iter = hashmap_iterator_make(map);
+  Iterator *saved = iterator_copy(iter);
+  iterator_release(iter);
+  char *key = iterator_value(saved);
+  saved = iterator_next(saved);
+  TEST_ASSERT_EQUAL_PTR(hashmap_get(map, key), iterator_value(saved));
+  iterator_release(saved);
+
+  allocator_set_default(NULL);
+  TEST_ASSERT_TRUE(iter_counts.allocs > 0);
+#ifdef PERSISTENT_REFCOUNT
+  TEST_ASSERT_EQUAL_INT(iter_counts.allocs, iter_counts.frees);
+#endif
+
+  /* loaded versions are released one by one and their array along with
+     the buffer their keys were decoded in. a refused image frees it all */
+  Hashmap *written[2] = {map, hashmap_assoc(hashmap_retain(map), "extra", "val")};
+  char path[] = "/tmp/test_hashmap_XXXXXX";
+  int fd = mkstemp(path);
+  TEST_ASSERT_EQUAL_INT(0, hashmap_serialize_versions(written, 2, fd, &hashmap_str_codec, \
+                                                      &hashmap_str_codec));
+  unlink(path);
+  hashmap_release(written[1]);
+
+  Counts load_counts = {0, 0};
+  Allocator load_counting = {counting_alloc, NULL, counting_free, &load_counts};
+  allocator_set_default(&load_counting);
+
+  int n = 0;
+  lseek(fd, 0, SEEK_SET);
+  Hashmap **loaded = hashmap_load_versions(fd, hash_str, equal_str, equal_str, \
+                                           &hashmap_str_codec, &hashmap_str_codec, &n);
+  TEST_ASSERT_EQUAL_INT(2, n);
+  TEST_ASSERT_EQUAL_STRING("val", hashmap_get(loaded[1], "extra"));
+  TEST_ASSERT_EQUAL_STRING(make_test_val(2), hashmap_get(loaded[0], make_test_key(2)));
+  hashmap_release(loaded[0]);
+  hashmap_release(loaded[1]);
+  hashmap_free_versions(loaded);
+
+  lseek(fd, 0, SEEK_SET);
+  TEST_ASSERT_NULL(hashmap_load_versions(fd, hash_collision, equal_str, equal_str, \
+                                         &hashmap_str_codec, &hashmap_str_codec, &n));
+  close(fd);
+
+  allocator_set_default(NULL);
+  TEST_ASSERT_TRUE(load_counts.allocs > 0);
+#ifdef PERSISTENT_REFCOUNT
+  TEST_ASSERT_EQUAL_INT(load_counts.allocs, load_counts.frees);
+#endif
+
+  /* comparing an entry with a HashCollisionNode of the same hash */
+  Hashmap *single = hashmap_make_with_allocator(hash_constant, equal_str, equal_str, &counting);
+  single = hashmap_assoc(single, make_test_key(0), make_test_val(0));
+  Hashmap *pair = hashmap_assoc(hashmap_retain(single), make_test_key(1), make_test_val(1));
+
+  struct diff_counts diffs = {0, 0, 0};
+  hashmap_diff(single, pair, added_fn, removed_fn, changed_fn, (void **)&diffs);
+  hashmap_diff(pair, single, added_fn, removed_fn, changed_fn, (void **)&diffs);
+  TEST_ASSERT_EQUAL_INT(1, diffs.added);
+  TEST_ASSERT_EQUAL_INT(1, diffs.removed);
+  TEST_ASSERT_EQUAL_INT(0, diffs.changed);
+  hashmap_release(single);
+  hashmap_release(pair);
+
+#ifdef PERSISTENT_REFCOUNT
+  /* a map with a single owner is changed in place */
+  int allocs = counts.allocs;
+  Hashmap *same = hashmap_assoc(map, make_test_key(2), "changed");
+  TEST_ASSERT_EQUAL_PTR(map, same);
+  TEST_ASSERT_EQUAL_INT(allocs, counts.allocs);
+  TEST_ASSERT_EQUAL_STRING("changed", hashmap_get(same, make_test_key(2)));
+
+  /* and everything is handed back once the last references are dropped */
+  hashmap_release(same);
+  hashmap_release(collisions);
+  TEST_ASSERT_EQUAL_INT(counts.allocs, counts.frees);
+#endif
+}
+
+int main(int argc, char **argv) {
+
+  UNITY_BEGIN();
+
+  RUN_TEST(test_hashmap_new);
+  RUN_TEST(test_hashmap_get);
+  RUN_TEST(test_hashmap_count);
+
+  RUN_TEST(test_hashmap_assoc);
+  RUN_TEST(test_hashmap_dissoc);
+
+  RUN_TEST(test_hashmap_with_hash);
+  RUN_TEST(test_hashmap_default_hash);
+  RUN_TEST(test_hashmap_get_many);
+  RUN_TEST(test_hashmap_from_arrays);
+  RUN_TEST(test_hashmap_from_arrays_parallel);
+  RUN_TEST(test_hashmap_merge);
+  RUN_TEST(test_hashmap_equal);
+  RUN_TEST(test_hashmap_diff);
 
   RUN_TEST(test_hashmap_int_keys);
   RUN_TEST(test_hashmap_int_vals);
   RUN_TEST(test_hashmap_collisions);
+  RUN_TEST(test_hashmap_collisions_many);
 
   RUN_TEST(test_hashmap_visit_count);
   RUN_TEST(test_hashmap_visit_list);
+  RUN_TEST(test_hashmap_visit_parallel);
+  RUN_TEST(test_hashmap_reduce);
   RUN_TEST(test_hashmap_iterator);
+  RUN_TEST(test_hashmap_iterator_lazy);
   RUN_TEST(test_hashmap_readme);
+  RUN_TEST(test_hashmap_transient);
+  RUN_TEST(test_hashmap_update);
+  RUN_TEST(test_hashmap_declare);
+  RUN_TEST(test_hashmap_stats);
+  RUN_TEST(test_hashmap_mmap);
+  RUN_TEST(test_hashmap_versions);
+  RUN_TEST(test_hashmap_image_corrupt);
+  RUN_TEST(test_hashmap_allocator);
+  RUN_TEST(test_hashmap_region);
+  RUN_TEST(test_hashmap_refcount);
 
   return UNITY_END();
 }
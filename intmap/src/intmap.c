@@ -0,0 +1,564 @@
+/*
+    Copyright (C) 2020 Duncan Watts
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 3 or later.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "intmap.h"
+
+#define BITS_PER_LEVEL 5
+
+/* indicates if the map changed during the operation */
+#define UNCHANGED 0
+#define ADDED 1
+#define UPDATED 2
+#define REMOVED 3
+
+/*
+   the trie has the same CHAMP layout as the Hashmap but the path to a key
+   is a mix of the key's bits. the mix is a bijection so different keys
+   always have different paths and, unlike the Hashmap, there are no
+   HashCollisionNodes. the mix spreads out keys such as sequential ids or
+   multiples of a large power of two that would otherwise share long
+   prefixes and make the trie deep
+*/
+
+/* Implementation details */
+typedef struct Node Node;
+typedef struct Entry Entry;
+
+/* intmap links to the root node */
+struct Intmap {
+  int count;
+  Node *root;
+
+  /* where the map and its nodes are allocated from */
+  Allocator *alloc;
+};
+
+/* a key/value pair stored inline in a node */
+struct Entry {
+  uint64_t key;
+  void *val;
+};
+
+/* each of the 32 positions holds either an inline entry (set in datamap)
+   or a sub-node (set in nodemap). array holds the entries followed by
+   the sub-nodes, both in bit order, and is allocated with the node */
+struct Node {
+  unsigned int datamap;
+  unsigned int nodemap;
+  void *array[];
+};
+
+/* forward references */
+static Node *new_node(Allocator *alloc, unsigned int datamap, unsigned int nodemap);
+
+static Intmap *new_intmap(Allocator *alloc, Node *root, int count);
+
+static Node *node_assoc(Allocator *alloc, Node *root, uint64_t key, void *val, int *result);
+
+static Node *node_dissoc(Allocator *alloc, Node *root, uint64_t key, int *result);
+
+static void node_visit(Node *node, intmap_visit_fn fn, void **acc);
+
+static void *node_reduce(Node *node, intmap_reduce_fn fn, void *acc, int *reduced);
+
+/* the deepest a trie can be: one level for every BITS_PER_LEVEL bits of the path */
+#define MAX_DEPTH ((64 + BITS_PER_LEVEL - 1) / BITS_PER_LEVEL)
+
+/* count 1's in x efficiently */
+#define popcount(x) __builtin_popcount(x)
+
+/* the path through the trie to key. each step of this mix can be undone
+   so no two keys share a path */
+static inline uint64_t key_path(uint64_t key)
+{
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ull;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebull;
+  key ^= key >> 31;
+
+  return key;
+}
+
+/* select the BITS_PER_LEVEL bits of path for level and
+   return the bit representing the node's position */
+static inline unsigned int bitpos(uint64_t path, int level)
+{
+  return 1u << ((path >> (BITS_PER_LEVEL * level)) & 0x01f);
+}
+
+/* the number of 1's below bit in bitmap */
+static inline int bit_index(unsigned int bitmap, unsigned int bit)
+{
+  return popcount(bitmap & (bit - 1));
+}
+
+/* the inline entries of a node */
+static inline Entry *node_entries(Node *node)
+{
+  return (Entry*)node->array;
+}
+
+/* the sub-nodes of a node follow the entries */
+static inline Node **node_children(Node *node)
+{
+  return (Node**)(node_entries(node) + popcount(node->datamap));
+}
+
+/* external interface */
+Intmap *intmap_make(void)
+{
+  return intmap_make_with_allocator(allocator_default());
+}
+
+Intmap *intmap_make_with_allocator(Allocator *alloc)
+{
+  return new_intmap(alloc, NULL, 0);
+}
+
+Intmap *intmap_assoc(Intmap *map, uint64_t key, void *val)
+{
+  Allocator *alloc = map->alloc;
+
+  /* if there are no entries create a root node holding the entry */
+  if (!map->root) {
+
+    Node *root = new_node(alloc, bitpos(key_path(key), 0), 0);
+    node_entries(root)[0].key = key;
+    node_entries(root)[0].val = val;
+
+    return new_intmap(alloc, root, 1);
+  }
+
+  int result = UNCHANGED;
+  Node *root = node_assoc(alloc, map->root, key, val, &result);
+
+  /* no change */
+  if (result == UNCHANGED) { return map; }
+
+  return new_intmap(alloc, root, map->count + ((result == ADDED) ? 1 : 0));
+}
+
+Intmap *intmap_dissoc(Intmap *map, uint64_t key)
+{
+  Allocator *alloc = map->alloc;
+
+  /* if there are no entries there's nothing to dissoc */
+  if (!map->root) { return map; }
+
+  int result = UNCHANGED;
+  Node *root = node_dissoc(alloc, map->root, key, &result);
+
+  /* no change */
+  if (result == UNCHANGED) { return map; }
+
+  return new_intmap(alloc, root, map->count - 1);
+}
+
+/* the entry for key or NULL if it isn't in map */
+static inline Entry *intmap_find(Intmap *map, uint64_t key)
+{
+  Node *node = map->root;
+  if (!node) { return NULL; }
+
+  uint64_t path = key_path(key);
+
+  /* keep looking down a level until the key's position is found */
+  for (int level = 0; ; level++) {
+
+    unsigned int bit = bitpos(path, level);
+
+    if (node->datamap & bit) {
+      Entry *entry = &node_entries(node)[bit_index(node->datamap, bit)];
+      return (entry->key == key) ? entry : NULL;
+    }
+    /* not found */
+    if (!(node->nodemap & bit)) { return NULL; }
+
+    node = node_children(node)[bit_index(node->nodemap, bit)];
+  }
+}
+
+void *intmap_get(Intmap *map, uint64_t key)
+{
+  Entry *entry = intmap_find(map, key);
+  return entry ? entry->val : NULL;
+}
+
+int intmap_contains(Intmap *map, uint64_t key)
+{
+  return (intmap_find(map, key) != NULL);
+}
+
+int intmap_count(Intmap *map)
+{
+  return map->count;
+}
+
+int intmap_empty(Intmap *map)
+{
+  return (map->count == 0);
+}
+
+void intmap_visit(Intmap *map, intmap_visit_fn fn, void **acc)
+{
+  if (!map->root) { return; }
+  node_visit(map->root, fn, acc);
+}
+
+void *intmap_reduce(Intmap *map, intmap_reduce_fn fn, void *init)
+{
+  int reduced = 0;
+
+  if (!map->root) { return init; }
+  return node_reduce(map->root, fn, init, &reduced);
+}
+
+/* internal implementation */
+
+/* the size of the array holding the entries and sub-nodes */
+static size_t array_size(unsigned int datamap, unsigned int nodemap)
+{
+  return (sizeof(Entry) * popcount(datamap)) + (sizeof(Node*) * popcount(nodemap));
+}
+
+static Node *new_node(Allocator *alloc, unsigned int datamap, unsigned int nodemap)
+{
+  /* a single allocation holds the node and its array */
+  Node *node = allocator_alloc(alloc, sizeof(*node) + array_size(datamap, nodemap));
+  node->datamap = datamap;
+  node->nodemap = nodemap;
+
+  return node;
+}
+
+static Intmap *new_intmap(Allocator *alloc, Node *root, int count)
+{
+  Intmap *map = allocator_alloc(alloc, sizeof(*map));
+  map->alloc = alloc;
+  map->root = root;
+  map->count = count;
+
+  return map;
+}
+
+static Node *copy_node(Allocator *alloc, Node *node)
+{
+  Node *copy = new_node(alloc, node->datamap, node->nodemap);
+  memcpy(copy->array, node->array, array_size(node->datamap, node->nodemap));
+
+  return copy;
+}
+
+/* return a node with the entry at bit added */
+static Node *insert_entry(Allocator *alloc, Node *node, unsigned int bit, uint64_t key, \
+                          void *val)
+{
+  Entry *entries = node_entries(node);
+  int n_entries = popcount(node->datamap);
+  int n_children = popcount(node->nodemap);
+  int idx = bit_index(node->datamap, bit);
+
+  Node *new = new_node(alloc, node->datamap | bit, node->nodemap);
+  Entry *new_entries = node_entries(new);
+
+  /* copy the entries shifting over the ones at >= idx to make room for the new one */
+  memcpy(new_entries, entries, sizeof(Entry) * idx);
+  memcpy(&new_entries[idx + 1], &entries[idx], sizeof(Entry) * (n_entries - idx));
+
+  new_entries[idx].key = key;
+  new_entries[idx].val = val;
+
+  /* the sub-nodes are unchanged */
+  memcpy(node_children(new), node_children(node), sizeof(Node*) * n_children);
+
+  return new;
+}
+
+/* return a node with the entry at bit removed */
+static Node *remove_entry(Allocator *alloc, Node *node, unsigned int bit)
+{
+  Entry *entries = node_entries(node);
+  int n_entries = popcount(node->datamap);
+  int n_children = popcount(node->nodemap);
+  int idx = bit_index(node->datamap, bit);
+
+  Node *new = new_node(alloc, node->datamap & ~bit, node->nodemap);
+  Entry *new_entries = node_entries(new);
+
+  /* copy the entries shifting over the ones at > idx to replace the removed one */
+  memcpy(new_entries, entries, sizeof(Entry) * idx);
+  memcpy(&new_entries[idx], &entries[idx + 1], sizeof(Entry) * (n_entries - idx - 1));
+
+  /* the sub-nodes are unchanged */
+  memcpy(node_children(new), node_children(node), sizeof(Node*) * n_children);
+
+  return new;
+}
+
+/* return a node with the entry at bit replaced by the sub-node child */
+static Node *entry_to_child(Allocator *alloc, Node *node, unsigned int bit, Node *child)
+{
+  Entry *entries = node_entries(node);
+  Node **children = node_children(node);
+  int n_entries = popcount(node->datamap);
+  int n_children = popcount(node->nodemap);
+  int entry_idx = bit_index(node->datamap, bit);
+  int child_idx = bit_index(node->nodemap, bit);
+
+  Node *new = new_node(alloc, node->datamap & ~bit, node->nodemap | bit);
+  Entry *new_entries = node_entries(new);
+  Node **new_children = node_children(new);
+
+  /* copy the entries without the one being pushed down */
+  memcpy(new_entries, entries, sizeof(Entry) * entry_idx);
+  memcpy(&new_entries[entry_idx], &entries[entry_idx + 1], \
+         sizeof(Entry) * (n_entries - entry_idx - 1));
+
+  /* copy the sub-nodes making room for the new one */
+  memcpy(new_children, children, sizeof(Node*) * child_idx);
+  memcpy(&new_children[child_idx + 1], &children[child_idx], \
+         sizeof(Node*) * (n_children - child_idx));
+  new_children[child_idx] = child;
+
+  return new;
+}
+
+/* return a node with the sub-node at bit replaced by the entry */
+static Node *child_to_entry(Allocator *alloc, Node *node, unsigned int bit, Entry *entry)
+{
+  Entry *entries = node_entries(node);
+  Node **children = node_children(node);
+  int n_entries = popcount(node->datamap);
+  int n_children = popcount(node->nodemap);
+  int entry_idx = bit_index(node->datamap, bit);
+  int child_idx = bit_index(node->nodemap, bit);
+
+  Node *new = new_node(alloc, node->datamap | bit, node->nodemap & ~bit);
+  Entry *new_entries = node_entries(new);
+  Node **new_children = node_children(new);
+
+  /* copy the entries making room for the one being pulled up */
+  memcpy(new_entries, entries, sizeof(Entry) * entry_idx);
+  memcpy(&new_entries[entry_idx + 1], &entries[entry_idx], \
+         sizeof(Entry) * (n_entries - entry_idx));
+  new_entries[entry_idx] = *entry;
+
+  /* copy the sub-nodes without the replaced one */
+  memcpy(new_children, children, sizeof(Node*) * child_idx);
+  memcpy(&new_children[child_idx], &children[child_idx + 1], \
+         sizeof(Node*) * (n_children - child_idx - 1));
+
+  return new;
+}
+
+/* create the smallest sub-node at level holding both the entry and the
+   new key/val. the keys are different so their paths part before the
+   bottom of the trie */
+static Node *merge_entries(Allocator *alloc, int level, Entry *entry, uint64_t entry_path, \
+                           uint64_t key, void *val, uint64_t path)
+{
+  unsigned int entry_bit = bitpos(entry_path, level);
+  unsigned int new_bit = bitpos(path, level);
+
+  /* can't put two entries in the same position so push them down a level */
+  if (entry_bit == new_bit) {
+
+    Node *node = new_node(alloc, 0, entry_bit);
+    node_children(node)[0] = merge_entries(alloc, level + 1, entry, entry_path, key, val, path);
+
+    return node;
+  }
+
+  /* otherwise store both entries inline in bit order */
+  Node *node = new_node(alloc, entry_bit | new_bit, 0);
+  Entry *entries = node_entries(node);
+
+  int entry_idx = bit_index(node->datamap, entry_bit);
+  int new_idx = bit_index(node->datamap, new_bit);
+
+  entries[entry_idx] = *entry;
+  entries[new_idx].key = key;
+  entries[new_idx].val = val;
+
+  return node;
+}
+
+static Node *node_assoc(Allocator *alloc, Node *root, uint64_t key, void *val, int *result)
+{
+  /* the nodes walked through on the way down */
+  Node *stack[MAX_DEPTH];
+
+  uint64_t path = key_path(key);
+  Node *node = root;
+  Node *new = NULL;
+  int level = 0;
+
+  *result = UNCHANGED;
+
+  /* walk down through the sub-nodes to the key's position */
+  while (1) {
+
+    unsigned int bit = bitpos(path, level);
+
+    if (node->nodemap & bit) {
+      stack[level++] = node;
+      node = node_children(node)[bit_index(node->nodemap, bit)];
+      continue;
+    }
+
+    /* an empty position so store the new entry inline */
+    if (!(node->datamap & bit)) {
+
+      *result = ADDED;
+      new = insert_entry(alloc, node, bit, key, val);
+      break;
+    }
+
+    int idx = bit_index(node->datamap, bit);
+    Entry *entry = &node_entries(node)[idx];
+
+    /* a different key so push both entries down into a new sub-node */
+    if (entry->key != key) {
+
+      Node *child = merge_entries(alloc, level + 1, entry, key_path(entry->key), key, val, path);
+
+      *result = ADDED;
+      new = entry_to_child(alloc, node, bit, child);
+      break;
+    }
+
+    /* if the key/value pair already exists return the original root */
+    if (entry->val == val) { return root; }
+
+    /* otherwise replace the value */
+    new = copy_node(alloc, node);
+    node_entries(new)[idx].val = val;
+
+    *result = UPDATED;
+    break;
+  }
+
+  /* copy the path back up to the root replacing each changed child */
+  while (level > 0) {
+
+    Node *parent = stack[--level];
+    int idx = bit_index(parent->nodemap, bitpos(path, level));
+
+    Node *copy = copy_node(alloc, parent);
+    node_children(copy)[idx] = new;
+
+    new = copy;
+  }
+  return new;
+}
+
+static Node *node_dissoc(Allocator *alloc, Node *root, uint64_t key, int *result)
+{
+  /* the nodes walked through on the way down */
+  Node *stack[MAX_DEPTH];
+
+  uint64_t path = key_path(key);
+  Node *node = root;
+  Node *new = NULL;
+  int level = 0;
+
+  *result = UNCHANGED;
+
+  /* walk down through the sub-nodes to the key's position */
+  while (1) {
+
+    unsigned int bit = bitpos(path, level);
+
+    if (node->nodemap & bit) {
+      stack[level++] = node;
+      node = node_children(node)[bit_index(node->nodemap, bit)];
+      continue;
+    }
+
+    /* not found */
+    if (!(node->datamap & bit)) { return root; }
+
+    Entry *entry = &node_entries(node)[bit_index(node->datamap, bit)];
+    if (entry->key != key) { return root; }
+
+    *result = REMOVED;
+
+    /* removing the last entry leaves an empty map. sub-nodes always
+       hold at least two keys so this can only be the root */
+    if (!node->nodemap && popcount(node->datamap) == 1) { return NULL; }
+
+    new = remove_entry(alloc, node, bit);
+    break;
+  }
+
+  /* copy the path back up to the root replacing each changed child */
+  while (level > 0) {
+
+    Node *parent = stack[--level];
+    unsigned int bit = bitpos(path, level);
+
+    /* a sub-node left with a single entry is pulled up inline */
+    if (!new->nodemap && popcount(new->datamap) == 1) {
+      new = child_to_entry(alloc, parent, bit, node_entries(new));
+      continue;
+    }
+
+    /* otherwise replace the changed one */
+    Node *copy = copy_node(alloc, parent);
+    node_children(copy)[bit_index(parent->nodemap, bit)] = new;
+
+    new = copy;
+  }
+  return new;
+}
+
+static void node_visit(Node *node, intmap_visit_fn fn, void **acc)
+{
+  Entry *entries = node_entries(node);
+  Node **children = node_children(node);
+
+  int n_entries = popcount(node->datamap);
+  for (int i = 0; i < n_entries; i++) {
+    fn(entries[i].key, entries[i].val, acc);
+  }
+
+  int n_children = popcount(node->nodemap);
+  for (int i = 0; i < n_children; i++) {
+    node_visit(children[i], fn, acc);
+  }
+}
+
+/* the same walk as node_visit but returning as soon as fn sets reduced */
+static void *node_reduce(Node *node, intmap_reduce_fn fn, void *acc, int *reduced)
+{
+  Entry *entries = node_entries(node);
+  Node **children = node_children(node);
+
+  int n_entries = popcount(node->datamap);
+  for (int i = 0; i < n_entries && !*reduced; i++) {
+    acc = fn(acc, entries[i].key, entries[i].val, reduced);
+  }
+
+  int n_children = popcount(node->nodemap);
+  for (int i = 0; i < n_children && !*reduced; i++) {
+    acc = node_reduce(children[i], fn, acc, reduced);
+  }
+  return acc;
+}
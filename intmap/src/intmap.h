@@ -0,0 +1,76 @@
+/*
+    Copyright (C) 2020 Duncan Watts
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 3 or later.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PERSISTENT_INTMAP_H
+#define _PERSISTENT_INTMAP_H
+
+#include <stdint.h>
+
+#include "../../allocator/allocator.h"
+
+/* External Interface */
+
+/*
+   a persistent map from 64 bit integer keys to values. it works like a
+   Hashmap but the keys are stored unboxed and hashed and compared inline,
+   so there are no hash or equality functions to provide and no calls
+   through function pointers
+*/
+
+/* type for Intmaps */
+typedef struct Intmap Intmap;
+
+/* type signature for a function to apply to all key/value pairs */
+typedef void (*intmap_visit_fn)(uint64_t key, void *val, void **result);
+
+/* type signature for a function folding a key/value pair into an accumulator.
+   setting *reduced to 1 stops the fold after this pair */
+typedef void *(*intmap_reduce_fn)(void *acc, uint64_t key, void *val, int *reduced);
+
+/* create a new, empty intmap */
+Intmap *intmap_make(void);
+
+/* create a new, empty intmap allocated from alloc along
+   with every version made from it */
+Intmap *intmap_make_with_allocator(Allocator *alloc);
+
+/* returns an intmap that is the same as map but with key
+   associated with val. values are compared by pointer */
+Intmap *intmap_assoc(Intmap *map, uint64_t key, void *val);
+
+/* returns an intmap that is the same as map but with key
+   (and associated val) removed if it exists */
+Intmap *intmap_dissoc(Intmap *map, uint64_t key);
+
+/* returns the value associated with key if it exists in map or NULL */
+void *intmap_get(Intmap *map, uint64_t key);
+
+/* returns 1 (true) if key is in map or 0 (false) if not */
+int intmap_contains(Intmap *map, uint64_t key);
+
+/* returns the number of key/value pairs in map */
+int intmap_count(Intmap *map);
+
+/* returns 1 (true) if map is empty or 0 (false) if not */
+int intmap_empty(Intmap *map);
+
+/* applies fn to every key/value pair along with acc which accumulates the result */
+void intmap_visit(Intmap *map, intmap_visit_fn fn, void **acc);
+
+/* folds every key/value pair into an accumulator starting from init by
+   calling acc = fn(acc, key, val, &reduced) until fn sets reduced */
+void *intmap_reduce(Intmap *map, intmap_reduce_fn fn, void *init);
+#endif
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef PERSISTENT_REFCOUNT
+/* the reference counted build doesn't link the collector */
+#define GC_MALLOC(size) calloc(1, (size))
+#else
+#include <gc.h>
+#endif
+
+#include "../../Unity/src/unity.h"
+#include "../src/intmap.h"
+
+/* included for time and rand functions */
+#include <time.h>
+#include <stdlib.h>
+
+/* number of items to add to test maps */
+#define TEST_ITERATIONS 10000
+
+/* keys that share long runs of bits */
+#define SPARSE_KEY(i) ((uint64_t)(i) << 40)
+
+void setUp(void) {
+  /* set up global state here */
+}
+
+void tearDown(void) {
+  /* clean up global state here */
+}
+
+/* a random 64 bit key */
+uint64_t rand_key(void) {
+  return ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ (uint64_t)rand();
+}
+
+/* test function that counts the visited pairs */
+void counter_fn(uint64_t key, void *val, void **acc) {
+  (*(uintptr_t *)acc)++;
+}
+
+/* test function that sums the keys */
+void sum_fn(uint64_t key, void *val, void **acc) {
+  *(uint64_t *)acc += key;
+}
+
+/* test function that stops at the key equal to the one in find_key */
+static uint64_t find_key;
+
+void *find_fn(void *acc, uint64_t key, void *val, int *reduced) {
+
+  if (key == find_key) {
+    *reduced = 1;
+    return val;
+  }
+  return acc;
+}
+
+/* tests */
+void test_intmap_make(void) {
+
+  Intmap *map = intmap_make();
+  TEST_ASSERT_NOT_NULL(map);
+  TEST_ASSERT_EQUAL_INT(0, intmap_count(map));
+  TEST_ASSERT_TRUE(intmap_empty(map));
+  TEST_ASSERT_NULL(intmap_get(map, 0));
+  TEST_ASSERT_FALSE(intmap_contains(map, 0));
+
+  /* removing from an empty map does nothing */
+  TEST_ASSERT_EQUAL_PTR(map, intmap_dissoc(map, 0));
+}
+
+void test_intmap_assoc(void) {
+
+  Intmap *map = intmap_make();
+
+  /* sequential, sparse and extreme keys */
+  for (uint64_t i = 1; i <= TEST_ITERATIONS; i++) {
+
+    map = intmap_assoc(map, i, (void *)(uintptr_t)(i + 1));
+    map = intmap_assoc(map, SPARSE_KEY(i), (void *)(uintptr_t)(i + 2));
+    TEST_ASSERT_EQUAL_INT(2 * i, intmap_count(map));
+  }
+  map = intmap_assoc(map, 0, (void *)3);
+  map = intmap_assoc(map, UINT64_MAX, (void *)1);
+  TEST_ASSERT_EQUAL_INT(2 * TEST_ITERATIONS + 2, intmap_count(map));
+
+  for (uint64_t i = 1; i <= TEST_ITERATIONS; i++) {
+
+    TEST_ASSERT_TRUE(intmap_contains(map, i));
+    TEST_ASSERT_EQUAL_PTR((void *)(uintptr_t)(i + 1), intmap_get(map, i));
+    TEST_ASSERT_EQUAL_PTR((void *)(uintptr_t)(i + 2), intmap_get(map, SPARSE_KEY(i)));
+  }
+  TEST_ASSERT_EQUAL_PTR((void *)3, intmap_get(map, 0));
+  TEST_ASSERT_EQUAL_PTR((void *)1, intmap_get(map, UINT64_MAX));
+  TEST_ASSERT_FALSE(intmap_contains(map, TEST_ITERATIONS + 1));
+
+  /* a NULL value is still present */
+  Intmap *nulls = intmap_assoc(intmap_make(), 7, NULL);
+  TEST_ASSERT_TRUE(intmap_contains(nulls, 7));
+  TEST_ASSERT_EQUAL_INT(1, intmap_count(nulls));
+
+  /* the same value returns the same map */
+  TEST_ASSERT_EQUAL_PTR(map, intmap_assoc(map, 5, (void *)6));
+
+  /* a new value leaves the original unchanged */
+  Intmap *updated = intmap_assoc(map, 5, (void *)99);
+  TEST_ASSERT_EQUAL_INT(intmap_count(map), intmap_count(updated));
+  TEST_ASSERT_EQUAL_PTR((void *)99, intmap_get(updated, 5));
+  TEST_ASSERT_EQUAL_PTR((void *)6, intmap_get(map, 5));
+}
+
+void test_intmap_dissoc(void) {
+
+  Intmap *map = intmap_make();
+  uint64_t *keys = GC_MALLOC(sizeof(uint64_t) * TEST_ITERATIONS);
+
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    keys[i] = (i % 2) ? rand_key() : SPARSE_KEY(i);
+    map = intmap_assoc(map, keys[i], (void *)(uintptr_t)keys[i]);
+  }
+  Intmap *original = map;
+  int count = intmap_count(map);
+
+  /* removing a missing key returns the same map */
+  TEST_ASSERT_EQUAL_PTR(map, intmap_dissoc(map, 1));
+
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    if (!intmap_contains(map, keys[i])) { continue; }
+
+    map = intmap_dissoc(map, keys[i]);
+    TEST_ASSERT_EQUAL_INT(--count, intmap_count(map));
+    TEST_ASSERT_FALSE(intmap_contains(map, keys[i]));
+
+    /* the rest are still there */
+    if (i % 100 == 0) {
+      for (int j = i + 1; j < TEST_ITERATIONS; j++) {
+        TEST_ASSERT_EQUAL_PTR((void *)(uintptr_t)keys[j], intmap_get(map, keys[j]));
+      }
+    }
+  }
+  TEST_ASSERT_TRUE(intmap_empty(map));
+
+  /* the original is unaffected */
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    TEST_ASSERT_EQUAL_PTR((void *)(uintptr_t)keys[i], intmap_get(original, keys[i]));
+  }
+}
+
+void test_intmap_visit(void) {
+
+  Intmap *map = intmap_make();
+  uint64_t expected = 0;
+
+  for (uint64_t i = 1; i <= TEST_ITERATIONS; i++) {
+
+    map = intmap_assoc(map, SPARSE_KEY(i), (void *)(uintptr_t)i);
+    expected += SPARSE_KEY(i);
+  }
+
+  uintptr_t count = 0;
+  intmap_visit(map, counter_fn, (void **)&count);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, count);
+
+  uint64_t sum = 0;
+  intmap_visit(map, sum_fn, (void **)&sum);
+  TEST_ASSERT_TRUE(expected == sum);
+
+  /* reduce stops at the key being looked for */
+  for (uint64_t i = 1; i <= TEST_ITERATIONS; i += 97) {
+
+    find_key = SPARSE_KEY(i);
+    TEST_ASSERT_EQUAL_PTR((void *)(uintptr_t)i, intmap_reduce(map, find_fn, NULL));
+  }
+  find_key = 0;
+  TEST_ASSERT_NULL(intmap_reduce(map, find_fn, NULL));
+  TEST_ASSERT_EQUAL_PTR((void *)5, intmap_reduce(intmap_make(), find_fn, (void *)5));
+}
+
+/* compare random updates against a plain array */
+void test_intmap_random(void) {
+
+  int n_keys = 1000;
+  void **ref = GC_MALLOC(sizeof(void *) * n_keys);
+  Intmap *map = intmap_make();
+  int count = 0;
+
+  for (int i = 0; i < TEST_ITERATIONS * 10; i++) {
+
+    int k = rand() % n_keys;
+    void *val = (void *)(uintptr_t)(1 + rand() % 3);
+
+    if (rand() % 3) {
+      count += ref[k] ? 0 : 1;
+      ref[k] = val;
+      map = intmap_assoc(map, SPARSE_KEY(k) | k, val);
+    } else {
+      count -= ref[k] ? 1 : 0;
+      ref[k] = NULL;
+      map = intmap_dissoc(map, SPARSE_KEY(k) | k);
+    }
+    TEST_ASSERT_EQUAL_INT(count, intmap_count(map));
+  }
+
+  for (int k = 0; k < n_keys; k++) {
+    TEST_ASSERT_EQUAL_PTR(ref[k], intmap_get(map, SPARSE_KEY(k) | k));
+  }
+}
+
+/* an allocator that counts its allocations */
+void *counting_alloc(void *ctx, size_t size) {
+
+  (*(int *)ctx)++;
+  return GC_MALLOC(size);
+}
+
+void test_intmap_allocator(void) {
+
+  int allocs = 0;
+  Allocator counting = {counting_alloc, NULL, NULL, &allocs};
+
+  Intmap *map = intmap_make_with_allocator(&counting);
+  TEST_ASSERT_EQUAL_INT(1, allocs);
+
+  for (uint64_t i = 0; i < TEST_ITERATIONS; i++) {
+
+    int before = allocs;
+    map = intmap_assoc(map, SPARSE_KEY(i), (void *)(uintptr_t)(i + 1));
+    TEST_ASSERT_TRUE(allocs > before);
+  }
+  int before = allocs;
+  map = intmap_dissoc(map, SPARSE_KEY(1));
+  TEST_ASSERT_TRUE(allocs > before);
+
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS - 1, intmap_count(map));
+  TEST_ASSERT_EQUAL_PTR((void *)3, intmap_get(map, SPARSE_KEY(2)));
+
+  /* maps made without one don't use it */
+  before = allocs;
+  intmap_assoc(intmap_make(), 1, (void *)1);
+  TEST_ASSERT_EQUAL_INT(before, allocs);
+}
+
+int main(int argc, char **argv) {
+
+  UNITY_BEGIN();
+
+  RUN_TEST(test_intmap_make);
+  RUN_TEST(test_intmap_assoc);
+  RUN_TEST(test_intmap_dissoc);
+  RUN_TEST(test_intmap_visit);
+  RUN_TEST(test_intmap_random);
+  RUN_TEST(test_intmap_allocator);
+
+  return UNITY_END();
+}
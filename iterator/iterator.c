@@ -1,7 +1,8 @@
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
-#include <gc.h>
 #include "iterator.h"
+#include "../allocator/allocator.h"
 
 inline Iterator *iterator_next(Iterator *iter) {
   assert(iter != NULL);
@@ -16,11 +17,35 @@ inline void *iterator_value(Iterator *iter) {
 inline Iterator *iterator_copy(Iterator *iter) {
   assert(iter != NULL);
 
-  Iterator *new = GC_MALLOC(sizeof(*new));
-  new->next_fn = iter->next_fn;
-  new->current = iter->current;
-  new->value = iter->value;
-  new->data = iter->data;
+  Iterator *new = allocator_alloc(iter->alloc, iter->size);
+  memcpy(new, iter, iter->size);
 
   return new;
 }
+
+void iterator_release(Iterator *iter) {
+#ifdef PERSISTENT_REFCOUNT
+  if (iter) { allocator_free(iter->alloc, iter); }
+#endif
+}
+
+Iterator *iterator_alloc(size_t size) {
+  assert(size >= sizeof(Iterator));
+
+  Allocator *alloc = allocator_default();
+  Iterator *iter = allocator_alloc(alloc, size);
+  iter->size = size;
+  iter->alloc = alloc;
+
+  return iter;
+}
+
+Iterator *iterator_step(Iterator *iter) {
+  assert(iter != NULL);
+
+#ifdef PERSISTENT_REFCOUNT
+  return iter;
+#else
+  return iterator_copy(iter);
+#endif
+}
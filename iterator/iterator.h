@@ -1,6 +1,8 @@
 #ifndef _MAL_ITERATOR_H
 #define _MAL_ITERATOR_H
 
+#include <stddef.h>
+
 typedef struct Iterator_s Iterator;
 
 /* a function that takes an Iterator* and returns
@@ -16,6 +18,12 @@ struct Iterator_s {
   void *current;
   /* a place to store anything needed between calls to next (optional) */
   void *data;
+  /* the bytes allocated for the iterator, which can be followed by the
+     state of the walk so that a copy doesn't share it */
+  size_t size;
+  /* the default allocator when the iterator was made, which its copies
+     come from too */
+  struct Allocator *alloc;
 };
 
 /*
@@ -23,10 +31,24 @@ struct Iterator_s {
    each collection must provide:
    a) a constructor function for the first element and
    b) a function that takes an iterator and returns the next (returns NULL at the end)
+
+   built with -DPERSISTENT_REFCOUNT iterator_next takes over the iterator
+   passed to it, advancing it in place and freeing it at the end. keep a
+   position with iterator_copy and drop an unfinished iterator with
+   iterator_release. in the normal build earlier iterators stay valid and
+   iterator_release does nothing
 */
 
 /* public interface */
 Iterator *iterator_next(Iterator *iter);
 void *iterator_value(Iterator *iter);
 Iterator *iterator_copy(Iterator *iter);
+void iterator_release(Iterator *iter);
+
+/* for collections: a new iterator of size bytes, at least sizeof(Iterator) */
+Iterator *iterator_alloc(size_t size);
+
+/* for collections: the iterator a next function fills in with the next
+   position. a copy of iter, or iter itself in the reference counted build */
+Iterator *iterator_step(Iterator *iter);
 #endif
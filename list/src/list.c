@@ -14,9 +14,9 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <gc.h>
 #include <assert.h>
 #include "list.h"
+#include "../../allocator/allocator.h"
 
 /* create a new 1 element list. note an empty list is just NULL */
 List *list_make(void *data)
@@ -33,7 +33,7 @@ int list_empty(List *lst)
 /* return a list with an element added at the head */
 List *list_cons(List *lst, void *val)
 {
-  pair *head = GC_malloc(sizeof(*head));
+  pair *head = allocator_alloc(allocator_default(), sizeof(*head));
   head->data = val;
   head->next = lst;
 
@@ -198,9 +198,12 @@ static Iterator *list_next_fn(Iterator *iter)
   current = current->next;
 
   /* check for end of the list */
-  if (!current) { return NULL; }
+  if (!current) {
+    iterator_release(iter);
+    return NULL;
+  }
 
-  Iterator *new = iterator_copy(iter);
+  Iterator *new = iterator_step(iter);
 
   /* set the next pair */
   new->current = current;
@@ -217,7 +220,7 @@ Iterator *list_iterator_make(List *lst)
   if (!lst) { return NULL; }
 
   /* create an iterator */
-  Iterator *iter = GC_MALLOC(sizeof(*iter));
+  Iterator *iter = iterator_alloc(sizeof(*iter));
 
   /* install the next function for a list */
   iter->next_fn = list_next_fn;
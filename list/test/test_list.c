@@ -1,7 +1,12 @@
 #include <string.h>
 #include "../../Unity/src/unity.h"
 #include "../src/list.h"
+#ifdef PERSISTENT_REFCOUNT
+/* the reference counted build doesn't link the collector */
+#define GC_MALLOC(size) calloc(1, (size))
+#else
 #include "gc.h"
+#endif
 
 /* included for time and rand functions */
 #include <time.h>
@@ -17,8 +17,6 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
-#include <gc.h>
-
 #include "vector.h"
 
 #define BITS 5
@@ -26,6 +24,11 @@
 #define MASK (WIDTH - 1)
 
 typedef struct Node {
+#ifdef PERSISTENT_REFCOUNT
+  /* the number of vectors and nodes referring to this one */
+  unsigned int refs;
+#endif
+
   /* a Node either holds child nodes or data elements */
   union {
     struct Node *children[WIDTH];
@@ -41,44 +44,125 @@ struct Vector_s {
   /* the tail is filled before being appended as a child node */
   Node *tail;
   int tail_count;
+
+  /* where the vector and its nodes are allocated from */
+  Allocator *alloc;
+
+#ifdef PERSISTENT_REFCOUNT
+  unsigned int refs;
+#endif
 };
 
 /* forward declarations */
-static Node *node_new(void);
-static Node *node_copy(Node *node);
+static Node *node_new(Allocator *alloc);
+static Node *node_copy(Allocator *alloc, Node *node, int level);
+static Node *node_edit(Allocator *alloc, Node *node, int level);
+static Vector *vector_edit(Vector *vec);
 static Node *pop_from_head(Vector *vec, Node *node, int level, int idx);
 static void vector_append_tail(Vector *vec);
 static void vector_pop_from_head(Vector *vec);
+static Node *leaf_for(Vector *vec, int idx);
+static Node *promote_node(Allocator *alloc, Node *node, int level);
 
 /* internal functions */
-static Node *node_new(void)
+#ifdef PERSISTENT_REFCOUNT
+
+static inline int node_shared(Node *node)
 {
-  return GC_MALLOC(sizeof(Node));
+  return __atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) > 1;
 }
 
-static Node *node_copy(Node *node)
+static inline Node *node_retain(Node *node)
 {
-  Node *new = GC_MALLOC(sizeof(Node));
+  __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+  return node;
+}
+
+/* drop a reference to node at level, freeing it along with its
+   references to its children if it was the last */
+static void node_release(Allocator *alloc, Node *node, int level)
+{
+  if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+
+  for (int i = 0; level > 0 && i < WIDTH; i++) {
+    if (node->children[i]) { node_release(alloc, node->children[i], level - BITS); }
+  }
+  allocator_free(alloc, node);
+}
+
+#else
+
+/* without reference counts every node may be part of another
+   version and the collector frees the nodes */
+static inline int node_shared(Node *node) { return 1; }
+
+static inline Node *node_retain(Node *node) { return node; }
+
+static inline void node_release(Allocator *alloc, Node *node, int level) {}
+
+#endif
+
+static Node *node_new(Allocator *alloc)
+{
+  Node *node = allocator_alloc(alloc, sizeof(Node));
+#ifdef PERSISTENT_REFCOUNT
+  node->refs = 1;
+#endif
+
+  return node;
+}
+
+/* copy node at level. the children of a node above the leaves
+   are shared with the copy */
+static Node *node_copy(Allocator *alloc, Node *node, int level)
+{
+  Node *new = node_new(alloc);
   memcpy(new->children, node->children, sizeof(Node*) * WIDTH);
 
+  for (int i = 0; level > 0 && i < WIDTH; i++) {
+    if (new->children[i]) { node_retain(new->children[i]); }
+  }
+
   return new;
 }
 
-static Vector *vector_copy(Vector *vec)
+/* return node, or a copy of it in place of the caller's reference, that
+   can be changed without changing any other version of the vector */
+static Node *node_edit(Allocator *alloc, Node *node, int level)
+{
+  if (!node_shared(node)) { return node; }
+
+  Node *copy = node_copy(alloc, node, level);
+  node_release(alloc, node, level);
+
+  return copy;
+}
+
+/* return vec, or a copy of it in place of the caller's reference, that
+   can be changed. the nodes of a copy are shared until they're edited */
+static Vector *vector_edit(Vector *vec)
 {
-  Vector *copy = GC_MALLOC(sizeof(Vector));
+#ifdef PERSISTENT_REFCOUNT
+  if (__atomic_load_n(&vec->refs, __ATOMIC_ACQUIRE) == 1) { return vec; }
+#endif
+
+  Vector *copy = allocator_alloc(vec->alloc, sizeof(Vector));
+  memcpy(copy, vec, sizeof(Vector));
+#ifdef PERSISTENT_REFCOUNT
+  copy->refs = 1;
+#endif
 
-  copy->levels = vec->levels;
-  copy->count = vec->count;
-  copy->tail_count = vec->tail_count;
-  copy->head = node_copy(vec->head);
-  copy->tail = vec->tail;
+  node_retain(copy->head);
+  node_retain(copy->tail);
+  vector_release(vec);
 
   return copy;
 }
 
 static void vector_append_tail(Vector *vec)
 {
+  Allocator *alloc = vec->alloc;
+
   /* The number of elements that can be stored
      without adding a new level */
   int capacity = (1 << (BITS * (vec->levels + 1)));
@@ -86,13 +170,16 @@ static void vector_append_tail(Vector *vec)
   /* if the tree is full, add a level */
   if(vec->count == capacity) {
 
-    Node *new_root = node_new();
+    Node *new_root = node_new(alloc);
     new_root->children[0] = vec->head;
     vec->head = new_root;
     vec->levels++;
   }
+  else {
+    vec->head = node_edit(alloc, vec->head, (BITS * vec->levels));
+  }
 
-  /* loop down the levels */
+  /* loop down the levels copying the path to the new leaf */
   int idx = vec->count - vec->tail_count;
   Node *cur = NULL;
   Node *prev = vec->head;
@@ -109,14 +196,17 @@ static void vector_append_tail(Vector *vec)
     }
     /* if there is a NULL node create a new one */
     if(!cur) {
-      prev->children[index] = node_new();
-      cur = prev->children[index];
+      cur = node_new(alloc);
     }
+    else {
+      cur = node_edit(alloc, cur, level - BITS);
+    }
+    prev->children[index] = cur;
     prev = cur;
   }
 
   /* add a new tail */
-  vec->tail = node_new();
+  vec->tail = node_new(alloc);
   vec->tail_count = 0;
 
   return;
@@ -124,18 +214,29 @@ static void vector_append_tail(Vector *vec)
 
 static void vector_pop_from_head(Vector *vec)
 {
+  Allocator *alloc = vec->alloc;
+  int level = BITS * vec->levels;
+
+  /* the empty tail is replaced */
+  node_release(alloc, vec->tail, 0);
+
   /* pop the last element (vec->count - 1) from the head node */
-  vec->head = pop_from_head(vec, vec->head, (BITS * vec->levels), vec->count - 1);
+  vec->head = pop_from_head(vec, node_edit(alloc, vec->head, level), level, vec->count - 1);
 
   /* if the head only has a single child (and there is more than one level)
      then it is redundant so get rid of it and decrese the number of levels by one */
   if (!vec->head->children[1] && vec->levels > 1) {
-    vec->head = vec->head->children[0];
+
+    Node *child = node_retain(vec->head->children[0]);
+    node_release(alloc, vec->head, level);
+
+    vec->head = child;
     vec->levels--;
   }
   return;
 }
 
+/* node can be changed and is replaced by the returned node */
 static Node *pop_from_head(Vector *vec, Node *node, int level, int idx)
 {
   int index = (idx >> level) & MASK;
@@ -149,6 +250,7 @@ static Node *pop_from_head(Vector *vec, Node *node, int level, int idx)
     /* if the node is empty (and we have more than one level
        in the tree) return NULL instead of an empty node */
     if (!node->children[0] && vec->levels > 1) {
+      node_release(vec->alloc, node, level);
       node = NULL;
     }
     return node;
@@ -156,33 +258,106 @@ static Node *pop_from_head(Vector *vec, Node *node, int level, int idx)
   } /* if not at the bottom of the tree call pop_from_head on the next level down
      and assign the returned tree to the right child node */
   else {
-    node->children[index] = pop_from_head(vec, node->children[index], level - BITS, idx);
+    Node *child = node_edit(vec->alloc, node->children[index], level - BITS);
+    node->children[index] = pop_from_head(vec, child, level - BITS, idx);
 
     /* if the node is empty return NULL instead of an empty node */
     if (!node->children[0]) {
+      node_release(vec->alloc, node, level);
       node = NULL;
     }
     return node;
   }
 }
 
+/* return the leaf node in the head holding the element at idx */
+static Node *leaf_for(Vector *vec, int idx)
+{
+  Node *node = vec->head;
+
+  /* loop down the levels */
+  for(int level = (BITS * vec->levels); level > 0; level -= BITS) {
+    node = node->children[(idx >> level) & MASK];
+  }
+  return node;
+}
+
+/* copy node and every node below it, where the leaves are at level 0 */
+static Node *promote_node(Allocator *alloc, Node *node, int level)
+{
+  /* copied as a leaf as the children are replaced by their copies */
+  Node *new = node_copy(alloc, node, 0);
+  if (level == 0) { return new; }
+
+  for (int i = 0; i < WIDTH; i++) {
+    if (node->children[i]) {
+      new->children[i] = promote_node(alloc, node->children[i], level - BITS);
+    }
+  }
+
+  return new;
+}
+
 /* external API */
 Vector *vector_make(void)
 {
-  Vector *vec = GC_MALLOC(sizeof(Vector));
+  return vector_make_with_allocator(allocator_default());
+}
+
+Vector *vector_make_with_allocator(Allocator *alloc)
+{
+  Vector *vec = allocator_alloc(alloc, sizeof(Vector));
+  vec->alloc = alloc;
+#ifdef PERSISTENT_REFCOUNT
+  vec->refs = 1;
+#endif
 
   /* start with one empty level */
-  vec->head = node_new();
+  vec->head = node_new(alloc);
   vec->levels = 1;
 
   /* start with an empty tail */
-  vec->tail = node_new();
+  vec->tail = node_new(alloc);
   vec->tail_count = 0;
 
   vec->count = 0;
   return vec;
 }
 
+Vector *vector_promote(Vector *vec, Allocator *alloc)
+{
+  Vector *new = allocator_alloc(alloc, sizeof(Vector));
+  memcpy(new, vec, sizeof(Vector));
+#ifdef PERSISTENT_REFCOUNT
+  new->refs = 1;
+#endif
+
+  new->alloc = alloc;
+  new->head = promote_node(alloc, vec->head, BITS * vec->levels);
+  new->tail = node_copy(alloc, vec->tail, 0);
+
+  return new;
+}
+
+Vector *vector_retain(Vector *vec)
+{
+#ifdef PERSISTENT_REFCOUNT
+  __atomic_add_fetch(&vec->refs, 1, __ATOMIC_RELAXED);
+#endif
+  return vec;
+}
+
+void vector_release(Vector *vec)
+{
+#ifdef PERSISTENT_REFCOUNT
+  if (__atomic_sub_fetch(&vec->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+
+  node_release(vec->alloc, vec->head, BITS * vec->levels);
+  node_release(vec->alloc, vec->tail, 0);
+  allocator_free(vec->alloc, vec);
+#endif
+}
+
 int vector_count(Vector *vec)
 {
   return vec->count;
@@ -195,19 +370,23 @@ int vector_empty(Vector *vec)
 
 Vector *vector_push(Vector *vec, void *data)
 {
-  Vector *copy = vector_copy(vec);
+  Vector *new = vector_edit(vec);
 
-  /* if the tail is full, append it to the head */
-  if (copy->tail_count == WIDTH) {
-    vector_append_tail(copy);
+  /* if the tail is full, append it to the head and start a new one,
+     otherwise copy it unless it can be changed in place */
+  if (new->tail_count == WIDTH) {
+    vector_append_tail(new);
+  }
+  else {
+    new->tail = node_edit(new->alloc, new->tail, 0);
   }
 
   /* add the new item to the tail */
-  copy->tail->elements[copy->tail_count] = data;
-  copy->count++;
-  copy->tail_count++;
+  new->tail->elements[new->tail_count] = data;
+  new->count++;
+  new->tail_count++;
 
-  return copy;
+  return new;
 }
 
 Vector *vector_pop(Vector *vec)
@@ -215,20 +394,21 @@ Vector *vector_pop(Vector *vec)
   /* check the vector isn't empty */
   if (vec->count == 0) { return vec; }
 
-  Vector *copy = vector_copy(vec);
+  Vector *new = vector_edit(vec);
 
   /* if the tail is empty move the last node
      from the head up to the tail */
-  if (copy->tail_count == 0) {
-    vector_pop_from_head(copy);
+  if (new->tail_count == 0) {
+    vector_pop_from_head(new);
   }
+  new->tail = node_edit(new->alloc, new->tail, 0);
 
   /* remove the item from the tail */
-  copy->tail->elements[copy->tail_count - 1] = NULL;
-  copy->count--;
-  copy->tail_count--;
+  new->tail->elements[new->tail_count - 1] = NULL;
+  new->count--;
+  new->tail_count--;
 
-  return copy;
+  return new;
 }
 
 void *vector_get(Vector *vec, int idx)
@@ -238,21 +418,13 @@ void *vector_get(Vector *vec, int idx)
     return NULL;
   }
 
-  Node *next = NULL;
-  Node *prev = vec->head;
-
   /* if idx is in the tail */
   int tail_offset = vec->count - vec->tail_count;
   if (idx >= tail_offset) {
     return vec->tail->elements[idx - tail_offset];
   }
   else {
-    /* loop down the levels */
-    for(int level = (BITS * vec->levels); level > 0; level -= BITS) {
-      next = prev->children[(idx >> level) & MASK];
-      prev = next;
-    }
-    return prev->elements[idx & MASK];
+    return leaf_for(vec, idx)->elements[idx & MASK];
   }
 }
 
@@ -263,28 +435,54 @@ Vector *vector_set(Vector *vec, int idx, void *data)
     return vec;
   }
 
-  /* copy the root node */
-  Vector *copy = vector_copy(vec);
+  Vector *new = vector_edit(vec);
+  Allocator *alloc = new->alloc;
 
   /* if idx is in the tail, copy and update the tail */
-  int tail_offset = vec->count - vec->tail_count;
+  int tail_offset = new->count - new->tail_count;
   if (idx >= tail_offset) {
-      copy->tail = node_copy(vec->tail);
-      copy->tail->elements[idx - tail_offset] = data;
-      return copy;
+    new->tail = node_edit(alloc, new->tail, 0);
+    new->tail->elements[idx - tail_offset] = data;
+    return new;
   }
-  else {
-    /* loop down the levels */
-    Node *cur = NULL;
-    Node *prev = copy->head;
 
-    for(int level = (BITS * vec->levels); level > 0; level -= BITS) {
-      cur = prev->children[(idx >> level) & MASK];
-      prev = cur;
+  /* otherwise copy the path down to the leaf */
+  Node **slot = &new->head;
+
+  for(int level = (BITS * new->levels); level > 0; level -= BITS) {
+    *slot = node_edit(alloc, *slot, level);
+    slot = &(*slot)->children[(idx >> level) & MASK];
+  }
+  *slot = node_edit(alloc, *slot, 0);
+  (*slot)->elements[idx & MASK] = data;
+
+  return new;
+}
+
+void *vector_reduce(Vector *vec, reduce_fn fn, void *init)
+{
+  void *acc = init;
+  int reduced = 0;
+
+  /* the full leaves in the head a node at a time */
+  int tail_offset = vec->count - vec->tail_count;
+  for (int idx = 0; idx < tail_offset; idx += WIDTH) {
+
+    Node *leaf = leaf_for(vec, idx);
+    for (int i = 0; i < WIDTH; i++) {
+
+      acc = fn(acc, leaf->elements[i], &reduced);
+      if (reduced) { return acc; }
     }
-    cur->elements[idx & MASK] = data;
-    return copy;
   }
+
+  /* then the tail */
+  for (int i = 0; i < vec->tail_count; i++) {
+
+    acc = fn(acc, vec->tail->elements[i], &reduced);
+    if (reduced) { return acc; }
+  }
+  return acc;
 }
 
 static Iterator *vector_next_fn(Iterator *iter)
@@ -292,12 +490,15 @@ static Iterator *vector_next_fn(Iterator *iter)
   assert(iter);
 
   Vector *vec = iter->data;
-  uintptr_t idx = (uintptr_t)++iter->current;
+  uintptr_t idx = (uintptr_t)iter->current + 1;
 
   /* check for end of the array */
-  if (idx == vec->count) { return NULL; }
+  if (idx == vec->count) {
+    iterator_release(iter);
+    return NULL;
+  }
 
-  Iterator *new = iterator_copy(iter);
+  Iterator *new = iterator_step(iter);
 
   /* increment the current pointer */
   new->current = (void *)idx;
@@ -316,7 +517,7 @@ Iterator *vector_iterator_make(Vector *vec)
   if (vector_empty(vec)) { return NULL; }
 
   /* create an iterator */
-  Iterator *iter = GC_MALLOC(sizeof(*iter));
+  Iterator *iter = iterator_alloc(sizeof(*iter));
 
   /* install the next function for a vector */
   iter->next_fn = vector_next_fn;
@@ -18,6 +18,7 @@
 #define _PERSISTENT_VECTOR_H
 
 #include "../../iterator/iterator.h"
+#include "../../allocator/allocator.h"
 
 /* external interface */
 
@@ -26,6 +27,28 @@ typedef struct Vector_s Vector;
 /* create a new vector */
 Vector *vector_make(void);
 
+/* create a new vector allocated from alloc along with
+   every version made from it */
+Vector *vector_make_with_allocator(Allocator *alloc);
+
+/* returns a copy of vec with every node allocated from alloc, e.g.
+   &allocator_gc, so it can outlive the Region vec was made in. the
+   elements themselves aren't copied */
+Vector *vector_promote(Vector *vec, Allocator *alloc);
+
+/* built with -DPERSISTENT_REFCOUNT vectors and their nodes are freed by
+   reference counts. every function returning a vector returns a reference
+   owned by the caller. vector_push, vector_pop and vector_set take over the
+   reference passed to them and change the vector in place while it and the
+   nodes they touch have a single owner. in the normal build these do nothing */
+
+/* adds a reference to vec and returns it */
+Vector *vector_retain(Vector *vec);
+
+/* drops a reference to vec, freeing it along with
+   any nodes no other vector uses if it was the last */
+void vector_release(Vector *vec);
+
 /* returns the number of elements in the vector */
 int vector_count(Vector* vec);
 
@@ -47,6 +70,14 @@ Vector *vector_set(Vector *vec, int idx, void *data);
 /* return an iterator */
 Iterator *vector_iterator_make(Vector *vec);
 
+/* type signature for a function folding an element into an accumulator.
+   setting *reduced to 1 stops the fold after this element */
+typedef void *(*reduce_fn)(void *acc, void *val, int *reduced);
+
+/* folds every element in order into an accumulator starting from init
+   by calling acc = fn(acc, val, &reduced). returns the final acc */
+void *vector_reduce(Vector *vec, reduce_fn fn, void *init);
+
 /* type signature for generic equality function */
 typedef int (*equal_fn)(void*, void*);
 #endif
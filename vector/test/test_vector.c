@@ -1,6 +1,20 @@
 #include "../../Unity/src/unity.h"
 #include "../src/vector.h"
+
+#ifdef PERSISTENT_REFCOUNT
+/* the reference counted build takes over the vector passed to these but
+   the tests keep using the old versions, so they hold on to their own reference */
+#define vector_push(vec, data) vector_push(vector_retain(vec), data)
+#define vector_pop(vec) vector_pop(vector_retain(vec))
+#define vector_set(vec, idx, data) vector_set(vector_retain(vec), idx, data)
+#endif
+#ifdef PERSISTENT_REFCOUNT
+/* the reference counted build doesn't link the collector */
+#define GC_MALLOC(size) calloc(1, (size))
+#else
 #include <gc.h>
+#endif
+#include <stdint.h>
 
 /* included for time and rand functions */
 #include <time.h>
@@ -132,6 +146,42 @@ void test_vector_set(void) {
   }
 }
 
+/* versions made from the same one don't change it or each other */
+void test_vector_persistence(void) {
+
+  Vector *vec = vector_make();
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    vec = vector_push(vec, (void *)make_test_str(i));
+  }
+
+  Vector *a = vector_push(vec, "a");
+  Vector *b = vector_push(vec, "b");
+  Vector *set = vector_set(vec, 1, "set");
+  Vector *set_tail = vector_set(vec, TEST_ITERATIONS - 1, "set");
+
+  /* popping back through the head and pushing into it again */
+  Vector *popped = vec;
+  for (int i = 0; i < 100; i++) { popped = vector_pop(popped); }
+  Vector *refilled = popped;
+  for (int i = 0; i < 100; i++) { refilled = vector_push(refilled, "refilled"); }
+
+  TEST_ASSERT_EQUAL_STRING("a", (char*)vector_get(a, TEST_ITERATIONS));
+  TEST_ASSERT_EQUAL_STRING("b", (char*)vector_get(b, TEST_ITERATIONS));
+  TEST_ASSERT_EQUAL_STRING("set", (char*)vector_get(set, 1));
+  TEST_ASSERT_EQUAL_STRING(make_test_str(1), (char*)vector_get(set_tail, 1));
+  TEST_ASSERT_EQUAL_STRING("set", (char*)vector_get(set_tail, TEST_ITERATIONS - 1));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS - 100, vector_count(popped));
+  TEST_ASSERT_EQUAL_STRING("refilled", (char*)vector_get(refilled, TEST_ITERATIONS - 1));
+
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, vector_count(vec));
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    TEST_ASSERT_EQUAL_STRING(make_test_str(i), (char*)vector_get(vec, i));
+    if (i < TEST_ITERATIONS - 100) {
+      TEST_ASSERT_EQUAL_STRING(make_test_str(i), (char*)vector_get(refilled, i));
+    }
+  }
+}
+
 void test_vector_empty(void) {
 
   /* test empty vector */
@@ -191,6 +241,122 @@ void test_vector_iterator(void) {
   TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, i);
 }
 
+/* test function that counts the elements and stops after stop_at */
+static uintptr_t stop_at;
+
+void *count_fn(void *acc, void *val, int *reduced) {
+
+  uintptr_t count = (uintptr_t)acc + 1;
+  if (count == stop_at) { *reduced = 1; }
+  return (void *)count;
+}
+
+/* test function that checks the elements are in order */
+void *in_order_fn(void *acc, void *val, int *reduced) {
+
+  uintptr_t i = (uintptr_t)acc;
+  TEST_ASSERT_EQUAL_STRING(make_test_str(i), (char*)val);
+  return (void *)(i + 1);
+}
+
+void test_vector_reduce(void) {
+
+  Vector *vec = vector_make();
+
+  /* no elements */
+  stop_at = 0;
+  TEST_ASSERT_EQUAL_PTR((void *)5, vector_reduce(vec, count_fn, (void *)5));
+
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    vec = vector_push(vec, (void *)make_test_str(i));
+  }
+
+  /* every element in order */
+  uintptr_t n = (uintptr_t)vector_reduce(vec, in_order_fn, (void *)0);
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, n);
+
+  /* stopping part way through the head and in the tail */
+  uintptr_t stops[] = {1, 31, 32, 33, 1000, TEST_ITERATIONS - 1};
+  for (int i = 0; i < sizeof(stops) / sizeof(stops[0]); i++) {
+
+    stop_at = stops[i];
+    TEST_ASSERT_EQUAL_INT(stops[i], (uintptr_t)vector_reduce(vec, count_fn, (void *)0));
+  }
+}
+
+/* an allocator that counts its allocations */
+void *counting_alloc(void *ctx, size_t size) {
+
+  (*(int *)ctx)++;
+  return GC_MALLOC(size);
+}
+
+/* and counts its frees after the allocations */
+void counting_free(void *ctx, void *ptr) {
+
+  ((int *)ctx)[1]++;
+#ifdef PERSISTENT_REFCOUNT
+  free(ptr);
+#endif
+}
+
+void test_vector_allocator(void) {
+
+  int allocs = 0;
+  Allocator counting = {counting_alloc, NULL, NULL, &allocs};
+
+  Vector *vec = vector_make_with_allocator(&counting);
+  TEST_ASSERT_TRUE(allocs > 0);
+
+  /* pushes, sets and pops all allocate from it */
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+
+    int before = allocs;
+    vec = vector_push(vec, (void *)make_test_str(i));
+    TEST_ASSERT_TRUE(allocs > before);
+  }
+  int before = allocs;
+  vec = vector_set(vec, 0, "set");
+  vec = vector_pop(vec);
+  TEST_ASSERT_TRUE(allocs > before);
+
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS - 1, vector_count(vec));
+  TEST_ASSERT_EQUAL_STRING("set", (char*)vector_get(vec, 0));
+
+  /* vectors made without one don't use it */
+  before = allocs;
+  vector_push(vector_make(), "val");
+  TEST_ASSERT_EQUAL_INT(before, allocs);
+}
+
+void test_vector_region(void) {
+
+  Allocator *original = allocator_default();
+  Region *region = region_begin();
+
+  Vector *vec = vector_make();
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    vec = vector_push(vec, (void *)make_test_str(i));
+  }
+  vec = vector_set(vec, 1, "set");
+  vec = vector_pop(vec);
+  TEST_ASSERT_TRUE(region_size(region) > 0);
+
+  /* the promoted copy outlives the region */
+  Vector *promoted = vector_promote(vec, original);
+  region_end(region);
+
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS - 1, vector_count(promoted));
+  TEST_ASSERT_EQUAL_STRING("set", (char*)vector_get(promoted, 1));
+  for (int i = 2; i < TEST_ITERATIONS - 1; i++) {
+    TEST_ASSERT_EQUAL_STRING(make_test_str(i), (char*)vector_get(promoted, i));
+  }
+
+  /* and can be changed like any other vector */
+  promoted = vector_push(promoted, "pushed");
+  TEST_ASSERT_EQUAL_STRING("pushed", (char*)vector_get(promoted, TEST_ITERATIONS - 1));
+}
+
 void test_vector_readme(void)
 {
   Vector *v = vector_make();
@@ -237,6 +403,92 @@ void test_vector_readme(void)
   TEST_ASSERT_EQUAL_STRING("item1", item1);
 }
 
+#ifdef PERSISTENT_REFCOUNT
+/* the rest of the tests own their references */
+#undef vector_push
+#undef vector_pop
+#undef vector_set
+#endif
+
+void test_vector_refcount(void) {
+
+  int counts[2] = {0, 0};
+  Allocator counting = {counting_alloc, NULL, counting_free, counts};
+
+  Vector *vec = vector_make_with_allocator(&counting);
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    vec = vector_push(vec, (void *)make_test_str(i));
+  }
+
+  /* versions branching from a retained one don't change it or each other */
+  Vector *old = vector_retain(vec);
+  Vector *a = vector_push(vector_retain(old), "a");
+  Vector *b = vector_push(vector_retain(old), "b");
+  Vector *set = vector_set(vector_retain(old), 1, "set");
+  Vector *set_tail = vector_set(vector_retain(old), TEST_ITERATIONS - 1, "set");
+  Vector *popped = vector_retain(old);
+  for (int i = 0; i < 100; i++) { popped = vector_pop(popped); }
+
+  TEST_ASSERT_EQUAL_STRING("a", (char*)vector_get(a, TEST_ITERATIONS));
+  TEST_ASSERT_EQUAL_STRING("b", (char*)vector_get(b, TEST_ITERATIONS));
+  TEST_ASSERT_EQUAL_STRING("set", (char*)vector_get(set, 1));
+  TEST_ASSERT_EQUAL_STRING("set", (char*)vector_get(set_tail, TEST_ITERATIONS - 1));
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS - 100, vector_count(popped));
+
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, vector_count(old));
+  for (int i = 0; i < TEST_ITERATIONS; i++) {
+    TEST_ASSERT_EQUAL_STRING(make_test_str(i), (char*)vector_get(old, i));
+  }
+
+  /* iterators come from the default allocator and are handed back at the
+     end of a walk or when released part way through */
+  int iter_counts[2] = {0, 0};
+  Allocator iter_counting = {counting_alloc, NULL, counting_free, iter_counts};
+  allocator_set_default(&iter_counting);
+
+  int count = 0;
+  for (Iterator *iter = vector_iterator_make(old); iter; count++) {
+    TEST_ASSERT_EQUAL_STRING(make_test_str(count), (char*)iterator_value(iter));
+    iter = iterator_next(iter);
+  }
+  TEST_ASSERT_EQUAL_INT(TEST_ITERATIONS, count);
+
+  Iterator *iter = iterator_next(vector_iterator_make(a));
+  Iterator *saved = iterator_copy(iter);
+  iterator_release(iter);
+  saved = iterator_next(saved);
+  TEST_ASSERT_EQUAL_STRING(make_test_str(2), (char*)iterator_value(saved));
+  iterator_release(saved);
+
+  allocator_set_default(NULL);
+  TEST_ASSERT_TRUE(iter_counts[0] > 0);
+#ifdef PERSISTENT_REFCOUNT
+  TEST_ASSERT_EQUAL_INT(iter_counts[0], iter_counts[1]);
+#endif
+
+  vector_release(a);
+  vector_release(b);
+  vector_release(set);
+  vector_release(set_tail);
+  vector_release(popped);
+  vector_release(old);
+
+#ifdef PERSISTENT_REFCOUNT
+  /* a vector with a single owner is changed in place */
+  int allocs = counts[0];
+  Vector *same = vector_set(vec, 5, "set");
+  same = vector_push(same, "pushed");
+  same = vector_pop(same);
+  TEST_ASSERT_EQUAL_PTR(vec, same);
+  TEST_ASSERT_EQUAL_INT(allocs, counts[0]);
+  TEST_ASSERT_EQUAL_STRING("set", (char*)vector_get(same, 5));
+
+  /* and everything is handed back once the last reference is dropped */
+  vector_release(same);
+  TEST_ASSERT_EQUAL_INT(counts[0], counts[1]);
+#endif
+}
+
 /* run tests */
 int main(void)
 {
@@ -247,9 +499,14 @@ int main(void)
   RUN_TEST(test_vector_pop);
   RUN_TEST(test_vector_get);
   RUN_TEST(test_vector_set);
+  RUN_TEST(test_vector_persistence);
   RUN_TEST(test_vector_empty);
   RUN_TEST(test_vector_count);
   RUN_TEST(test_vector_iterator);
+  RUN_TEST(test_vector_reduce);
+  RUN_TEST(test_vector_allocator);
+  RUN_TEST(test_vector_region);
+  RUN_TEST(test_vector_refcount);
   RUN_TEST(test_vector_readme);
 
   return UNITY_END();